@@ -1,4 +1,18 @@
 #include <exception>
+#include <iostream>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "config.h"
+#include "ae.h"
+using namespace std;
+
+/* Flag of eventloop->readymask[]: the fd is in eventloop->ready[]. It is
+kept when the events of the fd are deleted, so that an fd marked ready,
+deleted, created and marked again is not queued twice. */
+#define AE_READY_QUEUED 16
 
 /* Include the best multiplexing layer supported by this system.
 The following should be ordered by performances in descending order.*/
@@ -7,7 +21,7 @@ The following should be ordered by performances in descending order.*/
 #include "ae_evport.c"
 #else
 	#ifdef HAVE_EPOLL
-	#include "ae_epoll.c"
+	#include "ae_epoll.cpp"
 	#else
 		#ifdef HAVE_KQUEUE
 		#include "ae_kqueue.c"
@@ -17,22 +31,175 @@ The following should be ordered by performances in descending order.*/
 	#endif
 #endif
 
-aeEventLoop aeCreateEventLoop(int setsize)
+/* io_uring is only built next to epoll, which stays the fallback for
+kernels that lack it. Since the choice is made at startup, calls into the
+multiplexing layer go through the aeBackend* dispatchers below. */
+#ifdef HAVE_IO_URING
+#include "ae_iouring.cpp"
+#endif
+
+static int aeBackendCreate(aeEventLoop& eventloop, int api)
+{
+#ifdef HAVE_IO_URING
+	if (api == AE_API_IOURING && aeIouringCreate(eventloop) == 0)
+	{
+		eventloop.api = AE_API_IOURING;
+		return 0;
+	}
+#endif
+	eventloop.api = AE_API_DEFAULT;
+	return aeApiCreate(eventloop);
+}
+
+static int aeBackendAddEvent(aeEventLoop *eventloop, int fd, int mask)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+		return aeIouringAddEvent(eventloop, fd, mask);
+#endif
+	return aeApiAddEvent(eventloop, fd, mask);
+}
+
+static void aeBackendDelEvent(aeEventLoop *eventloop, int fd, int mask)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+	{
+		aeIouringDelEvent(eventloop, fd, mask);
+		return;
+	}
+#endif
+	aeApiDelEvent(eventloop, fd, mask);
+}
+
+static int aeBackendResize(aeEventLoop *eventloop, int setsize)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+		return aeIouringResize(eventloop, setsize);
+#endif
+	return aeApiResize(eventloop, setsize);
+}
+
+static int aeBackendPoll(aeEventLoop *eventloop, struct timeval *tvp)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+		return aeIouringPoll(eventloop, tvp);
+#endif
+	return aeApiPoll(eventloop, tvp);
+}
+
+/* Milliseconds from a monotonic clock: the timing wheel must never see
+the time going backward, even if the system clock is adjusted. */
+static long long aeMonotonicMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long aeMonotonicUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Resize the per fd array '*ptr' of 'elemsize' bytes elements from
+'oldsize' to 'setsize' elements, zeroing the new ones. realloc() extends
+the block in place when it can, so growing a large table is not a copy
+most of the time. On failure '*ptr' is left untouched and -1 is returned. */
+static int aeResizeArray(void **ptr, size_t elemsize, int oldsize, int setsize)
+{
+	void *p = realloc(*ptr, elemsize * setsize);
+
+	if (p == NULL)
+		return -1;
+	if (setsize > oldsize)
+		memset((char*)p + elemsize * oldsize, 0, elemsize * (setsize - oldsize));
+	*ptr = p;
+	return 0;
+}
+
+/* Free the per fd arrays of the loop, see aeResizeArray(). */
+static void aeFreeArrays(aeEventLoop& eventloop)
+{
+	free(eventloop.masks);
+	free(eventloop.rfileProcs);
+	free(eventloop.wfileProcs);
+	free(eventloop.clientData);
+	free(eventloop.fired);
+	free(eventloop.ready);
+	free(eventloop.readymask);
+}
+
+/* Grow (or shrink) every per fd array of the loop to 'setsize' entries.
+Arrays that were already resized keep their new size if a later one
+fails: they are only ever indexed below eventloop->setsize. */
+static int aeResizeArrays(aeEventLoop& eventloop, int oldsize, int setsize)
+{
+	if (aeResizeArray((void**)&eventloop.masks, sizeof(unsigned char), oldsize, setsize) == -1 ||
+		aeResizeArray((void**)&eventloop.rfileProcs, sizeof(aeFileProc*), oldsize, setsize) == -1 ||
+		aeResizeArray((void**)&eventloop.wfileProcs, sizeof(aeFileProc*), oldsize, setsize) == -1 ||
+		aeResizeArray((void**)&eventloop.clientData, sizeof(void*), oldsize, setsize) == -1 ||
+		aeResizeArray((void**)&eventloop.ready, sizeof(int), oldsize, setsize) == -1 ||
+		aeResizeArray((void**)&eventloop.readymask, sizeof(int), oldsize, setsize) == -1)
+		return -1;
+	/* The fired events of the current iteration may still be dispatched
+	when a handler shrinks the loop: that array never shrinks. */
+	if (setsize > oldsize &&
+		aeResizeArray((void**)&eventloop.fired, sizeof(aeFiredEvent), oldsize, setsize) == -1)
+		return -1;
+	return 0;
+}
+
+/* Initialize 'eventloop' so that it can track up to 'setsize' file
+descriptors. The loop is filled in place because server.el keeps its loops
+by value: every thread of the multi-threaded mode owns one of them.
+'api' is the preferred multiplexing backend (AE_API_*). If it can't be
+used the default one is selected, check eventloop.api to know which.
+Returns AE_OK on success, AE_ERR if the multiplexing layer could not be
+initialized. */
+int aeCreateEventLoop(aeEventLoop& eventloop, int setsize, int api)
 {
 	try
 	{
-		aeEventLoop eventloop;
-		eventloop.events = new aeFileEvent[setsize];
-		eventloop.fired = new aeFiredEvent[setsize];
+		eventloop.masks = NULL;
+		eventloop.rfileProcs = eventloop.wfileProcs = NULL;
+		eventloop.clientData = NULL;
+		eventloop.fired = NULL;
+		eventloop.ready = eventloop.readymask = NULL;
+		/* Events with mask == AE_NONE are not set: the arrays are
+		zeroed, which is AE_NONE. */
+		if (aeResizeArrays(eventloop, 0, setsize) == -1)
+		{
+			aeFreeArrays(eventloop);
+			return AE_ERR;
+		}
 		eventloop.setsize = setsize;
+		eventloop.maxfd = -1;
+		eventloop.timeEventNextId = 0;
 		eventloop.lastTime = time(NULL);
-		eventLoop.stop = 0;
-		aeApiCreate(eventloop);
-		/* Events with mask == AE_NONE are not set. So let's initialize the 
-		vector with it. */
-		for (int i = 0; i < setize; ++i)
-			eventloop->events[i].mask = AE_NONE;
-		return eventloop;
+		eventloop.stop = 0;
+		eventloop.timers = new twWheel();
+		twInit(eventloop.timers, aeMonotonicMs());
+		eventloop.timeEvents = new unordered_map<long long, aeTimeEvent*>();
+		eventloop.runningTimeEvent = NULL;
+		eventloop.nready = 0;
+		eventloop.drainBudget = AE_DEFAULT_DRAIN_BUDGET;
+		eventloop.busyPollUs = 0;
+		eventloop.lastEventUs = 0;
+		eventloop.beforesleep = NULL;
+		eventloop.stats = NULL;
+		if (aeBackendCreate(eventloop, api) == -1)
+		{
+			aeFreeArrays(eventloop);
+			delete eventloop.timers;
+			delete eventloop.timeEvents;
+			return AE_ERR;
+		}
+		return AE_OK;
 	}
 	catch(exception& e)
 	{
@@ -42,30 +209,546 @@ aeEventLoop aeCreateEventLoop(int setsize)
 	{
 		cout << "aeCreateEventLoop new operation failed.\n";
 	}
-	return NULL;
+	return AE_ERR;
+}
+
+void aeStop(aeEventLoop *eventloop)
+{
+	eventloop->stop = 1;
+}
+
+/* Return the current set size. */
+int aeGetSetSize(aeEventLoop *eventloop)
+{
+	return eventloop->setsize;
 }
 
+/* Resize the maximum set size of the event loop, so that a larger
+maxclients does not need a new loop. Every per fd array, including the
+ones of the multiplexing layer, is resized in place.
+If the requested set size is smaller than the current set size, but
+there is already a file descriptor in use that is >= the requested set
+size minus one, AE_ERR is returned and the operation is not performed at
+all. Otherwise AE_OK is returned and the operation is successful. */
+int aeResizeSetSize(aeEventLoop *eventloop, int setsize)
+{
+	if (setsize == eventloop->setsize)
+		return AE_OK;
+	if (eventloop->maxfd >= setsize)
+		return AE_ERR;
+	if (setsize > eventloop->setsize)
+	{
+		/* The multiplexing layer first: if the loop arrays then fail to
+		grow, the entries it gained are just never used. */
+		if (aeBackendResize(eventloop, setsize) == -1 ||
+			aeResizeArrays(*eventloop, eventloop->setsize, setsize) == -1)
+			return AE_ERR;
+	}
+	else
+	{
+		/* The fds deleted while ready are still queued, drop the ones
+		that are going away. */
+		int kept = 0;
+		for (int j = 0; j < eventloop->nready; j++)
+			if (eventloop->ready[j] < setsize)
+				eventloop->ready[kept++] = eventloop->ready[j];
+		eventloop->nready = kept;
+
+		/* A realloc() that fails to shrink a block leaves it as it was,
+		larger than needed: whatever fails, every array can hold the new
+		set size, which is used in any case. */
+		aeResizeArrays(*eventloop, eventloop->setsize, setsize);
+		aeBackendResize(eventloop, setsize);
+	}
+	eventloop->setsize = setsize;
+	return AE_OK;
+}
 
 int aeCreateFileEvent(aeEventLoop *eventloop, int fd, int mask,
 	aeFileProc * proc, void * clientData)
 {
-	if (fd >= eventLoop->setsize)
+	if (fd >= eventloop->setsize)
 	{
 		errno = ERANGE;
 		return AE_ERR;
 	}
-	aeFileEvent *fe = &eventloop->events[fd];
-
-	if (aeApiAddEvent(eventloop, fd, mask) == -1)
+	if (aeBackendAddEvent(eventloop, fd, mask) == -1)
 		return AE_ERR;
-	fe->mask |= mask;
+	eventloop->masks[fd] |= mask;
 	if (mask & AE_READABLE)
-		fe->rfileProc = proc;
+		eventloop->rfileProcs[fd] = proc;
 	if (mask & AE_WRITABLE)
-		fe->wfileProc = proc;
-	fe->clientData = clientData;
+		eventloop->wfileProcs[fd] = proc;
+	eventloop->clientData[fd] = clientData;
 	if (fd > eventloop->maxfd)
 		eventloop->maxfd = fd;
 	return AE_OK;
- 
+
+}
+
+void aeDeleteFileEvent(aeEventLoop *eventloop, int fd, int mask)
+{
+	if (fd >= eventloop->setsize)
+		return;
+	int fdmask = eventloop->masks[fd];
+	if (fdmask == AE_NONE)
+		return;
+
+	/* We want to always remove AE_BARRIER if set when AE_WRITABLE
+	is removed. */
+	if (mask & AE_WRITABLE)
+		mask |= AE_BARRIER;
+
+	aeBackendDelEvent(eventloop, fd, mask);
+	fdmask &= ~mask;
+	/* AE_EDGE alone is not an event. */
+	if (!(fdmask & (AE_READABLE|AE_WRITABLE)))
+		fdmask = AE_NONE;
+	eventloop->masks[fd] = fdmask;
+	eventloop->readymask[fd] &= fdmask | AE_READY_QUEUED;
+	if (fd == eventloop->maxfd && fdmask == AE_NONE)
+	{
+		/* Update the max fd, scanning the masks only. */
+		int j;
+
+		for (j = eventloop->maxfd - 1; j >= 0; j--)
+			if (eventloop->masks[j] != AE_NONE)
+				break;
+		eventloop->maxfd = j;
+	}
+}
+
+int aeGetFileEvents(aeEventLoop *eventloop, int fd)
+{
+	if (fd >= eventloop->setsize)
+		return 0;
+	return eventloop->masks[fd];
+}
+
+/* Edge triggered events
+
+An AE_EDGE file event is registered with EPOLLET, so the kernel reports
+it once when the fd becomes ready instead of at every epoll_wait() while
+data is pending. With tens of thousands of busy clients this means far
+fewer wakeups and result entries, but the handler must now consume the
+socket until EAGAIN or it will never hear about the fd again.
+
+To keep a client with a lot of pending data from starving the others,
+the handler moves at most aeGetDrainBudget() bytes, then calls
+aeMarkReady(): the event is fired again in the next iteration, as if the
+kernel reported it, after every other ready fd got its turn. */
+void aeMarkReady(aeEventLoop *eventloop, int fd, int mask)
+{
+	if (fd >= eventloop->setsize)
+		return;
+	mask &= eventloop->masks[fd] & (AE_READABLE|AE_WRITABLE);
+	if (mask == AE_NONE)
+		return;
+	if (!(eventloop->readymask[fd] & AE_READY_QUEUED))
+		eventloop->ready[eventloop->nready++] = fd;
+	eventloop->readymask[fd] |= mask | AE_READY_QUEUED;
+}
+
+void aeSetDrainBudget(aeEventLoop *eventloop, size_t bytes)
+{
+	eventloop->drainBudget = bytes;
+}
+
+size_t aeGetDrainBudget(aeEventLoop *eventloop)
+{
+	return eventloop->drainBudget;
+}
+
+/* Add the events requeued by aeMarkReady() to the 'numevents' events
+just returned by the multiplexing layer, merging the masks when the
+same fd fired again. The ready list is emptied first, so the handlers
+running in this iteration requeue for the next one.
+Returns the new number of fired events. */
+static int aeMergeReady(aeEventLoop *eventloop, int numevents)
+{
+	int nready = eventloop->nready;
+
+	if (nready == 0)
+		return numevents;
+	eventloop->nready = 0;
+	for (int j = 0; j < numevents; j++)
+	{
+		int fd = eventloop->fired[j].fd;
+		eventloop->fired[j].mask |= eventloop->readymask[fd] & ~AE_READY_QUEUED;
+		eventloop->readymask[fd] &= AE_READY_QUEUED;
+	}
+	for (int j = 0; j < nready; j++)
+	{
+		int fd = eventloop->ready[j];
+		int mask = eventloop->readymask[fd] & ~AE_READY_QUEUED;
+
+		eventloop->readymask[fd] = AE_NONE;
+		if (mask == AE_NONE)
+			continue; /* Fired again, or deleted meanwhile. */
+		eventloop->fired[numevents].fd = fd;
+		eventloop->fired[numevents].mask = mask;
+		numevents++;
+	}
+	return numevents;
+}
+
+/* Busy polling
+
+Sleeping in the multiplexing layer and being woken up by the interrupt
+of the next packet costs tens of microseconds. When a busy poll window is
+set, the loop keeps polling with a zero timeout for up to 'usecs'
+microseconds after the last fired event, and blocks again only when
+nothing happened for that long: traffic that comes in bursts is served
+without ever sleeping. This burns a core, so it is meant for loops running
+on dedicated CPUs. Combine it with SO_BUSY_POLL on the client sockets (see
+anetSetBusyPoll()) to make the kernel poll the NIC queue as well. */
+void aeSetBusyPoll(aeEventLoop *eventloop, long long usecs)
+{
+	eventloop->busyPollUs = usecs;
+}
+
+/* Latency instrumentation
+
+When enabled, every iteration records the time blocked in the
+multiplexing layer, the number of fired events, the time of every file
+event handler, of the time events and of the before sleep proc, so that
+a latency spike can be attributed to the kernel, to a handler or to the
+before sleep work. Handlers running longer than the slow threshold are
+logged with their address and fd. The cost when disabled is one pointer
+test per handler call. */
+static void aeHistAdd(aeHistogram *h, unsigned long long value)
+{
+	int b = value ? 64 - __builtin_clzll(value) : 0;
+
+	if (b >= AE_HIST_BUCKETS)
+		b = AE_HIST_BUCKETS - 1;
+	h->buckets[b]++;
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void aeEnableLoopStats(aeEventLoop *eventloop, long long slowThresholdUs)
+{
+	if (eventloop->stats == NULL)
+		eventloop->stats = new aeLoopStats();
+	eventloop->stats->slowThresholdUs = slowThresholdUs;
+}
+
+void aeDisableLoopStats(aeEventLoop *eventloop)
+{
+	delete eventloop->stats;
+	eventloop->stats = NULL;
+}
+
+/* Return the stats of the loop, or NULL if they are not enabled. The
+structure is owned by the loop thread: other threads reading it get
+counters that may be slightly inconsistent among them. */
+const aeLoopStats *aeGetLoopStats(aeEventLoop *eventloop)
+{
+	return eventloop->stats;
+}
+
+/* Call a file event handler, timing it when the stats are enabled.
+Returns the time taken in microseconds, 0 if not measured. */
+static long long aeCallFileProc(aeEventLoop *eventloop, aeFileProc *proc,
+	int fd, void *clientData, int mask)
+{
+	aeLoopStats *stats = eventloop->stats;
+	long long start, us;
+
+	if (stats == NULL)
+	{
+		proc(eventloop, fd, clientData, mask);
+		return 0;
+	}
+	start = aeMonotonicUs();
+	proc(eventloop, fd, clientData, mask);
+	us = aeMonotonicUs() - start;
+	aeHistAdd(&stats->handler, us);
+	if (us > stats->slowThresholdUs)
+	{
+		aeSlowHandler *sh = &stats->slowlog[stats->slowCount % AE_SLOWLOG_LEN];
+		sh->proc = (void*)proc;
+		sh->fd = fd;
+		sh->us = us;
+		sh->when = start;
+		stats->slowCount++;
+	}
+	return us;
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventloop, aeBeforeSleepProc *beforesleep)
+{
+	eventloop->beforesleep = beforesleep;
+}
+
+/* Time events are kept in a hierarchical timing wheel (see timewheel.h),
+so that creating and deleting them is O(1) no matter how many per-client
+timeouts are registered, and the map by id lets aeDeleteTimeEvent()
+find them. */
+long long aeCreateTimeEvent(aeEventLoop *eventloop, long long milliseconds,
+	aeTimeProc *proc, void *clientData, aeEventFinalizerProc *finalizerProc)
+{
+	long long id = eventloop->timeEventNextId++;
+	aeTimeEvent *te = new aeTimeEvent();
+
+	te->id = id;
+	te->timer.when = aeMonotonicMs() + milliseconds;
+	te->timer.head = NULL;
+	te->timeProc = proc;
+	te->finalizerProc = finalizerProc;
+	te->clientData = clientData;
+	twAdd(eventloop->timers, &te->timer);
+	(*eventloop->timeEvents)[id] = te;
+	return id;
+}
+
+int aeDeleteTimeEvent(aeEventLoop *eventloop, long long id)
+{
+	unordered_map<long long, aeTimeEvent*>::iterator it =
+		eventloop->timeEvents->find(id);
+	aeTimeEvent *te;
+
+	if (it == eventloop->timeEvents->end())
+		return AE_ERR; /* NO event with the specified ID found */
+	te = it->second;
+	eventloop->timeEvents->erase(it);
+	if (te == eventloop->runningTimeEvent)
+	{
+		/* Deleting itself from its own proc: processTimeEvents() frees it
+		as soon as the proc returns. */
+		te->id = AE_DELETED_EVENT_ID;
+		return AE_OK;
+	}
+	twCancel(eventloop->timers, &te->timer);
+	if (te->finalizerProc)
+		te->finalizerProc(eventloop, te->clientData);
+	delete te;
+	return AE_OK;
+}
+
+/* Return the milliseconds the multiplexing layer can sleep before the next
+time event has to be processed, 0 if one is already due, or -1 if there
+are no time events. */
+long long aeNextTimeout(aeEventLoop *eventloop)
+{
+	return twNextTimeout(eventloop->timers, aeMonotonicMs());
+}
+
+/* Process time events */
+static int processTimeEvents(aeEventLoop *eventloop)
+{
+	twTimer expired;
+	int processed = 0;
+
+	twListInit(&expired);
+	twExpire(eventloop->timers, aeMonotonicMs(), &expired);
+	/* Timers rescheduled below are never due before the next iteration,
+	so this loop can't run forever. A proc may delete events that are
+	still in 'expired': twCancel() unlinks them from this list. */
+	while (!twListEmpty(&expired))
+	{
+		aeTimeEvent *te = (aeTimeEvent*)expired.next;
+		long long id = te->id;
+		int retval;
+
+		twCancel(eventloop->timers, &te->timer);
+		eventloop->runningTimeEvent = te;
+		retval = te->timeProc(eventloop, id, te->clientData);
+		eventloop->runningTimeEvent = NULL;
+		processed++;
+		if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID)
+		{
+			te->timer.when = aeMonotonicMs() + retval;
+			twAdd(eventloop->timers, &te->timer);
+			continue;
+		}
+		if (te->id != AE_DELETED_EVENT_ID)
+			eventloop->timeEvents->erase(id);
+		if (te->finalizerProc)
+			te->finalizerProc(eventloop, te->clientData);
+		delete te;
+	}
+	return processed;
+}
+
+/* Process every pending file event, then every pending time event.
+Without special flags the function sleeps until some file event
+fires, or when the next time event occurs (if any).
+
+If flags is 0, the function does nothing and returns.
+if flags has AE_ALL_EVENTS set, all the kind of events are processed.
+if flags has AE_FILE_EVENTS set, file events are processed.
+if flags has AE_TIME_EVENTS set, time events are processed.
+if flags has AE_DONT_WAIT set the function returns ASAP until all
+the events that's possible to process without to wait are processed.
+
+The function returns the number of events processed. */
+int aeProcessEvents(aeEventLoop *eventloop, int flags)
+{
+	int processed = 0, numevents;
+	struct timeval tv, *tvp = NULL;
+	long long handlersUs = 0, start = 0;
+
+	/* Nothing to do? return ASAP */
+	if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS))
+		return 0;
+
+	/* We want to call the multiplexing layer if there are file events to
+	process, or to sleep until the next time event. */
+	if ((flags & AE_FILE_EVENTS) ||
+		((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT)))
+	{
+		long long ms = -1;
+
+		/* Don't sleep if there are requeued edge triggered events, or
+		while we are in the busy poll window. */
+		if (flags & AE_DONT_WAIT || eventloop->nready ||
+			(eventloop->busyPollUs &&
+			 aeMonotonicUs() - eventloop->lastEventUs < eventloop->busyPollUs))
+			ms = 0; /* We want to return ASAP. */
+		else if (flags & AE_TIME_EVENTS)
+			ms = aeNextTimeout(eventloop);
+		if (ms >= 0)
+		{
+			tv.tv_sec = ms / 1000;
+			tv.tv_usec = (ms % 1000) * 1000;
+			tvp = &tv;
+		}
+
+		if (eventloop->stats)
+			start = aeMonotonicUs();
+		numevents = aeBackendPoll(eventloop, tvp);
+		if (eventloop->stats)
+			aeHistAdd(&eventloop->stats->poll, aeMonotonicUs() - start);
+		if (numevents && eventloop->busyPollUs)
+			eventloop->lastEventUs = aeMonotonicUs();
+		numevents = aeMergeReady(eventloop, numevents);
+		if (eventloop->stats)
+			aeHistAdd(&eventloop->stats->fired, numevents);
+		for (int j = 0; j < numevents && (flags & AE_FILE_EVENTS); j++)
+		{
+			int fd = eventloop->fired[j].fd;
+			int mask = eventloop->fired[j].mask;
+			int fired = 0; /* Number of events fired for current fd. */
+
+			/* Normally we execute the readable event first, and the writable
+			event later. This is useful as sometimes we may be able to serve
+			the reply of a query immediately after processing the query.
+
+			However if AE_BARRIER is set in the mask, our application is
+			asking us to do the reverse: never fire the writable event
+			after the readable. In such a case, we invert the calls. */
+			int invert = eventloop->masks[fd] & AE_BARRIER;
+
+			/* Note the "masks[fd] & mask & ..." code, re-read after every
+			call: maybe an already processed event removed an element that
+			fired and we still didn't processed, so we check if the event is
+			still valid. The handlers may also resize the loop, so the arrays
+			are always reached through 'eventloop'. */
+			if (!invert && eventloop->masks[fd] & mask & AE_READABLE)
+			{
+				handlersUs += aeCallFileProc(eventloop, eventloop->rfileProcs[fd], fd,
+					eventloop->clientData[fd], mask);
+				fired++;
+			}
+
+			/* Fire the writable event. */
+			if (eventloop->masks[fd] & mask & AE_WRITABLE)
+			{
+				if (!fired || eventloop->wfileProcs[fd] != eventloop->rfileProcs[fd])
+				{
+					handlersUs += aeCallFileProc(eventloop, eventloop->wfileProcs[fd], fd,
+						eventloop->clientData[fd], mask);
+					fired++;
+				}
+			}
+
+			/* If we have to invert the call, fire the readable event now
+			after the writable one. */
+			if (invert && eventloop->masks[fd] & mask & AE_READABLE)
+			{
+				if (!fired || eventloop->wfileProcs[fd] != eventloop->rfileProcs[fd])
+				{
+					handlersUs += aeCallFileProc(eventloop, eventloop->rfileProcs[fd], fd,
+						eventloop->clientData[fd], mask);
+					fired++;
+				}
+			}
+			processed++;
+		}
+	}
+	if (eventloop->stats && (flags & AE_FILE_EVENTS))
+		aeHistAdd(&eventloop->stats->handlers, handlersUs);
+	/* Check time events */
+	if (flags & AE_TIME_EVENTS)
+	{
+		if (eventloop->stats)
+			start = aeMonotonicUs();
+		processed += processTimeEvents(eventloop);
+		if (eventloop->stats)
+			aeHistAdd(&eventloop->stats->timers, aeMonotonicUs() - start);
+	}
+
+	return processed; /* return the number of processed file/time events */
+}
+
+void aeMain(aeEventLoop *eventloop)
+{
+	eventloop->stop = 0;
+	while (!eventloop->stop)
+	{
+		if (eventloop->beforesleep != NULL)
+		{
+			long long start = eventloop->stats ? aeMonotonicUs() : 0;
+			eventloop->beforesleep(eventloop);
+			if (eventloop->stats)
+				aeHistAdd(&eventloop->stats->beforesleep, aeMonotonicUs() - start);
+		}
+		aeProcessEvents(eventloop, AE_ALL_EVENTS);
+	}
+}
+
+const char *aeGetApiName(aeEventLoop *eventloop)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+		return aeIouringName();
+#endif
+	return aeApiName();
+}
+
+void aeGetPollStats(aeEventLoop *eventloop, aePollStats *stats)
+{
+	stats->ctl_calls = stats->ctl_avoided = 0;
+#ifdef HAVE_IO_URING
+	/* io_uring batches every change with the wait, there is nothing
+	to count. */
+	if (eventloop->api == AE_API_IOURING)
+		return;
+#endif
+	aeApiGetStats(eventloop, stats);
+}
+
+/* Register 'count' fixed buffers of 'size' bytes with the io_uring of the
+loops created from now on, for the networking layer to read and write with
+them. Nothing is done by the other backends. */
+void aeSetFixedBuffers(int count, size_t size)
+{
+#ifdef HAVE_IO_URING
+	aeIouringSetFixedBuffers(count, size);
+#endif
+}
+
+/* Return the fixed buffer 'idx' of the loop, or NULL if the backend in use
+registered no such buffer. */
+struct iovec *aeGetFixedBuffer(aeEventLoop *eventloop, int idx)
+{
+#ifdef HAVE_IO_URING
+	if (eventloop->api == AE_API_IOURING)
+		return aeIouringGetFixedBuffer(eventloop, idx);
+#endif
+	return NULL;
 }
@@ -1,20 +1,179 @@
 /* A simple event-driven programming library. */
 
+#ifndef __AE_H__
+#define __AE_H__
+
+#include <time.h>
+#include <unordered_map>
+#include "timewheel.h"
+
 #define AE_OK 0
 #define AE_ERR -1
 #define AE_NONE 0         /* No events registered. */
 #define AE_READABLE 1
 #define AE_WRITABLE 2
-#define AE_BARRIER 4
+#define AE_BARRIER 4      /* With WRITABLE, never fire the event if the
+                             READABLE event already fired in the same event
+                             loop iteration. */
+#define AE_EDGE 8         /* Edge triggered: the event is reported once when
+                             the fd becomes ready, see aeMarkReady(). */
+
+/* Multiplexing backends that can be selected at startup. */
+#define AE_API_DEFAULT 0  /* Best one available at compile time. */
+#define AE_API_IOURING 1  /* io_uring, falls back to the default when the
+                             kernel lacks it. */
+
+#define AE_FILE_EVENTS 1
+#define AE_TIME_EVENTS 2
+#define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
+#define AE_DONT_WAIT 4
+
+/* Bytes a handler of an AE_EDGE event may move in one loop iteration
+before giving the turn to the other clients, see aeMarkReady(). */
+#define AE_DEFAULT_DRAIN_BUDGET (64 * 1024)
+
+#define AE_NOMORE -1
+#define AE_DELETED_EVENT_ID -1
+
+class aeEventLoop;
+
+/* Types and data structures */
+typedef void aeFileProc(aeEventLoop *eventloop, int fd, void *clientData, int mask);
+
+typedef void aeBeforeSleepProc(aeEventLoop *eventloop);
+typedef int aeTimeProc(aeEventLoop *eventloop, long long id, void *clientData);
+typedef void aeEventFinalizerProc(aeEventLoop *eventloop, void *clientData);
+
+/* Time event structure */
+class aeTimeEvent
+{
+public:
+	twTimer timer; /* Must be the first field: wheel timers are cast back
+	                  to their time event. */
+	long long id;  /* time event identifier. */
+	aeTimeProc *timeProc;
+	aeEventFinalizerProc *finalizerProc;
+	void *clientData;
+};
+
+/* A fired event */
+class aeFiredEvent
+{
+public:
+	int fd;
+	int mask;
+};
+
+/* Counters of the multiplexing layer, see aeGetPollStats(). */
+class aePollStats
+{
+public:
+	long long ctl_calls;   /* Interest set syscalls performed. */
+	long long ctl_avoided; /* Interest set changes collapsed by the changelist. */
+};
+
+/* Latency instrumentation, see aeEnableLoopStats().
+
+Histograms have power of two buckets: bucket 'b' counts the samples in
+the range [2^(b-1), 2^b), bucket 0 the samples equal to 0. Times are in
+microseconds, so the last bucket is for samples of 2^30 us (about 18 minutes)
+and above. */
+#define AE_HIST_BUCKETS 32
+#define AE_SLOWLOG_LEN 16
+
+class aeHistogram
+{
+public:
+	unsigned long long buckets[AE_HIST_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+/* A handler that ran longer than the slow threshold. */
+class aeSlowHandler
+{
+public:
+	void *proc;       /* Address of the rfileProc/wfileProc. */
+	int fd;
+	long long us;     /* Duration. */
+	long long when;   /* Monotonic time in microseconds it started. */
+};
 
+class aeLoopStats
+{
+public:
+	aeHistogram poll;        /* Time blocked in the multiplexing layer. */
+	aeHistogram fired;       /* Events fired per iteration (not a time). */
+	aeHistogram handler;     /* Time of every single rfileProc/wfileProc call. */
+	aeHistogram handlers;    /* Time of all the handlers of an iteration. */
+	aeHistogram timers;      /* Time of the time events of an iteration. */
+	aeHistogram beforesleep; /* Time of the before sleep proc. */
+	long long slowThresholdUs;
+	long long slowCount;     /* Handlers that exceeded the threshold. */
+	aeSlowHandler slowlog[AE_SLOWLOG_LEN]; /* Last slow handlers, circular. */
+};
 
+/* State of an event based program */
 class aeEventLoop
 {
-	int maxfd;
-	int setsize;
+public:
+	int id;       /* Index of the loop in server.el, 0 is the main thread. */
+	int maxfd;    /* highest file descriptor currently registered */
+	int setsize;  /* max number of file descriptors tracked */
 	long long timeEventNextId;
-	time_t lastTime;
-	aeFiredEvent * e
-	vector<aeFileEvent> events;
-	aeApiState* apidata; /* This is used for polling API specific data */
-}
+	time_t lastTime;      /* Used to detect system clock skew */
+	/* Registered file events, indexed by fd. They are kept as parallel
+	arrays rather than an array of structures: the masks, that are all
+	the multiplexing layer and most of the dispatch read, stay one byte
+	per fd, and a handler pointer is only loaded for the fds that fired. */
+	unsigned char *masks;     /* AE_(READABLE|WRITABLE|BARRIER|EDGE) */
+	aeFileProc **rfileProcs;
+	aeFileProc **wfileProcs;
+	void **clientData;
+	aeFiredEvent *fired;  /* Fired events */
+	twWheel *timers;      /* Time events, by expire time */
+	std::unordered_map<long long, aeTimeEvent*> *timeEvents; /* Time events, by id */
+	aeTimeEvent *runningTimeEvent; /* Time event whose proc is being called */
+	int *ready;           /* fds requeued by aeMarkReady() */
+	int nready;
+	int *readymask;       /* Per fd mask requeued by aeMarkReady() */
+	size_t drainBudget;   /* Bytes per iteration for AE_EDGE handlers */
+	long long busyPollUs; /* Busy poll window, 0 = always block */
+	long long lastEventUs; /* Monotonic time of the last fired event */
+	aeBeforeSleepProc *beforesleep;
+	aeLoopStats *stats;   /* Latency instrumentation, NULL when disabled */
+	int stop;
+	int api;       /* Backend in use, one of AE_API_* */
+	void *apidata; /* This is used for polling API specific data */
+};
+
+/* Prototypes */
+int aeCreateEventLoop(aeEventLoop& eventloop, int setsize, int api);
+void aeStop(aeEventLoop *eventloop);
+int aeGetSetSize(aeEventLoop *eventloop);
+int aeResizeSetSize(aeEventLoop *eventloop, int setsize);
+int aeCreateFileEvent(aeEventLoop *eventloop, int fd, int mask,
+	aeFileProc *proc, void *clientData);
+void aeDeleteFileEvent(aeEventLoop *eventloop, int fd, int mask);
+int aeGetFileEvents(aeEventLoop *eventloop, int fd);
+void aeMarkReady(aeEventLoop *eventloop, int fd, int mask);
+void aeSetDrainBudget(aeEventLoop *eventloop, size_t bytes);
+size_t aeGetDrainBudget(aeEventLoop *eventloop);
+void aeSetBusyPoll(aeEventLoop *eventloop, long long usecs);
+long long aeCreateTimeEvent(aeEventLoop *eventloop, long long milliseconds,
+	aeTimeProc *proc, void *clientData, aeEventFinalizerProc *finalizerProc);
+int aeDeleteTimeEvent(aeEventLoop *eventloop, long long id);
+long long aeNextTimeout(aeEventLoop *eventloop);
+int aeProcessEvents(aeEventLoop *eventloop, int flags);
+void aeMain(aeEventLoop *eventloop);
+void aeSetBeforeSleepProc(aeEventLoop *eventloop, aeBeforeSleepProc *beforesleep);
+void aeEnableLoopStats(aeEventLoop *eventloop, long long slowThresholdUs);
+void aeDisableLoopStats(aeEventLoop *eventloop);
+const aeLoopStats *aeGetLoopStats(aeEventLoop *eventloop);
+const char *aeGetApiName(aeEventLoop *eventloop);
+void aeGetPollStats(aeEventLoop *eventloop, aePollStats *stats);
+void aeSetFixedBuffers(int count, size_t size);
+struct iovec *aeGetFixedBuffer(aeEventLoop *eventloop, int idx);
+
+#endif
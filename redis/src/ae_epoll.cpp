@@ -1,50 +1,265 @@
 #include <sys/epoll.h>
 
+/* Interest set changes are not sent to the kernel as soon as a handler
+asks for them. aeApiAddEvent() and aeApiDelEvent() just record the fd in a
+changelist, and aeApiPoll() compares, for every fd in the list, the mask
+known by the kernel with the one the loop wants now, issuing at most one
+epoll_ctl() per fd right before epoll_wait(). A handler that installs the
+writable event and removes it again in the same iteration, as it happens
+under pipelining when the reply is written immediately, costs no syscall.
+
+An fd whose last event is removed may be closed, and its number reused by
+a new socket, before the changelist is applied: the final mask can then be
+the one the kernel knows for the old file. Its kmask is set to
+AE_KMASK_DIRTY, so that the flush registers it again in any case. */
+
+#define AE_KMASK_DIRTY -1 /* The fd went through AE_NONE since the last flush */
+
 class aeApiState
 {
+public:
 	int epfd;
 	struct epoll_event * events;
+	int *kmask;                 /* Per fd mask the kernel currently knows. */
+	unsigned char *inchanges;   /* Per fd flag: already in changes[]. */
+	int *changes;               /* fds whose interest set may have changed. */
+	int nchanges;
+	long long ctl_requested;    /* Interest set changes asked by the loop. */
+	long long ctl_calls;        /* epoll_ctl() calls actually performed. */
 };
 
+static void aeApiQueueChange(aeApiState *state, int fd)
+{
+	state->ctl_requested++;
+	if (state->inchanges[fd])
+		return;
+	state->inchanges[fd] = 1;
+	state->changes[state->nchanges++] = fd;
+}
+
 int aeApiAddEvent(aeEventLoop* eventloop, int fd, int mask)
 {
-	aeApiState *state = eventloop->apidata;
-	struct epoll_event ee = {0};/* avoid valgrind warning */
-	/* If the fd was already monitored for some event, we need
-	a MOD operation. Otherwise, we need an ADD operation. */
-	int op = eventloop->events[fd].mask == AE_NONE ?
-		EPOLL_CTL_ADD : EPOLL_CTL_MOD;
-
-	ee.events = 0;
-	mask |= eventloop->events[fd].mask; /* Merge old events */
-	if (mask & AE_READABLE)
-		ee.events |= EPOLLIN;
-	if (mask & AE_WRITABLE)
-		ee.events |= EPOLLOUT;
-	ee.data.fd = fd;
-	if (epoll_ctl(state->epfd, op, fd, &ee) == -1)
-		return -1;
+	aeApiQueueChange((aeApiState*)eventloop->apidata, fd);
 	return 0;
 }
 
+void aeApiDelEvent(aeEventLoop *eventloop, int fd, int delmask)
+{
+	aeApiState *state = (aeApiState*)eventloop->apidata;
+
+	if (!(eventloop->masks[fd] & (~delmask) & (AE_READABLE|AE_WRITABLE)) &&
+		state->kmask[fd] != AE_NONE)
+		state->kmask[fd] = AE_KMASK_DIRTY;
+	aeApiQueueChange(state, fd);
+}
+
+static int aeApiCtl(aeApiState *state, int op, int fd, struct epoll_event *ee)
+{
+	state->ctl_calls++;
+	return epoll_ctl(state->epfd, op, fd, ee);
+}
+
+/* Apply the changelist. An fd whose registration fails can't be reported
+to the caller of aeCreateFileEvent() anymore, so it is returned as fired
+(readable and writable, like EPOLLERR) in eventloop->fired: the handler
+will get the error from its next read or write.
+Returns the number of such events. */
+static int aeApiFlushChanges(aeEventLoop *eventloop)
+{
+	aeApiState *state = (aeApiState*)eventloop->apidata;
+	int numerrors = 0;
+
+	for (int j = 0; j < state->nchanges; j++)
+	{
+		int fd = state->changes[j];
+		int mask = eventloop->masks[fd] & (AE_READABLE|AE_WRITABLE);
+		struct epoll_event ee = {0}; /* avoid valgrind warning */
+		int retval;
+
+		if (mask != AE_NONE)
+			mask |= eventloop->masks[fd] & AE_EDGE;
+		state->inchanges[fd] = 0;
+		if (mask == state->kmask[fd])
+			continue;
+
+		ee.events = 0;
+		if (mask & AE_READABLE) ee.events |= EPOLLIN;
+		if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+		if (mask & AE_EDGE) ee.events |= EPOLLET;
+		ee.data.fd = fd;
+		if (mask == AE_NONE)
+		{
+			/* Note, Kernel < 2.6.9 requires a non null event pointer even for
+			EPOLL_CTL_DEL. The fd may be closed already, which removed it
+			from the set: the error is expected and ignored. */
+			aeApiCtl(state, EPOLL_CTL_DEL, fd, &ee);
+			state->kmask[fd] = AE_NONE;
+			continue;
+		}
+		if (state->kmask[fd] == AE_NONE || state->kmask[fd] == AE_KMASK_DIRTY)
+		{
+			/* A dirty fd is either the old file, still in the set, or a
+			new one the kernel never saw. */
+			retval = aeApiCtl(state, EPOLL_CTL_ADD, fd, &ee);
+			if (retval == -1 && errno == EEXIST)
+				retval = aeApiCtl(state, EPOLL_CTL_MOD, fd, &ee);
+		}
+		else
+		{
+			/* If the fd was closed and its number reused before we got
+			here, the kernel forgot about it: add it again. */
+			retval = aeApiCtl(state, EPOLL_CTL_MOD, fd, &ee);
+			if (retval == -1 && errno == ENOENT)
+				retval = aeApiCtl(state, EPOLL_CTL_ADD, fd, &ee);
+		}
+		if (retval == -1)
+		{
+			state->kmask[fd] = AE_NONE;
+			eventloop->fired[numerrors].fd = fd;
+			eventloop->fired[numerrors].mask = AE_READABLE|AE_WRITABLE;
+			numerrors++;
+		}
+		else
+		{
+			state->kmask[fd] = mask;
+		}
+	}
+	state->nchanges = 0;
+	return numerrors;
+}
+
 int aeApiCreate(aeEventLoop& eventloop)
 {
 	aeApiState *state = new aeApiState();
-	if (!state) 
+	if (!state)
 		return -1;
-	state->events = zmalloc(sizeof(struct epoll_event) * eventloop.setsize);
+	/* The per fd arrays are malloc'ed so that aeApiResize() can grow them
+	with realloc(). */
+	state->events = (struct epoll_event*)malloc(sizeof(struct epoll_event) * eventloop.setsize);
 	if (!state->events)
 	{
-		zfree(state);
+		delete state;
 		return -1;
 	}
 	state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel, #define __FD_SETSIZE 1024 in posix_types.h for select*/
 	if (state->epfd == -1)
 	{
-		zfree(state->events);
+		free(state->events);
+		delete state;
+		return -1;
+	}
+	state->kmask = (int*)calloc(eventloop.setsize, sizeof(int));
+	state->inchanges = (unsigned char*)calloc(eventloop.setsize, 1);
+	state->changes = (int*)malloc(sizeof(int) * eventloop.setsize);
+	if (!state->kmask || !state->inchanges || !state->changes)
+	{
+		free(state->kmask);
+		free(state->inchanges);
+		free(state->changes);
+		free(state->events);
+		close(state->epfd);
 		delete state;
 		return -1;
 	}
+	state->nchanges = 0;
+	state->ctl_requested = 0;
+	state->ctl_calls = 0;
 	eventloop.apidata = state;
 	return 0;
 }
+
+/* Resize the per fd arrays to 'setsize' entries. aeResizeSetSize() only
+shrinks the loop when no fd >= setsize is registered anymore, but such an
+fd may still wait in the changelist for its removal from the kernel: it
+is applied now, since its slot is about to go away. */
+int aeApiResize(aeEventLoop *eventloop, int setsize)
+{
+	aeApiState *state = (aeApiState*)eventloop->apidata;
+	int oldsize = eventloop->setsize;
+	void *p;
+
+	if (setsize < oldsize)
+	{
+		int kept = 0;
+		for (int j = 0; j < state->nchanges; j++)
+		{
+			int fd = state->changes[j];
+			if (fd < setsize)
+			{
+				state->changes[kept++] = fd;
+				continue;
+			}
+			if (state->kmask[fd] != AE_NONE)
+			{
+				struct epoll_event ee = {0};
+				aeApiCtl(state, EPOLL_CTL_DEL, fd, &ee);
+			}
+			state->kmask[fd] = AE_NONE;
+			state->inchanges[fd] = 0;
+		}
+		state->nchanges = kept;
+	}
+	if ((p = realloc(state->events, sizeof(struct epoll_event) * setsize)) == NULL)
+		return -1;
+	state->events = (struct epoll_event*)p;
+	if ((p = realloc(state->kmask, sizeof(int) * setsize)) == NULL)
+		return -1;
+	state->kmask = (int*)p;
+	if ((p = realloc(state->inchanges, setsize)) == NULL)
+		return -1;
+	state->inchanges = (unsigned char*)p;
+	if ((p = realloc(state->changes, sizeof(int) * setsize)) == NULL)
+		return -1;
+	state->changes = (int*)p;
+	if (setsize > oldsize)
+	{
+		memset(state->kmask + oldsize, 0, sizeof(int) * (setsize - oldsize));
+		memset(state->inchanges + oldsize, 0, setsize - oldsize);
+	}
+	return 0;
+}
+
+int aeApiPoll(aeEventLoop *eventloop, struct timeval *tvp)
+{
+	aeApiState *state = (aeApiState*)eventloop->apidata;
+	int retval, numevents;
+
+	numevents = aeApiFlushChanges(eventloop);
+	/* Don't sleep if we already have failed registrations to report. */
+	retval = epoll_wait(state->epfd, state->events, eventloop->setsize - numevents,
+		numevents ? 0 :
+		tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) : -1);
+	if (retval > 0)
+	{
+		for (int j = 0; j < retval; j++)
+		{
+			int mask = 0;
+			struct epoll_event *e = state->events + j;
+
+			if (e->events & EPOLLIN) mask |= AE_READABLE;
+			if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
+			/* Errors and hangups are reported as both readable and
+			writable so that the handlers notice them on their next I/O. */
+			if (e->events & EPOLLERR) mask |= AE_WRITABLE | AE_READABLE;
+			if (e->events & EPOLLHUP) mask |= AE_WRITABLE | AE_READABLE;
+			eventloop->fired[numevents].fd = e->data.fd;
+			eventloop->fired[numevents].mask = mask;
+			numevents++;
+		}
+	}
+	return numevents;
+}
+
+void aeApiGetStats(aeEventLoop *eventloop, aePollStats *stats)
+{
+	aeApiState *state = (aeApiState*)eventloop->apidata;
+
+	stats->ctl_calls = state->ctl_calls;
+	stats->ctl_avoided = state->ctl_requested > state->ctl_calls ?
+		state->ctl_requested - state->ctl_calls : 0;
+}
+
+const char *aeApiName(void)
+{
+	return "epoll";
+}
@@ -0,0 +1,372 @@
+/* io_uring based multiplexing layer.
+
+It implements the same contract as ae_epoll.cpp, but instead of issuing
+one epoll_ctl(2) per interest change, changes are queued as submission
+queue entries and handed to the kernel together with the wait for new
+events, in a single io_uring_enter(2) per loop iteration.
+
+Level triggered fds, the default, are armed with a single shot poll that
+is armed again after every completion: while the fd is still ready the new
+request completes at once, as the fd would be reported at every
+epoll_wait(). AE_EDGE fds are armed with a multishot poll instead, so that
+the kernel keeps reporting readiness changes without the request being
+re-submitted after every event.
+
+The fds are also registered in the ring fixed file table (the update is
+itself a queued operation, linked to the poll), which saves the kernel a
+file table lookup for every operation on the fd.
+
+A set of fixed buffers can be registered at creation time, so that the
+networking layer can issue IORING_OP_READ_FIXED/WRITE_FIXED on the same
+ring without the kernel mapping the user pages at every request, see
+aeSetFixedBuffers() and aeGetFixedBuffer(). */
+
+#include <liburing.h>
+#include <poll.h>
+
+#define AE_IOURING_IGNORE UINT64_MAX /* user_data of CQEs we don't care about */
+
+class aeIouringState
+{
+public:
+	struct io_uring ring;
+	unsigned *gen;        /* Per fd generation, tells stale CQEs apart. */
+	int *armed;           /* Per fd mask armed in the kernel. */
+	int *fixedfd;         /* Per fd slot of the fixed file table update. */
+	int *firedidx;        /* Per fd index in eventloop->fired, or -1. */
+	int nfiles;           /* Slots of the registered fixed file table. */
+	struct iovec *bufs;   /* Registered fixed buffers. */
+	int nbufs;
+};
+
+/* Number of fixed buffers, and the size of every buffer, registered by
+aeIouringCreate(). Zero buffers disables the registration. */
+static int aeIouringBufCount = 0;
+static size_t aeIouringBufSize = 16 * 1024;
+
+void aeIouringSetFixedBuffers(int count, size_t size)
+{
+	aeIouringBufCount = count;
+	aeIouringBufSize = size;
+}
+
+static inline uint64_t aeIouringUserData(aeIouringState *state, int fd)
+{
+	return ((uint64_t)state->gen[fd] << 32) | (uint32_t)fd;
+}
+
+/* Return a free submission queue entry. When the queue is full we submit
+what we have, which is the only case in which a change is not batched with
+the next wait. */
+static struct io_uring_sqe *aeIouringGetSqe(aeIouringState *state)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&state->ring);
+	if (sqe == NULL)
+	{
+		io_uring_submit(&state->ring);
+		sqe = io_uring_get_sqe(&state->ring);
+	}
+	return sqe;
+}
+
+/* Make sure 'count' SQEs can be taken without aeIouringGetSqe() submitting
+in between, so that a linked chain is never split across two submits. */
+static int aeIouringReserve(aeIouringState *state, unsigned count)
+{
+	if (io_uring_sq_space_left(&state->ring) < count)
+		io_uring_submit(&state->ring);
+	return io_uring_sq_space_left(&state->ring) < count ? -1 : 0;
+}
+
+/* Queue a poll for 'fd' with the given AE mask: single shot unless the
+mask has AE_EDGE, see the top of the file. */
+static int aeIouringArm(aeIouringState *state, int fd, int mask)
+{
+	struct io_uring_sqe *sqe = aeIouringGetSqe(state);
+	unsigned pollmask = 0;
+
+	if (sqe == NULL)
+		return -1;
+	if (mask & AE_READABLE) pollmask |= POLLIN;
+	if (mask & AE_WRITABLE) pollmask |= POLLOUT;
+	if (mask & AE_EDGE)
+		io_uring_prep_poll_multishot(sqe, fd, pollmask);
+	else
+		io_uring_prep_poll_add(sqe, fd, pollmask);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, aeIouringUserData(state, fd));
+	state->armed[fd] = mask;
+	return 0;
+}
+
+/* Queue the removal of the poll currently armed for 'fd'. Bumping the
+generation makes any CQE still in flight for the old request stale. */
+static int aeIouringDisarm(aeIouringState *state, int fd)
+{
+	struct io_uring_sqe *sqe = aeIouringGetSqe(state);
+
+	if (sqe == NULL)
+		return -1;
+	io_uring_prep_poll_remove(sqe, aeIouringUserData(state, fd));
+	io_uring_sqe_set_data64(sqe, AE_IOURING_IGNORE);
+	state->gen[fd]++;
+	state->armed[fd] = AE_NONE;
+	return 0;
+}
+
+/* Queue the update of the fixed file table slot 'fd'. The next SQE is
+linked to it, so the poll is only started once the slot is valid. */
+static int aeIouringRegisterFd(aeIouringState *state, int fd, int value)
+{
+	struct io_uring_sqe *sqe = aeIouringGetSqe(state);
+
+	if (sqe == NULL)
+		return -1;
+	state->fixedfd[fd] = value;
+	io_uring_prep_files_update(sqe, &state->fixedfd[fd], 1, fd);
+	io_uring_sqe_set_data64(sqe, AE_IOURING_IGNORE);
+	if (value != -1)
+		sqe->flags |= IOSQE_IO_LINK;
+	return 0;
+}
+
+int aeIouringCreate(aeEventLoop& eventloop)
+{
+	aeIouringState *state = new aeIouringState();
+	int setsize = eventloop.setsize;
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	/* The kernel only needs to stay ahead of the changes queued in one
+	iteration, completions are sized to hold one event per fd. */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = setsize;
+	if (io_uring_queue_init_params(1024, &state->ring, &params) < 0)
+	{
+		/* ENOSYS or EPERM: no io_uring in this kernel, or it is
+		disabled. The caller falls back to epoll. */
+		delete state;
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_FAST_POLL) ||
+		io_uring_register_files_sparse(&state->ring, setsize) < 0)
+	{
+		io_uring_queue_exit(&state->ring);
+		delete state;
+		return -1;
+	}
+
+	/* malloc'ed, so that aeIouringResize() can grow them with realloc(). */
+	state->nfiles = setsize;
+	state->gen = (unsigned*)calloc(setsize, sizeof(unsigned));
+	state->armed = (int*)calloc(setsize, sizeof(int));
+	state->fixedfd = (int*)malloc(sizeof(int) * setsize);
+	state->firedidx = (int*)malloc(sizeof(int) * setsize);
+	if (!state->gen || !state->armed || !state->fixedfd || !state->firedidx)
+	{
+		free(state->gen);
+		free(state->armed);
+		free(state->fixedfd);
+		free(state->firedidx);
+		io_uring_queue_exit(&state->ring);
+		delete state;
+		return -1;
+	}
+	for (int j = 0; j < setsize; j++)
+	{
+		state->fixedfd[j] = -1;
+		state->firedidx[j] = -1;
+	}
+
+	state->nbufs = 0;
+	state->bufs = NULL;
+	if (aeIouringBufCount > 0)
+	{
+		state->bufs = new struct iovec[aeIouringBufCount];
+		for (int j = 0; j < aeIouringBufCount; j++)
+		{
+			state->bufs[j].iov_base = new char[aeIouringBufSize];
+			state->bufs[j].iov_len = aeIouringBufSize;
+		}
+		if (io_uring_register_buffers(&state->ring, state->bufs,
+			aeIouringBufCount) == 0)
+			state->nbufs = aeIouringBufCount;
+	}
+	eventloop.apidata = state;
+	return 0;
+}
+
+/* Return the registered fixed buffer 'idx', to be used with
+io_uring_prep_read_fixed()/io_uring_prep_write_fixed() and 'idx' as
+buf_index. NULL is returned if no such buffer is registered. */
+struct iovec *aeIouringGetFixedBuffer(aeEventLoop *eventloop, int idx)
+{
+	aeIouringState *state = (aeIouringState*)eventloop->apidata;
+
+	if (idx < 0 || idx >= state->nbufs)
+		return NULL;
+	return &state->bufs[idx];
+}
+
+int aeIouringAddEvent(aeEventLoop *eventloop, int fd, int mask)
+{
+	aeIouringState *state = (aeIouringState*)eventloop->apidata;
+	int oldmask = eventloop->masks[fd] & (AE_READABLE|AE_WRITABLE);
+
+	/* Merge old events, AE_EDGE included since it selects the poll kind. */
+	mask = (mask | eventloop->masks[fd]) & (AE_READABLE|AE_WRITABLE|AE_EDGE);
+	if ((mask & ~AE_EDGE) == oldmask && state->armed[fd] == mask)
+		return 0;
+	if (oldmask == AE_NONE)
+	{
+		/* The update and the poll linked to it go in the same submit. */
+		if (aeIouringReserve(state, 2) == -1 ||
+			aeIouringRegisterFd(state, fd, fd) == -1)
+			return -1;
+	}
+	else if (state->armed[fd] != AE_NONE && aeIouringDisarm(state, fd) == -1)
+	{
+		return -1;
+	}
+	return aeIouringArm(state, fd, mask);
+}
+
+void aeIouringDelEvent(aeEventLoop *eventloop, int fd, int delmask)
+{
+	aeIouringState *state = (aeIouringState*)eventloop->apidata;
+	int mask = eventloop->masks[fd] & (~delmask) & (AE_READABLE|AE_WRITABLE);
+	int edge = eventloop->masks[fd] & (~delmask) & AE_EDGE;
+
+	if (state->armed[fd] != AE_NONE)
+		aeIouringDisarm(state, fd);
+	if (mask != AE_NONE)
+		aeIouringArm(state, fd, mask | edge);
+	else
+		aeIouringRegisterFd(state, fd, -1);
+}
+
+/* Resize the per fd arrays to 'setsize' entries. The queued fixed file
+updates point into fixedfd[], so they are submitted before it moves. The
+fixed file table itself can't grow: when it is too small it is registered
+again, larger, with the fds in use. It is never shrunk. */
+int aeIouringResize(aeEventLoop *eventloop, int setsize)
+{
+	aeIouringState *state = (aeIouringState*)eventloop->apidata;
+	int oldsize = eventloop->setsize;
+	void *p;
+
+	io_uring_submit(&state->ring);
+	if ((p = realloc(state->gen, sizeof(unsigned) * setsize)) == NULL)
+		return -1;
+	state->gen = (unsigned*)p;
+	if ((p = realloc(state->armed, sizeof(int) * setsize)) == NULL)
+		return -1;
+	state->armed = (int*)p;
+	if ((p = realloc(state->fixedfd, sizeof(int) * setsize)) == NULL)
+		return -1;
+	state->fixedfd = (int*)p;
+	if ((p = realloc(state->firedidx, sizeof(int) * setsize)) == NULL)
+		return -1;
+	state->firedidx = (int*)p;
+	for (int j = oldsize; j < setsize; j++)
+	{
+		state->gen[j] = 0;
+		state->armed[j] = AE_NONE;
+		state->fixedfd[j] = -1;
+		state->firedidx[j] = -1;
+	}
+
+	if (setsize > state->nfiles)
+	{
+		/* Polls already armed keep their own reference to the file. */
+		io_uring_unregister_files(&state->ring);
+		if (io_uring_register_files_sparse(&state->ring, setsize) < 0)
+			return -1;
+		state->nfiles = setsize;
+		if (io_uring_register_files_update(&state->ring, 0, state->fixedfd,
+			oldsize < setsize ? oldsize : setsize) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int aeIouringPoll(aeEventLoop *eventloop, struct timeval *tvp)
+{
+	aeIouringState *state = (aeIouringState*)eventloop->apidata;
+	struct __kernel_timespec ts, *tsp = NULL;
+	struct io_uring_cqe *cqe;
+	unsigned head, seen = 0;
+	int numevents = 0;
+
+	if (tvp)
+	{
+		ts.tv_sec = tvp->tv_sec;
+		ts.tv_nsec = tvp->tv_usec * 1000;
+		tsp = &ts;
+	}
+
+	/* Submit every change queued since the last call and wait for events
+	with a single system call. */
+	io_uring_submit_and_wait_timeout(&state->ring, &cqe, 1, tsp, NULL);
+
+	io_uring_for_each_cqe(&state->ring, head, cqe)
+	{
+		uint64_t data = io_uring_cqe_get_data64(cqe);
+		int fd = (int)(uint32_t)data;
+		int mask = 0;
+
+		seen++;
+		if (data == AE_IOURING_IGNORE || (unsigned)(data >> 32) != state->gen[fd])
+			continue;
+
+		/* A single shot poll is done after its completion, a multishot
+		one without IORING_CQE_F_MORE has been terminated by the kernel:
+		arm it again if we are still interested. A poll that failed is
+		only armed again if it was cancelled, as when the kernel drops a
+		multishot poll: -EBADF or -EINVAL would fail the same way at once,
+		so the fd is reported as fired instead and its handler gets the
+		error from its next read or write. */
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			int armed = state->armed[fd];
+			state->gen[fd]++;
+			state->armed[fd] = AE_NONE;
+			if (armed != AE_NONE && (cqe->res >= 0 || cqe->res == -ECANCELED))
+				aeIouringArm(state, fd, armed);
+		}
+		if (cqe->res == -ECANCELED)
+			continue;
+
+		if (cqe->res < 0)
+			mask = AE_READABLE | AE_WRITABLE;
+		else
+		{
+			if (cqe->res & POLLIN) mask |= AE_READABLE;
+			if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+			if (cqe->res & (POLLERR|POLLHUP)) mask |= AE_READABLE | AE_WRITABLE;
+		}
+
+		/* The same fd may have more than one completion in the queue,
+		merge them into a single fired event. */
+		if (state->firedidx[fd] != -1)
+		{
+			eventloop->fired[state->firedidx[fd]].mask |= mask;
+		}
+		else if (numevents < eventloop->setsize)
+		{
+			state->firedidx[fd] = numevents;
+			eventloop->fired[numevents].fd = fd;
+			eventloop->fired[numevents].mask = mask;
+			numevents++;
+		}
+	}
+	io_uring_cq_advance(&state->ring, seen);
+	for (int j = 0; j < numevents; j++)
+		state->firedidx[eventloop->fired[j].fd] = -1;
+	return numevents;
+}
+
+const char *aeIouringName(void)
+{
+	return "io_uring";
+}
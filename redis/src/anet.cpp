@@ -1,6 +1,7 @@
 #include <sys/socket.h> /* for addrinfo */
 #include <netdb.h> /* for getaddrinfo */
 #include <stdarg.h> /* for va_list */
+#include <arpa/inet.h> /* for inet_ntop */
 void anetSetError(char* err, const char *fmt, ...)
 {
 	va_list ap;
@@ -68,6 +69,72 @@ int anetSetReuseAddr(char* err, int fd)
 	return ANET_OK;
 }
 
+/* Let several sockets bind the same address and port. Every event loop
+of the multi-threaded mode opens its own listening socket with this option
+set, so the kernel spreads incoming connections among the loops and no
+single accept thread becomes the bottleneck. */
+int anetSetReusePort(char* err, int fd)
+{
+#ifdef SO_REUSEPORT
+	int yes = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	anetSetError(err, "setsockopt SO_REUSEPORT: not supported");
+	return ANET_ERR;
+#endif
+}
+
+/* Not every libc exports the busy polling options yet. */
+#ifdef __linux__
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+#endif
+
+/* Ask the kernel to busy poll the device queue of the socket for up to
+'usecs' microseconds on blocking reads and polls, instead of waiting for
+the interrupt. With 'prefer' set the kernel also defers the interrupts
+while the application keeps polling (SO_PREFER_BUSY_POLL), and 'budget',
+if non zero, is the number of packets processed per busy poll round.
+It trades CPU for latency, so it makes sense only on dedicated cores. */
+int anetSetBusyPoll(char *err, int fd, int usecs, int prefer, int budget)
+{
+#ifdef __linux__
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	if (prefer && setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+		sizeof(prefer)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_PREFER_BUSY_POLL: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	if (budget && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget,
+		sizeof(budget)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_BUSY_POLL_BUDGET: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	anetSetError(err, "setsockopt SO_BUSY_POLL: not supported");
+	return ANET_ERR;
+#endif
+}
+
 int anetListen(char* err, int s, struct sockaddr *sa, socklen_t len, int backlog)
 {
 	if (bind(s, sa, len) == -1)
@@ -92,7 +159,7 @@ void setError(int& s)
 	s = ANET_ERR; 
 }
 
-int _anetTcpServer(char* err, int port, char* bindaddr, int af, int backlog)
+int _anetTcpServer(char* err, int port, char* bindaddr, int af, int backlog, int reuseport)
 {
 	int s = -1, rv;
 	char _port[6];
@@ -118,6 +185,8 @@ int _anetTcpServer(char* err, int port, char* bindaddr, int af, int backlog)
 			setError(s);
 		if (anetSetReuseAddr(err, s) == ANET_ERR)
 			setError(s);
+		if (reuseport && anetSetReusePort(err, s) == ANET_ERR)
+			setError(s);
 		if (anetListen(err, s, p->ai_addr, p->ai_addrlen, backlog) == ANET_ERR)	
 			s = ANET_ERR;
 		freeaddrinfo(servinfo);
@@ -132,9 +201,58 @@ int _anetTcpServer(char* err, int port, char* bindaddr, int af, int backlog)
 }
 int anetTcpServer(char* err, int port, char* bindaddr, int backlog)
 {
-	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog);
+	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, 0);
 }
 int anetTcp6Server(char* err, int port, char* bindaddr, int backlog)
 {
-	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog);
+	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, 0);
+}
+int anetTcpReusePortServer(char* err, int port, char* bindaddr, int backlog)
+{
+	return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, 1);
+}
+int anetTcp6ReusePortServer(char* err, int port, char* bindaddr, int backlog)
+{
+	return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, 1);
+}
+
+static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len)
+{
+	int fd;
+	while(1)
+	{
+		fd = accept(s, sa, len);
+		if (fd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			anetSetError(err, "accept: %s", strerror(errno));
+			return ANET_ERR;
+		}
+		break;
+	}
+	return fd;
+}
+
+int anetTcpAccept(char *err, int s, char *ip, size_t ip_len, int *port)
+{
+	int fd;
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	if ((fd = anetGenericAccept(err, s, (struct sockaddr*)&sa, &salen)) == -1)
+		return ANET_ERR;
+
+	if (sa.ss_family == AF_INET)
+	{
+		struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+		if (ip) inet_ntop(AF_INET, (void*)&(s->sin_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin_port);
+	}
+	else
+	{
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+		if (ip) inet_ntop(AF_INET6, (void*)&(s->sin6_addr), ip, ip_len);
+		if (port) *port = ntohs(s->sin6_port);
+	}
+	return fd;
 }
@@ -12,5 +12,10 @@
 int anetSetError(char*, const char*, ...);
 int anetV6Only(char*, int);
 int anetSetReuseAddr(char*, int);
-int _anetTcpServer(char*, int, string, int, int);
+int anetSetReusePort(char*, int);
+int anetSetBusyPoll(char*, int, int, int, int);
+int anetTcpAccept(char*, int, char*, size_t, int*);
+int _anetTcpServer(char*, int, string, int, int, int);
 int anetTcp6Server(char* int, string, int);
+int anetTcpReusePortServer(char*, int, char*, int);
+int anetTcp6ReusePortServer(char*, int, char*, int);
@@ -14,34 +14,285 @@ it is not impossible that we'll need a non blocking FLUSHDB/FLUSHALL implementat
 DESIGN
 ------
 
-The design is trival, we have a structure representing a job to perform and a 
-different thread and job queue for every job type. Every thread waits for new jobs
-in its queue, and process every job sequentially.
+The jobs are processed by a pool of bio_threads workers, shared by the job
+types. BIO_LAZY_FREE frees the objects too big to be freed by the main
+thread without blocking it, see lazyfree.cpp: a burst of them is processed
+by every worker at once.
 
-Jobs of the same type are guaranteed to be processed from the least recently
-inserted one to the most recently inserted.
+The jobs are queued in rings of BIO_RING_SIZE preallocated jobs. A
+producer takes a ticket incrementing 'head' with a compare and swap, the
+slot of the ticket is free once its 'seq' equals the ticket, and the
+producer publishes the job storing 'seq' + 1 in it. A worker takes the job
+at 'tail' the same way once published, and hands the slot back to the
+producers of the next lap. Queueing a job takes no lock, no allocation and
+no system call, unless a worker sleeps.
 
-Currently there is no way for the creator of the job to be notified about the 
-completion of the operation, this will only be added when needed.  
+Every worker has a ring. A job goes to the ring of a sleeping worker if
+there is one, otherwise to the next worker in turn. A worker processes the
+jobs of its ring, and when there are none it steals the jobs of the other
+rings, so that a long job does not delay the ones queued behind it.
+
+The jobs of the BIO_ORDERED() types, the AOF fsyncs, have their own ring
+instead. A single worker at a time processes its jobs, flagging the type
+'busy', so that the jobs of such a type are processed from the least
+recently inserted one to the most recently inserted, one after the other.
+
+A worker with nothing to do sets its bit in 'idle_workers' and sleeps on
+its 'idle' word, a futex. A worker is 'searching' from the end of a job
+until it finds the next one or sleeps. The producers read the count of the
+searching workers after publishing their job, and wake a sleeping worker
+only if none is searching: a searching worker looks at the rings again
+after it stopped searching and before sleeping, so that either it sees the
+job, or the producer sees that no one searches. The last searching worker
+that finds a job wakes another one if there are jobs left, so that a long
+job does not leave the others waiting. A worker yields BIO_SPIN_YIELDS
+times, searching, before it sleeps: a burst of short jobs is processed by
+the awake workers without a system call in the producer.
+
+COMPLETIONS
+-----------
+
+The creator of a job can pass a callback and its private data, called in
+the main thread once the job was processed. The worker pushes them on the
+'completions' list, a lock free stack, and the worker that finds the list
+empty makes the completion fd readable, an eventfd on Linux and a pipe
+elsewhere. The event loop calls bioCompletionHandler(), that takes the
+whole list at once: the completions posted meanwhile are delivered with a
+single wakeup, in the order they were posted.
+
+The list is not bounded: a worker never waits for the main thread, that
+may itself be waiting for the workers in waitStepOfType().
 
 */
 
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#include "server.h"
 #include "bio.h"
 
-/* Initialize the background system, spawning the thread. */
-void Bio::init()
+static void bioEventInit(bioEvent *e)
+{
+	e->word = 0;
+#ifndef __linux__
+	pthread_mutex_init(&e->mutex, NULL);
+	pthread_cond_init(&e->cond, NULL);
+#endif
+}
+
+/* Sleep as long as the word of the event is 'val'. */
+static void bioEventWait(bioEvent *e, uint32_t val)
+{
+#ifdef __linux__
+	while (__atomic_load_n(&e->word, __ATOMIC_ACQUIRE) == val)
+		syscall(SYS_futex, &e->word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&e->mutex);
+	while (__atomic_load_n(&e->word, __ATOMIC_ACQUIRE) == val)
+		pthread_cond_wait(&e->cond, &e->mutex);
+	pthread_mutex_unlock(&e->mutex);
+#endif
+}
+
+/* Wake one or all the threads sleeping on the event. The caller changed
+the word before. */
+static void bioEventWake(bioEvent *e, int all)
+{
+#ifdef __linux__
+	syscall(SYS_futex, &e->word, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+#else
+	/* A waiter checks the word holding the mutex: once we hold it, the
+	waiters that saw the old value are in pthread_cond_wait(). */
+	pthread_mutex_lock(&e->mutex);
+	pthread_mutex_unlock(&e->mutex);
+	if (all)
+		pthread_cond_broadcast(&e->cond);
+	else
+		pthread_cond_signal(&e->cond);
+#endif
+}
+
+/* Return the slot of ticket 'pos' and how far it is from its turn: 0 if
+the producer of 'pos' can fill it, negative while it holds the job of the
+previous lap, positive if it was taken already. */
+static bioSlot *bioSlotOf(bioRing *r, unsigned long pos, long *dif)
+{
+	bioSlot *slot = &r->slots[pos & (BIO_RING_SIZE - 1)];
+
+	*dif = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+	return slot;
+}
+
+static void bioRingInit(bioRing *r)
+{
+	r->slots = (bioSlot*)zmalloc(sizeof(bioSlot) * BIO_RING_SIZE);
+	for (unsigned long i = 0; i < BIO_RING_SIZE; i++)
+		r->slots[i].seq = i;
+	r->head = r->tail = 0;
+	bioEventInit(&r->room);
+	r->room_waiters = 0;
+}
+
+/* Return 1 if the ring has no job published at its tail. */
+static int bioRingEmpty(bioRing *r)
+{
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&r->slots[pos & (BIO_RING_SIZE - 1)].seq,
+		__ATOMIC_ACQUIRE) != pos + 1;
+}
+
+/* Queue a copy of 'job'. Returns 0 if the ring is full, with the ticket
+that found it full in '*pos'. */
+static int bioRingPush(bioRing *r, bio_job *job, unsigned long *pos)
+{
+	bioSlot *slot;
+	long dif;
+
+	*pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while (1)
+	{
+		slot = bioSlotOf(r, *pos, &dif);
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&r->head, pos, *pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			*pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	slot->job = *job;
+	__atomic_store_n(&slot->seq, *pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Copy the job at the tail in 'job', with its ticket in '*ticket', and
+give its slot back to the producers. Returns 0 if there is no job. */
+static int bioRingPop(bioRing *r, bio_job *job, unsigned long *ticket)
+{
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	bioSlot *slot;
+	long dif;
+
+	while (1)
+	{
+		slot = &r->slots[pos & (BIO_RING_SIZE - 1)];
+		dif = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (dif == 0)
+		{
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0)
+		{
+			return 0;
+		}
+		else
+		{
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	*job = slot->job;
+	*ticket = pos;
+	__atomic_store_n(&slot->seq, pos + BIO_RING_SIZE, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Sleep until the workers make room, the ring being full at ticket 'pos'.
+Waking the producers for every job would cost two system calls a job as
+long as they outpace the workers: they are woken every half ring the
+workers process, or when the ring is empty, see bioRingMadeRoom(). The
+ring being full, either comes once a worker got past 'pos'. */
+static void bioWaitRoom(bioRing *r, unsigned long pos)
+{
+	uint32_t room = __atomic_load_n(&r->room.word, __ATOMIC_SEQ_CST);
+	long dif;
+
+	__atomic_add_fetch(&r->room_waiters, 1, __ATOMIC_SEQ_CST);
+	bioSlotOf(r, pos, &dif);
+	if (dif < 0)
+		bioEventWait(&r->room, room);
+	__atomic_sub_fetch(&r->room_waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* Called by a worker once it processed the job of 'ticket', after a full
+barrier, to wake the producers waiting for room if it is time. */
+static void bioRingMadeRoom(bioRing *r, unsigned long ticket)
+{
+	if (__atomic_load_n(&r->room_waiters, __ATOMIC_SEQ_CST) &&
+		(((ticket + 1) & (BIO_RING_SIZE / 2 - 1)) == 0 || bioRingEmpty(r)))
+	{
+		__atomic_add_fetch(&r->room.word, 1, __ATOMIC_SEQ_CST);
+		bioEventWake(&r->room, 1);
+	}
+}
+
+/* Initialize the background system, spawning 'threads' workers. */
+void Bio::init(int threads)
 {
 	pthread_attr_t attr;
 	pthread_t thread;
 	size_t stacksize;
 
+	if (threads < 1)
+		threads = 1;
+	if (threads > BIO_MAX_THREADS)
+		threads = BIO_MAX_THREADS;
+
 	/* Initialization of state vars and objects */
 	for (int j = 0; j < BIO_NUM_OPS; ++j)
 	{
-		pthread_mutex_init(&bio_mutex[j], NULL);
-		pthread_cond_init(&bio_newjob_cond[j], NULL);
-		pthread_cond_init(&bio_step_cond[j], NULL);
-		bio_pending[j] = 0;
+		bioType *t = &types[j];
+
+		if (BIO_ORDERED(j))
+			bioRingInit(&t->ring);
+		t->busy = 0;
+		bioEventInit(&t->step);
+		t->step_waiters = 0;
+		t->pending = 0;
+	}
+	numworkers = threads;
+	workers = new bioWorker[threads];
+	idle_workers = 0;
+	searching = 0;
+
+	completions = NULL;
+#ifdef __linux__
+	completion_rfd = completion_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (completion_rfd == -1)
+#else
+	int fds[2];
+
+	if (pipe(fds) == 0)
+	{
+		completion_rfd = fds[0];
+		completion_wfd = fds[1];
+		fcntl(completion_rfd, F_SETFL, fcntl(completion_rfd, F_GETFL) | O_NONBLOCK);
+		fcntl(completion_wfd, F_SETFL, fcntl(completion_wfd, F_GETFL) | O_NONBLOCK);
+	}
+	else
+#endif
+	{
+		serverLog(LL_WARNING, "Fatal: Can't create the background jobs completion fd: %s",
+			strerror(errno));
+		exit(1);
 	}
 
 	/* Set the stack size as by default it may be small in some system */
@@ -51,92 +302,331 @@ void Bio::init()
 	while(stacksize < REDIS_THREAD_STACK_SIZE) 
 		stacksize *= 2;
 	pthread_attr_setstacksize(&attr, stacksize);
-	
+
 	/* Ready to spawn our threads. We use the single argument the thread
-	function accepts in order to pass the job ID the thread is reponsible of.*/
-	for (int j = 0; j < BIO_NUM_OPS; j++)
+	function accepts in order to pass the worker it runs. */
+	for (int j = 0; j < threads; j++)
 	{
-		void *arg = (void*)(unsigned long) j;
-		if (pthread_create(&thread, &attr, bioProcessBackgroundJobs, arg) != 0)
+		bioWorker *w = &workers[j];
+
+		bioRingInit(&w->ring);
+		bioEventInit(&w->idle);
+		w->bio = this;
+		w->id = j;
+	}
+	for (int j = 0; j < threads; j++)
+	{
+		if (pthread_create(&thread, &attr, processBackgroundJobs, &workers[j]) != 0)
 		{
 			serverLog(LL_WARNING, "Fatal: Can't initialize Background Jobs.");
 			exit(1);
 		}
-		bio_threads[j] = thread;
+		workers[j].thread = thread;
 	}
+}
 
+/* Wake a sleeping worker, 'preferred' if it sleeps, if any. The caller
+published a job and issued a full barrier. */
+void Bio::wakeWorker(int preferred)
+{
+	uint64_t idle = __atomic_load_n(&idle_workers, __ATOMIC_RELAXED), bit;
+	int id;
+
+	if (idle == 0)
+		return;
+	id = preferred >= 0 && (idle & (1ULL << preferred)) ? preferred : __builtin_ctzll(idle);
+	bit = 1ULL << id;
+	/* If another producer cleared the bit first, it wakes the worker. */
+	if (__atomic_fetch_and(&idle_workers, ~bit, __ATOMIC_SEQ_CST) & bit)
+	{
+		__atomic_store_n(&workers[id].idle.word, 0, __ATOMIC_SEQ_CST);
+		bioEventWake(&workers[id].idle, 0);
+	}
 }
 
+/* Queue a job of 'type'. If 'done' is not NULL, it is called with
+'privdata' by the event loop once the job was processed. */
+void Bio::createBackgroundJob(int type, void *arg1, void *arg2, void *arg3,
+	bioCompletionProc *done, void *privdata)
+{
+	static __thread unsigned int next_worker;
+	bioRing *ring;
+	bio_job job;
+	unsigned long pos;
+	int target = -1;
+
+	job.time = time(NULL);
+	job.type = type;
+	job.arg1 = arg1;
+	job.arg2 = arg2;
+	job.arg3 = arg3;
+	job.done = done;
+	job.privdata = privdata;
+
+	/* Counted before the job is visible, the worker uncounts it after. */
+	__atomic_add_fetch(&types[type].pending, 1, __ATOMIC_RELAXED);
+	if (BIO_ORDERED(type))
+	{
+		ring = &types[type].ring;
+		while (!bioRingPush(ring, &job, &pos))
+			bioWaitRoom(ring, pos);
+	}
+	else
+	{
+		/* To a sleeping worker if any, otherwise to the next one in turn,
+		or to the following ones if its ring is full. */
+		uint64_t idle = __atomic_load_n(&idle_workers, __ATOMIC_RELAXED);
+
+		target = idle ? __builtin_ctzll(idle) : next_worker++ % numworkers;
+		for (int j = 0; ; j++)
+		{
+			ring = &workers[(target + j) % numworkers].ring;
+			if (bioRingPush(ring, &job, &pos))
+				break;
+			if (j == numworkers - 1)
+			{
+				bioWaitRoom(ring, pos);
+				j = -1;
+			}
+		}
+	}
 
-void* biProcessBackgroundJobs(void *arg)
+	/* Wake a worker if none is searching. A job of an ordered type is picked
+	by the worker processing the type if any, see processBackgroundJobs(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&searching, __ATOMIC_RELAXED) == 0 &&
+		(!BIO_ORDERED(type) || !__atomic_load_n(&types[type].busy, __ATOMIC_RELAXED)))
+		wakeWorker(target);
+}
+
+/* Push a completion for the event loop, see COMPLETIONS at the top of the
+file. Called by the workers. */
+void Bio::postCompletion(bioCompletionProc *done, void *privdata)
 {
-	struct bio_jobs *job;
-	unsigned long type = (unsigned long) args;
-	sigset_t sigset;
+	bioCompletion *c = (bioCompletion*)zmalloc(sizeof(*c));
+	bioCompletion *head = __atomic_load_n(&completions, __ATOMIC_RELAXED);
+	uint64_t one = 1;
+
+	c->done = done;
+	c->privdata = privdata;
+	do
+		c->next = head;
+	while (!__atomic_compare_exchange_n(&completions, &head, c, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* The completions pushed on a non empty list are taken with the first
+	one: only the first one signals. */
+	if (head == NULL && write(completion_wfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		serverLog(LL_WARNING, "Warning: can't signal a background job completion: %s",
+			strerror(errno));
+}
 
-	/* check that the type is within the right interval */
-	if (type >= BIO_NUM_OPS)
+/* Call the completions posted since the last call, in the order they were
+posted. Returns their number. Called by the main thread. */
+int Bio::processCompletions()
+{
+	bioCompletion *c, *next, *fifo = NULL;
+	char buf[64];
+	int count = 0;
+
+	/* Drain the fd before taking the list: a completion posted after the
+	list was taken makes it readable again. */
+	while (read(completion_rfd, buf, sizeof(buf)) > 0)
+		;
+	c = __atomic_exchange_n(&completions, (bioCompletion*)NULL, __ATOMIC_ACQUIRE);
+	while (c)
+	{
+		next = c->next;
+		c->next = fifo;
+		fifo = c;
+		c = next;
+	}
+	while (fifo)
 	{
-		serverLog(LL_WARNING, "Warning: bio thread started with wrong type %lu", type);
-	return NULL;
+		next = fifo->next;
+		fifo->done(fifo->privdata);
+		zfree(fifo);
+		fifo = next;
+		count++;
 	}
+	return count;
+}
+
+/* Readable handler of the completion fd, registered in the event loop of
+the main thread with the service as client data. */
+void bioCompletionHandler(aeEventLoop *el, int fd, void *clientData, int mask)
+{
+	((Bio*)clientData)->processCompletions();
+}
+
+/* Take a job for 'w': of an ordered type if no other worker processes
+one, from the ring of 'w', or stolen from the other rings. The ring and
+the ticket of the job are returned in '*ring' and '*ticket'. Returns 0
+if there is no job. */
+int Bio::findJob(bioWorker *w, bio_job *job, bioRing **ring, unsigned long *ticket)
+{
+	for (int type = 0; type < BIO_NUM_OPS; type++)
+	{
+		bioType *t = &types[type];
+		uint32_t idle = 0;
+
+		if (!BIO_ORDERED(type) || bioRingEmpty(&t->ring) ||
+			!__atomic_compare_exchange_n(&t->busy, &idle, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+		if (bioRingPop(&t->ring, job, ticket))
+		{
+			*ring = &t->ring;
+			return 1;
+		}
+		__atomic_store_n(&t->busy, 0, __ATOMIC_RELEASE);
+	}
+	for (int j = 0; j < numworkers; j++)
+	{
+		*ring = &workers[(w->id + j) % numworkers].ring;
+		if (bioRingPop(*ring, job, ticket))
+			return 1;
+	}
+	return 0;
+}
+
+/* Return 1 if a ring holds a job, the ring of a busy ordered type aside. */
+int Bio::jobsQueued()
+{
+	for (int type = 0; type < BIO_NUM_OPS; type++)
+	{
+		if (BIO_ORDERED(type) && !__atomic_load_n(&types[type].busy, __ATOMIC_RELAXED) &&
+			!bioRingEmpty(&types[type].ring))
+			return 1;
+	}
+	for (int j = 0; j < numworkers; j++)
+	{
+		if (!bioRingEmpty(&workers[j].ring))
+			return 1;
+	}
+	return 0;
+}
+
+void *Bio::processBackgroundJobs(void *arg)
+{
+	bioWorker *w = (bioWorker*)arg;
+	Bio *bio = w->bio;
+	uint64_t bit = 1ULL << w->id;
+	bioRing *ring;
+	unsigned long ticket;
+	bio_job job;
+	sigset_t sigset;
 
 	/* Make the thread killable at any time, so that bioKillThreads() can work reliably. */
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-	pthread_mutex_lock(&bio_mutex[type]);/* block until the mutex become available */
 	/* Block SIGALRM so we are sure that only the main thread will receive the watchdog signal. */
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGALRM);
 	if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
 		serverLog(LL_WARNING, "Warning: can't mask SIGALRM in bio.c thread: %s", strerror(errno));
+	__atomic_add_fetch(&bio->searching, 1, __ATOMIC_SEQ_CST);
 	while(1)
 	{
-		listNode * ln;
-		/* The loop always starts with the lock hold*/
-		if (listLength(bio_jobs[type]) == 0)
+		bioType *t;
+		int found = bio->findJob(w, &job, &ring, &ticket);
+
+		/* Jobs often come in bursts: yield a few times before sleeping, the
+		producers do not need to wake a worker that searches. */
+		for (int spin = 0; !found && spin < BIO_SPIN_YIELDS; spin++)
 		{
-			pthread_cond_wait(&bio_newjob_cond[type], &bio_mutex[type]);
-			continue;
+			sched_yield();
+			found = bio->findJob(w, &job, &ring, &ticket);
 		}
-		/* Pop the job from the queue */
-		ln = listFirst(bio_jobs[type]);
-		job = ln->value;
-		/* It is now possible to unlock the background system as we know there
-		is a stand alone job structure to process. */
-		pthread_mutex_unlock(&bio_mutex[type]);
+		if (!found)
+		{
+			/* Tell the producers we are about to sleep, then look at the
+			rings again: a job published before they could see that no
+			worker searches would wait for the next one otherwise. */
+			__atomic_store_n(&w->idle.word, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_or(&bio->idle_workers, bit, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&bio->searching, 1, __ATOMIC_SEQ_CST);
+			found = bio->findJob(w, &job, &ring, &ticket);
+			if (!found)
+				bioEventWait(&w->idle, 1);
+			__atomic_fetch_and(&bio->idle_workers, ~bit, __ATOMIC_RELAXED);
+			__atomic_store_n(&w->idle.word, 0, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&bio->searching, 1, __ATOMIC_SEQ_CST);
+			if (!found)
+				continue;
+		}
+		/* No longer searching: if no other worker does, and jobs are left,
+		wake one for them. */
+		if (__atomic_sub_fetch(&bio->searching, 1, __ATOMIC_SEQ_CST) == 0 &&
+			bio->jobsQueued())
+			bio->wakeWorker(-1);
 
 		/* Process the job accordingly to its type. */
-		if (type == BIO_CLOSE_FILE)
-			close((long)job->arg1);
-		else if (type == BIO_AOF_FSYNC)
-			redis_fsync((long)job->arg1);
-		else if (type == BIO_LAZY_FREE)
+		if (job.type == BIO_CLOSE_FILE)
+			close((long)job.arg1);
+		else if (job.type == BIO_AOF_FSYNC)
+			redis_fsync((long)job.arg1);
+		else if (job.type == BIO_LAZY_FREE)
 		{
-			/* What we free changes depending on what arguments are set:
-			arg1 -> free the object at pointer.
-			arg2 & arg3 -> free two dictionaries (a Redis DB). 
-			only arg3 -> free the skiplist. */
-			if (job->arg1)
-				lazyfreeFreeObjectFromBioThread(job->arg1);
-			else if (job->arg2 && job->arg3)
-				lazyfreeFreeDatabaseFromBioThread(job->arg2, job->arg3);
-			else if (job->arg3)
-				lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+			/* arg1 is the object to free, arg2 the memory it was
+			accounted for in the pending lazy free bytes. */
+			lazyfreeFreeObjectFromBioThread((robj*)job.arg1, (size_t)job.arg2);
 		}
 		else
 		{
 			serverPanic("Wrong job type in bioProcessBackgroundJobs().");
-		}	
-		zfree(job);
+		}
+
+		/* Before the job is uncounted: once no job is pending, every
+		completion was posted. */
+		if (job.done)
+			bio->postCompletion(job.done, job.privdata);
+
+		t = &bio->types[job.type];
+		/* Let the next job of an ordered type go. The exchange is a full
+		barrier: either the producer of a new job sees the type free and
+		wakes a worker, or we see the job looking for the next one. */
+		if (BIO_ORDERED(job.type))
+			__atomic_exchange_n(&t->busy, 0, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&t->pending, 1, __ATOMIC_SEQ_CST);
+		/* Unblock threads blocked on waitStepOfType() if any. */
+		__atomic_add_fetch(&t->step.word, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&t->step_waiters, __ATOMIC_SEQ_CST))
+			bioEventWake(&t->step, 1);
+		bioRingMadeRoom(ring, ticket);
+		__atomic_add_fetch(&bio->searching, 1, __ATOMIC_SEQ_CST);
+	}
+}
 
-		/* Lock again before reiterating the loop, if there are no longer jobs 
-		to process, we'll block again in pthread_cond_wait(). */
-		pthread_mutex_lock(&bio_mutex[type]);
-		listDelNode(bio_jobs[type], ln);
-		bio_pending[type]--;
-		/* Unblock threads blocked on bioWaitStepOfType() if any. */
-		pthread_cond_broadcast(&bio_step_cond[type]);	
+/* Return the number of pending jobs of the specified type. */
+unsigned long long Bio::pendingJobsOfType(int type)
+{
+	return __atomic_load_n(&types[type].pending, __ATOMIC_SEQ_CST);
+}
+
+/* If there are pending jobs for the specified type, the function blocks
+and waits that the next job was processed. Otherwise the function
+does not block and returns ASAP.
+
+The function returns the number of jobs still to process of the
+requested type.
+
+This function is useful when from another thread, we want to wait
+a bio.c thread to do more work in a blocking way. */
+unsigned long long Bio::waitStepOfType(int type)
+{
+	bioType *t = &types[type];
+	/* The step is read first: the thread uncounts a job before it steps,
+	so a job still pending steps after this read. */
+	uint32_t step = __atomic_load_n(&t->step.word, __ATOMIC_SEQ_CST);
+	unsigned long long val = __atomic_load_n(&t->pending, __ATOMIC_SEQ_CST);
+
+	if (val != 0)
+	{
+		__atomic_add_fetch(&t->step_waiters, 1, __ATOMIC_SEQ_CST);
+		bioEventWait(&t->step, step);
+		__atomic_sub_fetch(&t->step_waiters, 1, __ATOMIC_RELAXED);
+		val = __atomic_load_n(&t->pending, __ATOMIC_SEQ_CST);
 	}
+	return val;
 }
@@ -1,28 +1,154 @@
+#ifndef __BIO_H
+#define __BIO_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 /* Background job opcodes */
+#define BIO_CLOSE_FILE 0 /* Deferred close(2) syscall. */
+#define BIO_AOF_FSYNC 1  /* Deferred AOF fsync. */
+#define BIO_LAZY_FREE 2  /* Deferred objects freeing. */
 #define BIO_NUM_OPS 3
 
+/* Types whose jobs are processed one at a time, in the order they were
+created. The others are processed by any worker, concurrently. */
+#define BIO_ORDERED(type) ((type) == BIO_AOF_FSYNC)
+
+#define BIO_MAX_THREADS 64 /* Workers, one bit each in 'idle_workers'. */
+#define BIO_SPIN_YIELDS 4  /* sched_yield() calls before a worker sleeps. */
+
+#define REDIS_THREAD_STACK_SIZE (1024 * 1024 * 4)
+
+/* Jobs a ring can hold, a power of two. When the rings are full
+createBackgroundJob() waits for the workers to make room. */
+#define BIO_RING_SIZE 4096
+
+#define BIO_CACHE_LINE 64
+
+class aeEventLoop;
+
+/* Called in the main thread, from the event loop, once the job it was
+given to was processed. */
+typedef void bioCompletionProc(void *privdata);
+
 class bio_job
 {
-	time_t time;/* Time the job was created. */
-	/*Job specific arguments pointers. If we need to pass m ore than
+public:
+	time_t time; /* Time the job was created. */
+	int type;    /* BIO_* opcode. */
+	/* Job specific arguments pointers. If we need to pass more than
 	three arguments, we can just pass a pointer to a structure. */
 	void *arg1, *arg2, *arg3;
-}
+	bioCompletionProc *done; /* NULL if the creator is not notified. */
+	void *privdata;
+};
+
+/* A processed job whose creator is notified, in the list of completions
+the event loop takes. */
+class bioCompletion
+{
+public:
+	bioCompletion *next;
+	bioCompletionProc *done;
+	void *privdata;
+};
+
+/* A slot of a ring. 'seq' tells whose turn it is: the slot is free for
+the producer taking ticket 'seq', and holds the job of ticket 'seq - 1'
+for the workers once the producer stored it. */
+class bioSlot
+{
+public:
+	unsigned long seq;
+	bio_job job;
+};
+
+/* A word threads sleep on while it holds a given value, a futex on Linux,
+a mutex and a condition variable elsewhere. */
+class bioEvent
+{
+public:
+	uint32_t word;
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+/* A bounded queue of jobs, filled by any thread and drained by any worker.
+The fields written by the producers and by the workers are on different
+cache lines. */
+class alignas(BIO_CACHE_LINE) bioRing
+{
+public:
+	bioSlot *slots;                  /* BIO_RING_SIZE preallocated jobs. */
+	alignas(BIO_CACHE_LINE)
+	unsigned long head;              /* Next ticket, taken by the producers. */
+	alignas(BIO_CACHE_LINE)
+	unsigned long tail;              /* Next job to process, taken by the workers. */
+	bioEvent room;                   /* Times the workers made room in it full. */
+	uint32_t room_waiters;           /* Producers waiting for room. */
+};
+
+/* The accounting of a job type, and the ring of the ordered types. */
+class alignas(BIO_CACHE_LINE) bioType
+{
+public:
+	bioRing ring;                    /* Jobs of an ordered type. */
+	uint32_t busy;                   /* A worker processes a job of the ring. */
+	bioEvent step;                   /* Jobs processed, see waitStepOfType(). */
+	uint32_t step_waiters;           /* Threads in waitStepOfType(). */
+	/* The number of pending jobs of the type. This allows us to export the
+	pendingJobsOfType() API that is useful when the main thread wants to
+	perform some operation that may involve objects shared with the
+	background thread. The main thread will just wait that there are no
+	longer jobs of this type to be executed before performing the sensible
+	operation. This data is also useful for reporting. */
+	unsigned long long pending;
+};
+
+class Bio;
+
+/* A background thread, with the ring of the unordered jobs given to it. */
+class alignas(BIO_CACHE_LINE) bioWorker
+{
+public:
+	bioRing ring;
+	bioEvent idle;                   /* 1 while the worker sleeps. */
+	Bio *bio;
+	int id;
+	pthread_t thread;
+};
 
 class Bio
 {
-	pthread_mutex_t bio_mutex[BIO_NUM_OPS];
-	pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
-	pthread_cond_t bio_step_cond[BIO_NUM_OPS];
-	list<bio_jobs> jobs[BIO_NUM_OPS];
-	/* The following array is used to hold the number of pending jobs for every
-	OP type. This allows us to export the bioPendingJobsOfType() API that is useful
-	when the main thread wants to perform some opertion that may involve objects
-	shared with the background thread. The main thread will just wait that there
-	are no longer jobs of this type to be executed before performing the sensible
- 	operation. This data is alos useful for reporting.*/
-	unsigned long long bio_pending[BIO_NUM_OPS];
+	bioType types[BIO_NUM_OPS];
+	bioWorker *workers;
+	int numworkers;
+	alignas(BIO_CACHE_LINE)
+	uint64_t idle_workers;           /* Bit 'id' set while worker 'id' sleeps. */
+	uint32_t searching;              /* Workers awake looking for a job. */
+	alignas(BIO_CACHE_LINE)
+	bioCompletion *completions;      /* To deliver, the newest first. */
+	int completion_rfd;              /* Readable when there are completions. */
+	int completion_wfd;
+
+	int findJob(bioWorker *w, bio_job *job, bioRing **ring, unsigned long *ticket);
+	int jobsQueued();
+	void wakeWorker(int preferred);
+	void postCompletion(bioCompletionProc *done, void *privdata);
+	static void *processBackgroundJobs(void *arg);
 public:
-	init();
+	void init(int threads);
+	void createBackgroundJob(int type, void *arg1, void *arg2, void *arg3,
+		bioCompletionProc *done = NULL, void *privdata = NULL);
+	unsigned long long pendingJobsOfType(int type);
+	unsigned long long waitStepOfType(int type);
+	int completionFd() { return completion_rfd; }
+	int processCompletions();
 };
+
+void bioCompletionHandler(aeEventLoop *el, int fd, void *clientData, int mask);
+
+#endif
@@ -17,9 +17,10 @@ multiple policies is faster. */
 #define MAXMEMORY_FLAG_LRU (1 << 0) 
 #define MAXMEMORY_FLAG_LFU (1 << 1)
 #define MAXMEMORY_FLAG_ALLKEYS (1 << 2)
-#define MAXMEMORY_FLAG_NO_SHARED_INTEGERS (MAXMEMORY_FLAG_LRU | MAMEMORY_FLAG_LFU)
+#define MAXMEMORY_FLAG_ADMISSION (1 << 3) /* New keys must beat the victim, see tinylfu.cpp */
+#define MAXMEMORY_FLAG_NO_SHARED_INTEGERS (MAXMEMORY_FLAG_LRU | MAXMEMORY_FLAG_LFU)
 
-#define MAXMEMORY_VOLATILE_LRU ((0 << 8) | MAXMEMORY_FALG_LRU)
+#define MAXMEMORY_VOLATILE_LRU ((0 << 8) | MAXMEMORY_FLAG_LRU)
 #define MAXMEMORY_VOLATILE_LFU ((1 << 8) | MAXMEMORY_FLAG_LFU)
 #define MAXMEMORY_VOLATILE_TTL (2 << 8)
 #define MAXMEMORY_VOLATILE_RANDOM (3 << 8)
@@ -27,7 +28,16 @@ multiple policies is faster. */
 #define MAXMEMORY_ALLKEYS_LFU ((5 << 8) | MAXMEMORY_FLAG_LFU | MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6 << 8) | MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7 << 8)
+#define MAXMEMORY_ALLKEYS_LRU_TINYLFU ((8 << 8) | MAXMEMORY_FLAG_LRU | \
+	MAXMEMORY_FLAG_ALLKEYS | MAXMEMORY_FLAG_ADMISSION)
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
+#define CONFIG_DEFAULT_MAXMEMORY 0
+#define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_LFU_LOG_FACTOR 10 /* Accesses to saturate the counter grow with it */
+#define CONFIG_DEFAULT_LFU_DECAY_TIME 1  /* Minutes to decrement the counter, 0 = never */
+#define CONFIG_DEFAULT_TINYLFU_SKETCH_BYTES (1024 * 1024) /* Admission sketch, 2M counters */
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 1 /* Free big evicted values in background */
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0   /* Free big expired values in background */
 
 /* Static Server configuration */
 #define CONFIG_BINDADDR_MAX 16
@@ -36,6 +46,21 @@ multiple policies is faster. */
 #define CONFIG_DEFAULT_SERVER_PORT 6379 /* TCP port */
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_TCP_BACKLOG 511  /* TCP listening backlog */
+#define CONFIG_DEFAULT_EVENT_LOOPS 1    /* Event loop threads, 1 = classic single loop */
+#define CONFIG_MAX_EVENT_LOOPS 128
+#define CONFIG_DEFAULT_EVENT_LOOP_PINNING 1 /* Pin every event loop thread to a CPU */
+#define CONFIG_DEFAULT_DRAIN_BUDGET (64 * 1024) /* Bytes per AE_EDGE handler per iteration */
+#define CONFIG_DEFAULT_BUSY_POLL_USECS 0 /* Event loop spin window, 0 = always block */
+#define CONFIG_DEFAULT_SO_BUSY_POLL_USECS 0 /* SO_BUSY_POLL of clients, 0 = disabled */
+#define CONFIG_DEFAULT_SO_PREFER_BUSY_POLL 0
+#define CONFIG_DEFAULT_SO_BUSY_POLL_BUDGET 0 /* 0 = kernel default */
+#define CONFIG_DEFAULT_EL_STATS 0 /* Event loop latency instrumentation */
+#define CONFIG_DEFAULT_EL_SLOW_HANDLER_US 1000 /* Handlers slower than this are logged */
+#define CONFIG_DEFAULT_BIO_THREADS 3 /* Background job workers, see bio.c */
+#define CONFIG_DEFAULT_ACTIVE_REHASHING 1
+#define CONFIG_DEFAULT_ACTIVE_REHASH_BUDGET_US 1000 /* Per cron tick, for all the DBs */
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_MAX_CPU 25 /* Percent of the cron period to expire keys */
+#define CONFIG_DEFAULT_DICT_SHRINK_PERCENT 10 /* Shrink dict tables used below this, 0 = never */
 #define CONFIG_MIN_RESERVED_FDS 32
 #define LOG_MAX_LEN 1024                /* Default maximum length of syslog messages. */
 #define NET_IP_STR_LEN 46               /* INET6_ADDRSTRLEN is 46 */
@@ -50,6 +75,35 @@ stay safe. Since RESERVED_FDS defaults to 32, we add 96 in order to make sure of
 not over provisioning more than 128 fds. */
 #define CONFIG_FDSET_INCR (CONFIG_MIN_RESERVED_FDS + 96)
 
+/* Test for polling API */
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+/* io_uring is an opt-in build (make USE_IO_URING=yes) since it needs
+liburing. It is always built next to epoll, used as runtime fallback. */
+#if defined(USE_IO_URING) && defined(HAVE_EPOLL)
+#define HAVE_IO_URING 1
+#endif
+
+/* Multiplexing backend the event loops ask for, one of the AE_API_* of
+ae.h. A build with io_uring asks for it; it can also be set with
+-DCONFIG_DEFAULT_AE_API. */
+#ifndef CONFIG_DEFAULT_AE_API
+#ifdef HAVE_IO_URING
+#define CONFIG_DEFAULT_AE_API AE_API_IOURING
+#else
+#define CONFIG_DEFAULT_AE_API AE_API_DEFAULT
+#endif
+#endif
+
+/* Define redis_fsync to fdatasync() in Linux and fsync() for all the rest */
+#ifdef __linux__
+#define redis_fsync fdatasync
+#else
+#define redis_fsync fsync
+#endif
+
 /* Byte ordering detection */
 #include <sys/types.h>	/*This will likely define BYTE_ORDER*/
 
@@ -1,37 +1,766 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "dict.h"
+
+/* Using dictEnableResize() / dictDisableResize() we make possible to
+enable/disable resizing of the hash table as needed. This is very important
+for Redis, as we use copy-on-write and don't want to move too much memory
+around when there is a child performing saving operations.
+
+Note that even when dict_can_resize is set to 0, not all resizes are
+prevented: a hash table is still allowed to grow if the ratio between
+the number of elements and the buckets > dict_force_resize_ratio. */
+static int dict_can_resize = 1;
+static unsigned int dict_force_resize_ratio = 5;
+
+/* A table is shrunk when less than dict_shrink_percent of its buckets are
+used, to the size where it is a quarter to half full: a few adds or
+deletes then neither expand it again (at 100%) nor shrink it further.
+0 disables the shrinking. */
+static unsigned int dict_shrink_percent = 10;
+
+/* -------------------------- private prototypes ---------------------------- */
+
+static int _dictExpandIfNeeded(dict *d);
+static unsigned long _dictNextPower(unsigned long size);
+static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **existing);
+static int _dictSwissResize(dict *d, unsigned long size);
+static long _dictSwissFind(dict *d, const void *key, uint64_t hash);
+static dictEntry *_dictSwissAddRaw(dict *d, void *key, dictEntry **existing);
+static int _dictSwissDelete(dict *d, const void *key);
+static void _dictSwissClear(dict *d);
+static int _dictSlabClass(size_t size);
+static void *_dictSlabAlloc(dict *d, size_t size);
+static void _dictSlabFree(dict *d, void *ptr, size_t size);
+static size_t _dictSlabRelease(dict *d);
+static int _dictSlabPoolGrown(dictSlabPool *pool);
+static dictEntry *_dictEntryCreate(dict *d, void *key, dictEntry *next);
+static void _dictEntryFree(dict *d, dictEntry *de);
+static dictEntry *_dictFindConcurrent(dict *d, const void *key);
+static void _dictRehashBucketConcurrent(dict *d, unsigned long idx);
+static void _dictRetire(dict *d, void *ptr, int what);
+static void _dictReclaim(dict *d, uint64_t minepoch);
+static dictEntry **_dictFindLink(dict *d, const void *key);
+
+/* What to free with a retired object of a concurrent dict. */
+#define DICT_RETIRE_ENTRY 0
+#define DICT_RETIRE_KEY 1     /* Also free the key of the entry... */
+#define DICT_RETIRE_VAL 2     /* ...and its value. */
+#define DICT_RETIRE_TABLE 4   /* A bucket array. */
+
+/* Control bytes of the open addressing tables. A full slot holds H2, the
+7 low bits of the hash, so the sign bit is set only in the empty and
+deleted ones. */
+#define DICT_SWISS_EMPTY ((int8_t)-128)   /* 0x80 */
+#define DICT_SWISS_DELETED ((int8_t)-2)   /* 0xFE */
+#define DICT_SWISS_H1(hash) ((hash) >> 7) /* Selects the first group. */
+#define DICT_SWISS_H2(hash) ((int8_t)((hash) & 0x7f))
+
+/* Maximum load, tombstones included: 7/8 of the slots. */
+#define DICT_SWISS_MAX_LOAD(size) ((size) - (size) / 8)
+
+/* Allocator and resize counters of all the dicts, see dictGetAllocStats(). */
+static dictAllocStats dict_alloc_stats;
+
 /* ------------------ hash function ---------------------- */
 static uint8_t dict_hash_function_seed[16];
 void dictSetHashFunctionSeed(uint8_t *seed)
 {
 	memcpy(dict_hash_function_seed, seed, sizeof(dict_hash_function_seed));
 }
-static unsigned int dictGenHashFunction(const void *key,  int len)
+
+/* SipHash-1-2, keyed with the seed: for the keys that come from the
+clients, as it resists hash flooding. */
+uint64_t dictGenHashFunction(const void *key, int len)
+{
+	return siphash((const uint8_t*)key, len, dict_hash_function_seed);
+}
+
+/* wyhash (final version 4) by Wang Yi, a fast seeded hash of the
+wyhash/xxh3 class that passes SMHasher. It is not meant to resist an
+attacker who can observe the buckets, so it is for the dicts whose keys
+are not chosen by the clients. */
+static const uint64_t dict_wyp[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+	0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+static inline uint64_t _dictWymix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t _dictRead64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t _dictRead32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t _dictWyhash(const void *key, size_t len, uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t*)key;
+	uint64_t a, b;
+	__uint128_t r;
+
+	seed ^= _dictWymix(seed ^ dict_wyp[0], dict_wyp[1]);
+	if (len <= 16)
+	{
+		if (len >= 4)
+		{
+			a = (_dictRead32(p) << 32) | _dictRead32(p + ((len >> 3) << 2));
+			b = (_dictRead32(p + len - 4) << 32) | _dictRead32(p + len - 4 - ((len >> 3) << 2));
+		}
+		else if (len > 0)
+		{
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else
+		{
+			a = b = 0;
+		}
+	}
+	else
+	{
+		size_t i = len;
+
+		if (i > 48)
+		{
+			uint64_t see1 = seed, see2 = seed;
+			do
+			{
+				seed = _dictWymix(_dictRead64(p) ^ dict_wyp[1], _dictRead64(p + 8) ^ seed);
+				see1 = _dictWymix(_dictRead64(p + 16) ^ dict_wyp[2], _dictRead64(p + 24) ^ see1);
+				see2 = _dictWymix(_dictRead64(p + 32) ^ dict_wyp[3], _dictRead64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16)
+		{
+			seed = _dictWymix(_dictRead64(p) ^ dict_wyp[1], _dictRead64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = _dictRead64(p + i - 16);
+		b = _dictRead64(p + i - 8);
+	}
+	r = (__uint128_t)(a ^ dict_wyp[1]) * (b ^ seed);
+	return _dictWymix((uint64_t)r ^ dict_wyp[0] ^ len, (uint64_t)(r >> 64) ^ dict_wyp[1]);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* With AES-NI the keys longer than DICT_AES_HASH_MIN bytes go through AES
+rounds, in the way of the aeshash of the Go runtime: four lanes of 16
+bytes, every block being the round key of its lane, then three rounds
+mixing the lanes end the hash. wyhash is faster below: one multiply per
+8 bytes does not leave the AES latency chains the time to pay off. */
+#include <wmmintrin.h>
+
+#define DICT_AES_HASH_MIN 512
+
+__attribute__((target("aes,sse2")))
+static uint64_t _dictAesHash(const void *key, size_t len, uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t*)key, *end = p + len;
+	__m128i h0, h1, h2, h3;
+
+	if (len < DICT_AES_HASH_MIN)
+		return _dictWyhash(key, len, seed);
+	h0 = _mm_set_epi64x(seed ^ dict_wyp[0], len ^ dict_wyp[1]);
+	h1 = _mm_set_epi64x(seed ^ dict_wyp[1], len ^ dict_wyp[2]);
+	h2 = _mm_set_epi64x(seed ^ dict_wyp[2], len ^ dict_wyp[3]);
+	h3 = _mm_set_epi64x(seed ^ dict_wyp[3], len ^ dict_wyp[0]);
+	h0 = _mm_aesenc_si128(h0, h0);
+	h1 = _mm_aesenc_si128(h1, h1);
+	h2 = _mm_aesenc_si128(h2, h2);
+	h3 = _mm_aesenc_si128(h3, h3);
+	while (end - p > 64)
+	{
+		h0 = _mm_aesenc_si128(h0, _mm_loadu_si128((const __m128i*)p));
+		h1 = _mm_aesenc_si128(h1, _mm_loadu_si128((const __m128i*)(p + 16)));
+		h2 = _mm_aesenc_si128(h2, _mm_loadu_si128((const __m128i*)(p + 32)));
+		h3 = _mm_aesenc_si128(h3, _mm_loadu_si128((const __m128i*)(p + 48)));
+		p += 64;
+	}
+	/* The last 64 bytes, overlapping the previous blocks. */
+	h0 = _mm_aesenc_si128(h0, _mm_loadu_si128((const __m128i*)(end - 64)));
+	h1 = _mm_aesenc_si128(h1, _mm_loadu_si128((const __m128i*)(end - 48)));
+	h2 = _mm_aesenc_si128(h2, _mm_loadu_si128((const __m128i*)(end - 32)));
+	h3 = _mm_aesenc_si128(h3, _mm_loadu_si128((const __m128i*)(end - 16)));
+	h0 = _mm_aesenc_si128(h0, h1);
+	h2 = _mm_aesenc_si128(h2, h3);
+	h0 = _mm_aesenc_si128(h0, h2);
+	h2 = _mm_aesenc_si128(h2, h0);
+	h0 = _mm_aesenc_si128(h0, h2);
+	return (uint64_t)_mm_cvtsi128_si64(h0) ^
+		(uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(h0, h0));
+}
+#endif
+
+static uint64_t _dictFastHashResolve(const void *key, size_t len, uint64_t seed);
+/* Selected on the first call, depending on the CPU features. */
+static uint64_t (*dict_fast_hash)(const void *key, size_t len, uint64_t seed) =
+	_dictFastHashResolve;
+
+static uint64_t _dictFastHashResolve(const void *key, size_t len, uint64_t seed)
+{
+	dict_fast_hash = _dictWyhash;
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes"))
+		dict_fast_hash = _dictAesHash;
+#endif
+	return dict_fast_hash(key, len, seed);
+}
+
+/* Fast seeded hash for the keys not chosen by the clients. */
+uint64_t dictGenFastHashFunction(const void *key, int len)
+{
+	return dict_fast_hash(key, len, _dictRead64(dict_hash_function_seed));
+}
+
+/* Integer mixer, the finalizer of MurmurHash3 with the seed added in:
+every input bit changes about half of the output bits. For the dicts
+keyed by pointers or small integers, such as the modules dict. */
+uint64_t dictGenIntHashFunction(uint64_t key)
+{
+	key ^= _dictRead64(dict_hash_function_seed + 8);
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+/* dictGenIntHashFunction() of the pointer itself, to be used directly as
+the hashFunction of a dictType keyed by pointers. */
+uint64_t dictPtrHashFunction(const void *key)
+{
+	return dictGenIntHashFunction((uint64_t)(uintptr_t)key);
+}
+
+/* ----------------------------- entry layouts ----------------------------- */
+
+typedef struct dictEntryNoValue
+{
+	void *key;
+	dictEntry *next;
+} dictEntryNoValue;
+
+typedef struct dictEntryEmbedded
+{
+	dictVal v;
+	dictEntry *next;
+	unsigned char keyoff;
+	unsigned char key[];
+} dictEntryEmbedded;
+
+typedef struct dictEntryEmbeddedNoValue
+{
+	dictEntry *next;
+	unsigned char keyoff;
+	unsigned char key[];
+} dictEntryEmbeddedNoValue;
+
+#define dictEntryLayout(de) ((uintptr_t)(de) & DICT_ENTRY_MASK)
+#define dictEntryPtr(de) ((void*)((uintptr_t)(de) & ~(uintptr_t)DICT_ENTRY_MASK))
+#define dictEntryTag(ptr, layout) ((dictEntry*)((uintptr_t)(ptr) | (layout)))
+
+/* Can the dict store a key alone in a bucket, see dictEntryIsKey(). */
+#define dictBareKeys(d) ((d)->type->noValue && (d)->type->keysAreOdd && \
+	!(d)->type->embedKey)
+
+static inline void *_dictEntryKey(const dictEntry *de)
+{
+	if (dictEntryIsKey(de))
+		return (void*)de;
+	switch (dictEntryLayout(de))
+	{
+	case DICT_ENTRY_NO_VALUE:
+		return ((dictEntryNoValue*)dictEntryPtr(de))->key;
+	case DICT_ENTRY_EMBEDDED:
+	{
+		dictEntryEmbedded *e = (dictEntryEmbedded*)dictEntryPtr(de);
+		return e->key + e->keyoff;
+	}
+	case DICT_ENTRY_EMBEDDED_NO_VALUE:
+	{
+		dictEntryEmbeddedNoValue *e = (dictEntryEmbeddedNoValue*)dictEntryPtr(de);
+		return e->key + e->keyoff;
+	}
+	default:
+		return de->key;
+	}
+}
+
+/* The 'next' field of the entry, NULL for a key without entry: it is
+always the tail of its chain. */
+static inline dictEntry **_dictEntryNextRef(const dictEntry *de)
+{
+	if (dictEntryIsKey(de))
+		return NULL;
+	switch (dictEntryLayout(de))
+	{
+	case DICT_ENTRY_NO_VALUE:
+		return &((dictEntryNoValue*)dictEntryPtr(de))->next;
+	case DICT_ENTRY_EMBEDDED:
+		return &((dictEntryEmbedded*)dictEntryPtr(de))->next;
+	case DICT_ENTRY_EMBEDDED_NO_VALUE:
+		return &((dictEntryEmbeddedNoValue*)dictEntryPtr(de))->next;
+	default:
+		return &((dictEntry*)de)->next;
+	}
+}
+
+static inline dictEntry *_dictEntryNext(const dictEntry *de)
+{
+	dictEntry **next = _dictEntryNextRef(de);
+	return next ? *next : NULL;
+}
+
+static inline void _dictEntrySetNext(dictEntry *de, dictEntry *next)
+{
+	dictEntry **ref = _dictEntryNextRef(de);
+
+	assert(ref != NULL);
+	*ref = next;
+}
+
+void *dictGetKey(const dictEntry *de)
+{
+	return _dictEntryKey(de);
+}
+
+/* The value of the entry, NULL for the key only layouts. */
+void *dictGetVal(const dictEntry *de)
+{
+	if (dictEntryIsKey(de))
+		return NULL;
+	switch (dictEntryLayout(de))
+	{
+	case DICT_ENTRY_NORMAL:
+		return de->v.val;
+	case DICT_ENTRY_EMBEDDED:
+		return ((dictEntryEmbedded*)dictEntryPtr(de))->v.val;
+	default:
+		return NULL;
+	}
+}
+
+/* The value union of the entry, which must not be a key only one. */
+dictVal *dictEntryVal(const dictEntry *de)
+{
+	assert(!dictEntryIsKey(de));
+	switch (dictEntryLayout(de))
+	{
+	case DICT_ENTRY_NORMAL:
+		return &((dictEntry*)de)->v;
+	case DICT_ENTRY_EMBEDDED:
+		return &((dictEntryEmbedded*)dictEntryPtr(de))->v;
+	default:
+		assert(0);
+		return NULL;
+	}
+}
+
+/* Bytes of the entry, as given to _dictSlabAlloc(). */
+static size_t _dictEntrySize(dict *d, const dictEntry *de)
+{
+	unsigned char keyoff;
+
+	switch (dictEntryLayout(de))
+	{
+	case DICT_ENTRY_NO_VALUE:
+		return sizeof(dictEntryNoValue);
+	case DICT_ENTRY_EMBEDDED:
+		return offsetof(dictEntryEmbedded, key) +
+			d->type->embedKey(NULL, _dictEntryKey(de), &keyoff);
+	case DICT_ENTRY_EMBEDDED_NO_VALUE:
+		return offsetof(dictEntryEmbeddedNoValue, key) +
+			d->type->embedKey(NULL, _dictEntryKey(de), &keyoff);
+	default:
+		return sizeof(dictEntry);
+	}
+}
+
+/* Create the entry of 'key', in the smallest layout of the dict type,
+to be linked in front of 'next'. The key is embedded if the type wants
+to, otherwise it must already be duplicated. The value, if any, is not
+initialized. */
+static dictEntry *_dictEntryCreate(dict *d, void *key, dictEntry *next)
+{
+	dictType *type = d->type;
+
+	if (type->embedKey)
+	{
+		unsigned char keyoff;
+		size_t keylen = type->embedKey(NULL, key, &keyoff);
+
+		if (type->noValue)
+		{
+			dictEntryEmbeddedNoValue *e = (dictEntryEmbeddedNoValue*)_dictSlabAlloc(d,
+				offsetof(dictEntryEmbeddedNoValue, key) + keylen);
+			type->embedKey(e->key, key, &e->keyoff);
+			e->next = next;
+			return dictEntryTag(e, DICT_ENTRY_EMBEDDED_NO_VALUE);
+		}
+		dictEntryEmbedded *e = (dictEntryEmbedded*)_dictSlabAlloc(d,
+			offsetof(dictEntryEmbedded, key) + keylen);
+		type->embedKey(e->key, key, &e->keyoff);
+		e->next = next;
+		return dictEntryTag(e, DICT_ENTRY_EMBEDDED);
+	}
+	if (type->noValue)
+	{
+		dictEntryNoValue *e;
+
+		if (dictBareKeys(d) && next == NULL)
+		{
+			assert(dictEntryIsKey(key));
+			return (dictEntry*)key;
+		}
+		e = (dictEntryNoValue*)_dictSlabAlloc(d, sizeof(*e));
+		e->key = key;
+		e->next = next;
+		return dictEntryTag(e, DICT_ENTRY_NO_VALUE);
+	}
+	dictEntry *e = (dictEntry*)_dictSlabAlloc(d, sizeof(*e));
+	e->key = key;
+	e->next = next;
+	return e;
+}
+
+/* Free the entry itself, not its key nor its value. */
+static void _dictEntryFree(dict *d, dictEntry *de)
+{
+	if (dictEntryIsKey(de))
+		return;
+	_dictSlabFree(d, dictEntryPtr(de), _dictEntrySize(d, de));
+}
+
+/* A new entry with the key and the value of 'de', linked to 'next'. The
+key is shared with 'de', unless it is embedded. */
+static dictEntry *_dictEntryCopy(dict *d, dictEntry *de, dictEntry *next)
+{
+	dictEntry *copy = _dictEntryCreate(d, _dictEntryKey(de), next);
+
+	if (!d->type->noValue)
+		*dictEntryVal(copy) = *dictEntryVal(de);
+	return copy;
+}
+
+/* ----------------------------- API implementation ------------------------- */
+
+/* Copy 'src' to the table 'ht' of the dict. The readers of a concurrent
+dict load these fields while the writer changes them, see
+_dictFindConcurrent(): every field is then stored atomically. */
+static void _dictHtSet(dict *d, dictht *ht, const dictht *src)
+{
+	if (!d->type->concurrent)
+	{
+		*ht = *src;
+		return;
+	}
+	__atomic_store_n(&ht->table, src->table, __ATOMIC_RELAXED);
+	__atomic_store_n(&ht->size, src->size, __ATOMIC_RELAXED);
+	__atomic_store_n(&ht->sizemask, src->sizemask, __ATOMIC_RELAXED);
+	__atomic_store_n(&ht->used, src->used, __ATOMIC_RELAXED);
+}
+
+/* Reset a hash table already initialized with ht_init().
+NOTE: This function should only be called by ht_destroy(). */
+static void _dictReset(dict *d, dictht *ht)
+{
+	dictht empty = {NULL, 0, 0, 0};
+
+	_dictHtSet(d, ht, &empty);
+}
+
+/* The readers of a concurrent dict read ht[] under 'tableseq': it is odd
+while the writer changes the tables, and changed once it is done. */
+static inline void _dictTablesWriteBegin(dict *d)
+{
+	if (!d->type->concurrent)
+		return;
+	__atomic_store_n(&d->tableseq, d->tableseq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void _dictTablesWriteEnd(dict *d)
 {
-	return siphash(key, len, dict_hash_function_seed);
+	if (d->type->concurrent)
+		__atomic_store_n(&d->tableseq, d->tableseq + 1, __ATOMIC_RELEASE);
 }
 
 /* Create a new hash table */
 dict* dictCreate(dictType &type, void *privDataPtr)
 {
 	dict *d = new dict();
-	d.init()
+
+	d->type = &type;
+	_dictReset(d, &d->ht[0]);
+	_dictReset(d, &d->ht[1]);
+	d->privdata = privDataPtr;
+	d->rehashidx = -1;
+	d->iterators = 0;
+	d->swiss = NULL;
+	d->slabs = NULL;
+	d->tableseq = 0;
+	d->retired = NULL;
+	d->nretired = 0;
+	if (type.openAddressing && !type.concurrent)
+	{
+		d->swiss = (dictSwiss*)zcalloc(sizeof(dictSwiss));
+		_dictSwissResize(d, DICT_SWISS_GROUP);
+	}
+	return d;
 }
 
-int dictAdd(dict *d, void* key, void* val)
+/* Resize the table to the minimal size that contains all the elements,
+but with the invariant of a USED/BUCKETS ratio near to <= 1 */
+int dictResize(dict *d)
+{
+	unsigned long minimal;
+
+	if (!dict_can_resize || dictIsRehashing(d))
+		return DICT_ERR;
+	minimal = d->ht[0].used;
+	if (minimal < DICT_HT_INITIAL_SIZE)
+		minimal = DICT_HT_INITIAL_SIZE;
+	return dictExpand(d, minimal);
+}
+
+/* Expand or create the hash table. For an open addressing dict the table
+is sized so that 'size' elements fit below the maximum load factor. */
+int dictExpand(dict *d, unsigned long size)
 {
-	dictEntry *entry = dictAddRaw(d, key, NULL);
+	if (d->swiss)
+	{
+		if (size < d->swiss->used)
+			return DICT_ERR;
+		return _dictSwissResize(d, _dictNextPower(size + size / 7 + 1));
+	}
+
+	/* the size is invalid if it is smaller than the number of
+	elements already inside the hash table */
+	if (dictIsRehashing(d) || d->ht[0].used > size)
+		return DICT_ERR;
+
+	dictht n; /* the new hash table */
+	unsigned long realsize = _dictNextPower(size);
 
-	if (!entry)
+	/* Rehashing to the same table size is not useful. */
+	if (realsize == d->ht[0].size)
 		return DICT_ERR;
-	dictSetVal(d, entry, val);
+
+	/* Allocate the new hash table and initialize all pointers to NULL */
+	n.size = realsize;
+	n.sizemask = realsize - 1;
+	n.table = (dictEntry**)zcalloc(realsize * sizeof(dictEntry*));
+	n.used = 0;
+
+	/* Is this the first initialization? If so it's not really a rehashing
+	we just set the first hash table so that it can accept keys. */
+	if (d->ht[0].table == NULL)
+	{
+		_dictTablesWriteBegin(d);
+		_dictHtSet(d, &d->ht[0], &n);
+		_dictTablesWriteEnd(d);
+		return DICT_OK;
+	}
+
+	/* Prepare a second hash table for incremental rehashing */
+	_dictTablesWriteBegin(d);
+	_dictHtSet(d, &d->ht[1], &n);
+	_dictTablesWriteEnd(d);
+	d->rehashidx = 0;
 	return DICT_OK;
 }
 
+/* Performs N steps of incremental rehashing. Returns 1 if there are still
+keys to move from the old to the new hash table, otherwise 0 is returned.
+
+Note that a rehashing step consists in moving a bucket (that may have more
+than one key as we use chaining) from the old to the new hash table, however
+since part of the hash table may be composed of empty spaces, it is not
+guaranteed that this function will rehash even a single bucket, since it
+will visit at max N*10 empty buckets in total, otherwise the amount of
+work it does would be unbound and the function may block for a long time. */
+int dictRehash(dict *d, int n)
+{
+	int empty_visits = n * 10; /* Max number of empty buckets to visit. */
+
+	if (!dictIsRehashing(d))
+		return 0;
+
+	while (n-- && d->ht[0].used != 0)
+	{
+		dictEntry *de, *nextde;
+
+		/* Note that rehashidx can't overflow as we are sure there are more
+		elements because ht[0].used != 0 */
+		while (d->ht[0].table[d->rehashidx] == NULL)
+		{
+			d->rehashidx++;
+			if (--empty_visits == 0)
+				return 1;
+		}
+		if (d->type->concurrent)
+		{
+			_dictRehashBucketConcurrent(d, d->rehashidx++);
+			continue;
+		}
+		de = d->ht[0].table[d->rehashidx];
+		/* Move all the keys in this bucket from the old to the new hash HT */
+		while (de)
+		{
+			uint64_t h;
+			void *key = _dictEntryKey(de);
+			dictEntry **bucket;
+
+			nextde = _dictEntryNext(de);
+			/* Get the index in the new hash table */
+			h = dictHashKey(d, key) & d->ht[1].sizemask;
+			bucket = &d->ht[1].table[h];
+			/* A key alone in its new bucket does not need an entry, and
+			one that is not alone anymore needs one again. */
+			if (dictBareKeys(d) && *bucket == NULL && !dictEntryIsKey(de))
+			{
+				_dictEntryFree(d, de);
+				de = (dictEntry*)key;
+			}
+			else if (dictEntryIsKey(de) && *bucket != NULL)
+			{
+				de = _dictEntryCreate(d, key, *bucket);
+			}
+			else if (!dictEntryIsKey(de))
+			{
+				_dictEntrySetNext(de, *bucket);
+			}
+			*bucket = de;
+			d->ht[0].used--;
+			d->ht[1].used++;
+			de = nextde;
+		}
+		d->ht[0].table[d->rehashidx] = NULL;
+		d->rehashidx++;
+	}
+
+	/* Check if we already rehashed the whole table... */
+	if (d->ht[0].used == 0)
+	{
+		dictEntry **table = d->ht[0].table;
+
+		if (d->ht[1].size < d->ht[0].size)
+		{
+			dict_alloc_stats.shrinks++;
+			dict_alloc_stats.reclaimed_bytes +=
+				(d->ht[0].size - d->ht[1].size) * sizeof(dictEntry*);
+		}
+		_dictTablesWriteBegin(d);
+		_dictHtSet(d, &d->ht[0], &d->ht[1]);
+		_dictReset(d, &d->ht[1]);
+		_dictTablesWriteEnd(d);
+		d->rehashidx = -1;
+		if (d->type->concurrent)
+			_dictRetire(d, table, DICT_RETIRE_TABLE);
+		else
+			zfree(table);
+		return 0;
+	}
+
+	/* More to rehash... */
+	return 1;
+}
+
+static long long timeInMicroseconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (((long long)tv.tv_sec) * 1000000) + tv.tv_usec;
+}
+
+/* Rehash in batches of 100 buckets for about 'us' microseconds, so that a
+dict that is no longer written finishes its migration instead of being
+looked up in both tables forever. The time is checked between batches, so
+the budget may be exceeded by one batch. Nothing is done while there are
+iterators on the dict, for the same reason of _dictRehashStep().
+Returns the number of rehash steps performed. */
+int dictRehashMicroseconds(dict *d, long long us)
+{
+	long long start = timeInMicroseconds();
+	int rehashes = 0;
+
+	if (d->iterators)
+		return 0;
+	while (dictRehash(d, 100))
+	{
+		rehashes += 100;
+		if (timeInMicroseconds() - start > us)
+			break;
+	}
+	return rehashes;
+}
+
+/* Rehash for an amount of time between ms milliseconds and ms+1
+milliseconds */
+int dictRehashMilliseconds(dict *d, int ms)
+{
+	return dictRehashMicroseconds(d, (long long)ms * 1000);
+}
+
+/* This function performs just a step of rehashing, and only if there are
+no safe iterators bound to our hash table. When we have iterators in the
+middle of a rehashing we can't mess with the two hash tables otherwise
+some element can be missed or duplicated.
+
+This function is called by common lookup or update operations in the
+dictionary so that the hash table automatically migrates from H1 to H2
+while it is actively used. */
+static void _dictRehashStep(dict *d)
+{
+	if (d->iterators == 0)
+		dictRehash(d, 1);
+}
+
+static dictEntry *_dictAddRaw(dict *d, void *key, dictEntry **existing,
+	void *val, int setval);
+
+/* Add an element to the target hash table */
+int dictAdd(dict *d, void* key, void* val)
+{
+	dictEntry *entry = _dictAddRaw(d, key, NULL, val, !d->type->noValue);
+
+	return entry ? DICT_OK : DICT_ERR;
+}
+
 /* Low lover add or find:
 This function adds the entry but instead of setting a value returns the
-dictEntry structure to the user, that will make sure to fill the value 
+dictEntry structure to the user, that will make sure to fill the value
 field as he wishes.
 
-This function is also directly exposed to the user API to be called 
+This function is also directly exposed to the user API to be called
 mainly in order to store non-pointers inside the hash value, example:
 
 entry = dictAddRaw(dict, mykey, NULL);
@@ -43,13 +772,33 @@ If key already exists NULL is returned and "existing" is populated with
 the existing entry if existing is not NULL.
 
 If key was added, the hash entry is returned to be manipulated by the caller.
+In a key only dict it may be the key itself, see dictEntryIsKey().
+
+For an open addressing dict the returned entry lives in the table itself:
+it is only valid until the next insertion or deletion.
 */
 dictEntry* dictAddRaw(dict *d, void *key, dictEntry **existing)
+{
+	return _dictAddRaw(d, key, existing, NULL, 0);
+}
+
+/* dictAddRaw() that also sets the value if 'setval', before the entry is
+visible to the readers of a concurrent dict. */
+static dictEntry *_dictAddRaw(dict *d, void *key, dictEntry **existing,
+	void *val, int setval)
 {
 	long index;
 	dictEntry *entry;
 	dictht *ht;
 
+	if (d->swiss)
+	{
+		entry = _dictSwissAddRaw(d, key, existing);
+		if (entry && setval)
+			dictSetVal(d, entry, val);
+		return entry;
+	}
+
 	if (dictIsRehashing(d))
 		_dictRehashStep(d);
 
@@ -57,57 +806,1289 @@ dictEntry* dictAddRaw(dict *d, void *key, dictEntry **existing)
 	if ((index = _dictKeyIndex(d, key, dictHashKey(d, key), existing)) == -1)
 		return NULL;
 
-	/* Allocate memory and store the new entry. 
+	/* Allocate memory and store the new entry.
 	Insert the element in the top, with the assumption that in a database
 	system it is more likely that recently added entries are accessed more
 	frequently. */
 	ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-	entry = zmalloc(sizeof(*entry));
-	entry->next = ht->table[index];
-	ht->table[index] = entry;
+	if (d->type->keyDup && !d->type->embedKey)
+		key = d->type->keyDup(d->privdata, key);
+	entry = _dictEntryCreate(d, key, ht->table[index]);
+	if (setval)
+		dictSetVal(d, entry, val);
+	__atomic_store_n(&ht->table[index], entry, __ATOMIC_RELEASE);
 	ht->used++;
-
-	/* Set the sh entry fields. */
-	dictSetKey(d, entry, key);
 	return entry;
 }
 
-/* Returns the index of a free slot that can be populated with a hash entry 
-for the given 'key'. If the key already exists, -1 is returned and the optional
-output parameter may be filled.
+/* Add or Overwrite:
+Add an element, discarding the old value if the key already exists.
+Return 1 if the key was added from scratch, 0 if there was already an
+element with such key and dictReplace() just performed a value update
+operation. */
+int dictReplace(dict *d, void *key, void *val)
+{
+	dictEntry *entry, *existing;
+	void *oldval;
 
-Note that if we are in the process of rehashing the hash table, the index is always
-returned in the context of the second (new) hash table. */
+	/* Try to add the element. If the key does not exists dictAdd will
+	succeed. */
+	entry = _dictAddRaw(d, key, &existing, val, !d->type->noValue);
+	if (entry)
+		return 1;
+	if (d->type->noValue)
+		return 0;
 
+	/* The readers of a concurrent dict may be using the old value: link a
+	copy of the entry with the new value in place of the old one. */
+	if (d->type->concurrent)
+	{
+		dictEntry **link = _dictFindLink(d, key);
+		dictEntry *copy = _dictEntryCopy(d, existing, _dictEntryNext(existing));
 
-/* static function could not be invoked in another file. */
-static long _dictKeyIndex(dict *d, const void* key, uint64_t hash, dictEntry** existing)
+		dictSetVal(d, copy, val);
+		__atomic_store_n(link, copy, __ATOMIC_RELEASE);
+		_dictRetire(d, existing, DICT_RETIRE_VAL);
+		return 0;
+	}
+
+	/* Set the new value and free the old one. Note that it is important
+	to do that in this order, as the value may just be exactly the same
+	as the previous one. */
+	oldval = dictGetVal(existing);
+	dictSetVal(d, existing, val);
+	if (d->type->valDestructor)
+		d->type->valDestructor(d->privdata, oldval);
+	return 0;
+}
+
+/* Search and remove an element. Return DICT_OK if the key was found and
+removed, DICT_ERR otherwise. */
+int dictDelete(dict *d, const void *key)
 {
-	unsigned long idx, table;
-	dictEntry *he;
-	if (existing)
-		*existing = NULL;
+	uint64_t h, idx;
+	dictEntry *he, *prevHe;
+	int table;
 
-	/* Expand the table if needed. */
-	if (_dictExpandIfNeeded(d) == DICT_ERR)
-		return -1;
-	for (table = 0; table <= 1; table++)
-	{
-		idx = hash & d->ht[table].sizemask;
-		/* Search if this slot does not already contain the given key. */
-		he = d->ht[table].table[idx];
+	if (d->swiss)
+		return _dictSwissDelete(d, key);
+
+	if (d->ht[0].used == 0 && d->ht[1].used == 0)
+		return DICT_ERR;
+
+	if (dictIsRehashing(d))
+		_dictRehashStep(d);
+	h = dictHashKey(d, key);
+
+	for (table = 0; table <= 1; table++)
+	{
+		idx = h & d->ht[table].sizemask;
+		he = d->ht[table].table[idx];
+		prevHe = NULL;
+		while (he)
+		{
+			void *hekey = _dictEntryKey(he);
+
+			if (key == hekey || dictCompareKeys(d, key, hekey))
+			{
+				/* Unlink the element from the list */
+				dictEntry **link = prevHe ? _dictEntryNextRef(prevHe) :
+					&d->ht[table].table[idx];
+				__atomic_store_n(link, _dictEntryNext(he), __ATOMIC_RELEASE);
+				d->ht[table].used--;
+				if (d->type->concurrent)
+				{
+					_dictRetire(d, he, DICT_RETIRE_KEY | DICT_RETIRE_VAL);
+				}
+				else
+				{
+					dictFreeKey(d, he);
+					dictFreeVal(d, he);
+					_dictEntryFree(d, he);
+				}
+				dictShrinkIfNeeded(d);
+				return DICT_OK;
+			}
+			prevHe = he;
+			he = _dictEntryNext(he);
+		}
+		if (!dictIsRehashing(d))
+			break;
+	}
+	return DICT_ERR; /* not found */
+}
+
+/* Destroy an entire dictionary. With 'bulk' set the entries are not
+freed one by one: their slabs are about to be released all together.
+Embedded key entries too big for the slabs were malloc'ed on their own,
+and are still freed. */
+static int _dictClear(dict *d, dictht *ht, int bulk)
+{
+	unsigned long i;
+
+	/* Free all the elements */
+	for (i = 0; i < ht->size && ht->used > 0; i++)
+	{
+		dictEntry *he, *nextHe;
+
+		if ((he = ht->table[i]) == NULL)
+			continue;
+		while (he)
+		{
+			nextHe = _dictEntryNext(he);
+			dictFreeKey(d, he);
+			dictFreeVal(d, he);
+			if (!bulk || (d->type->embedKey &&
+				_dictSlabClass(_dictEntrySize(d, he)) == -1))
+				_dictEntryFree(d, he);
+			ht->used--;
+			he = nextHe;
+		}
+	}
+	/* Free the table and the allocated cache structure */
+	zfree(ht->table);
+	/* Re-initialize the table */
+	_dictReset(d, ht);
+	return DICT_OK; /* never fails */
+}
+
+/* Clear & Release the hash table */
+void dictRelease(dict *d)
+{
+	if (d->swiss)
+	{
+		_dictSwissClear(d);
+		zfree(d->swiss);
+	}
+	/* The caller stopped the lookups, wait for the ones in flight. */
+	if (d->type->concurrent)
+	{
+		dictEpochSynchronize();
+		_dictReclaim(d, UINT64_MAX);
+	}
+	_dictClear(d, &d->ht[0], 1);
+	_dictClear(d, &d->ht[1], 1);
+	_dictSlabRelease(d);
+	delete d;
+}
+
+dictEntry *dictFind(dict *d, const void *key)
+{
+	dictEntry *he;
+	uint64_t h, idx, table;
+
+	if (d->swiss)
+	{
+		long slot = _dictSwissFind(d, key, dictHashKey(d, key));
+		return slot == -1 ? NULL : &d->swiss->slots[slot];
+	}
+	if (d->type->concurrent)
+		return _dictFindConcurrent(d, key);
+
+	if (d->ht[0].used + d->ht[1].used == 0)
+		return NULL; /* dict is empty */
+	if (dictIsRehashing(d))
+		_dictRehashStep(d);
+	h = dictHashKey(d, key);
+	for (table = 0; table <= 1; table++)
+	{
+		idx = h & d->ht[table].sizemask;
+		he = d->ht[table].table[idx];
+		while (he)
+		{
+			void *hekey = _dictEntryKey(he);
+
+			if (key == hekey || dictCompareKeys(d, key, hekey))
+				return he;
+			he = _dictEntryNext(he);
+		}
+		if (!dictIsRehashing(d))
+			return NULL;
+	}
+	return NULL;
+}
+
+void *dictFetchValue(dict *d, const void *key)
+{
+	dictEntry *he;
+
+	he = dictFind(d, key);
+	return he ? dictGetVal(he) : NULL;
+}
+
+/* Look up the keys of a batch in stages rather than one after the other:
+hash all of them, prefetch all their buckets, then prefetch the first
+entry of every bucket, and only then compare, so that the cache misses of
+the keys overlap instead of stalling each lookup in turn. The keys are
+processed DICT_FIND_BATCH at a time, about what the CPU keeps in flight.
+'out[j]' is set to the entry of 'keys[j]', or NULL. Returns the number of
+keys found. */
+unsigned long dictFindBatch(dict *d, const void **keys, unsigned long n, dictEntry **out)
+{
+	uint64_t hashes[DICT_FIND_BATCH];
+	unsigned long found = 0;
+
+	for (unsigned long base = 0; base < n; base += DICT_FIND_BATCH)
+	{
+		unsigned long count = n - base < DICT_FIND_BATCH ? n - base : DICT_FIND_BATCH;
+		const void **k = keys + base;
+		dictEntry **o = out + base;
+
+		if (d->swiss)
+		{
+			dictSwiss *st = d->swiss;
+			unsigned long groups = st->size / DICT_SWISS_GROUP;
+
+			for (unsigned long j = 0; j < count; j++)
+			{
+				unsigned long g = DICT_SWISS_H1(hashes[j] = dictHashKey(d, k[j])) & (groups - 1);
+				__builtin_prefetch(st->ctrl + g * DICT_SWISS_GROUP);
+				__builtin_prefetch(st->slots + g * DICT_SWISS_GROUP);
+			}
+			for (unsigned long j = 0; j < count; j++)
+			{
+				long slot = _dictSwissFind(d, k[j], hashes[j]);
+				o[j] = slot == -1 ? NULL : &st->slots[slot];
+				found += slot != -1;
+			}
+			continue;
+		}
+
+		if (d->type->concurrent)
+		{
+			for (unsigned long j = 0; j < count; j++)
+				found += (o[j] = _dictFindConcurrent(d, k[j])) != NULL;
+			continue;
+		}
+		if (d->ht[0].used + d->ht[1].used == 0)
+		{
+			memset(o, 0, count * sizeof(*o));
+			continue;
+		}
+		if (dictIsRehashing(d) && d->iterators == 0)
+			dictRehash(d, count);
+		for (unsigned long j = 0; j < count; j++)
+		{
+			hashes[j] = dictHashKey(d, k[j]);
+			__builtin_prefetch(&d->ht[0].table[hashes[j] & d->ht[0].sizemask]);
+			if (dictIsRehashing(d))
+				__builtin_prefetch(&d->ht[1].table[hashes[j] & d->ht[1].sizemask]);
+		}
+		for (unsigned long j = 0; j < count; j++)
+		{
+			for (int table = 0; table <= dictIsRehashing(d); table++)
+			{
+				dictEntry *he = d->ht[table].table[hashes[j] & d->ht[table].sizemask];
+				if (he)
+					__builtin_prefetch(dictEntryIsKey(he) ? (void*)he : dictEntryPtr(he));
+			}
+		}
+		for (unsigned long j = 0; j < count; j++)
+		{
+			o[j] = NULL;
+			for (int table = 0; table <= dictIsRehashing(d) && !o[j]; table++)
+			{
+				dictEntry *he = d->ht[table].table[hashes[j] & d->ht[table].sizemask];
+				while (he)
+				{
+					void *hekey = _dictEntryKey(he);
+
+					if (k[j] == hekey || dictCompareKeys(d, k[j], hekey))
+					{
+						o[j] = he;
+						found++;
+						break;
+					}
+					he = _dictEntryNext(he);
+				}
+			}
+		}
+	}
+	return found;
+}
+
+/* Function to reverse bits. Algorithm from:
+http://graphics.stanford.edu/~seander/bithacks.html#ReverseParallel */
+static unsigned long rev(unsigned long v)
+{
+	unsigned long s = 8 * sizeof(v); /* bit size; must be power of 2 */
+	unsigned long mask = ~0UL;
+
+	while ((s >>= 1) > 0)
+	{
+		mask ^= (mask << s);
+		v = ((v >> s) & mask) | ((v << s) & ~mask);
+	}
+	return v;
+}
+
+/* Entries of the scan being collected for the callbacks. The next entry
+of the chain is read before the callback runs, so that the callback may
+delete the entries it gets: the tables are neither rehashed nor resized
+until the last batch was given, see _dictScan(). */
+typedef struct dictScanState
+{
+	dictScanFunction *fn;
+	dictScanBatchFunction *batchfn;
+	void *privdata;
+	dictEntry *batch[DICT_SCAN_BATCH];
+	unsigned long count;     /* Entries in 'batch'. */
+	unsigned long emitted;   /* Entries of this call. */
+	unsigned long buckets;   /* Buckets of this call. */
+} dictScanState;
+
+static void _dictScanFlush(dictScanState *state)
+{
+	if (state->count)
+		state->batchfn(state->privdata, state->batch, state->count);
+	state->count = 0;
+}
+
+static void _dictScanBucket(dictScanState *state, dictEntry *de)
+{
+	state->buckets++;
+	while (de)
+	{
+		dictEntry *next = _dictEntryNext(de);
+
+		if (state->fn)
+		{
+			state->fn(state->privdata, de);
+		}
+		else
+		{
+			state->batch[state->count++] = de;
+			if (state->count == DICT_SCAN_BATCH)
+				_dictScanFlush(state);
+		}
+		state->emitted++;
+		de = next;
+	}
+}
+
+/* dictScan() and dictScanBatch(): visit the buckets of cursor 'v' and
+return the next cursor, 0 once the whole dict was visited, and go on with
+the next cursors until 'limit' entries were visited, or the end. At most
+10*limit buckets are visited, so that the call stays short on a table
+left sparse by deletions.
+
+The cursor is incremented from its most significant bit down, as in a
+reversed binary counter. The buckets that a cursor covers in a table of
+2^N buckets are then the buckets it covers in a table of 2^M buckets,
+whatever M, so that the cursors already done never have to be visited
+again after the table grows or shrinks between two calls. While rehashing
+both tables are visited: the bucket of the cursor in the small table,
+then all its expansions in the big one.
+
+So every element present from the start to the end of a full scan is
+returned at least once, an element may be returned more than once when
+the table shrinks, and nothing is held between calls: there is no
+iterator, and the rehashing and the resizes are only paused during a
+call. An open addressing table is scanned by slot: it is only complete if
+the table is not resized between the calls. */
+static unsigned long _dictScan(dict *d, unsigned long v, unsigned long limit,
+	dictScanState *state)
+{
+	dictht *t0, *t1;
+	unsigned long m0, m1;
+
+	if (dictSize(d) == 0)
+		return 0;
+
+	/* Pause the rehashing and the resizes, a callback may add or delete,
+	until the last batch was given. */
+	d->iterators++;
+	if (d->swiss)
+	{
+		dictSwiss *st = d->swiss;
+
+		for (; v < st->size; v++)
+		{
+			if (st->ctrl[v] < 0)
+				state->buckets++;
+			else
+				_dictScanBucket(state, &st->slots[v]);
+			if (state->emitted >= limit || state->buckets >= limit * 10)
+				break;
+		}
+		v = v + 1 < st->size ? v + 1 : 0;
+		if (state->batchfn)
+			_dictScanFlush(state);
+		d->iterators--;
+		return v;
+	}
+
+	do
+	{
+		if (!dictIsRehashing(d))
+		{
+			t0 = &d->ht[0];
+			m0 = t0->sizemask;
+
+			/* Emit entries at cursor */
+			_dictScanBucket(state, t0->table[v & m0]);
+
+			/* Set unmasked bits so incrementing the reversed cursor
+			operates on the masked bits */
+			v |= ~m0;
+
+			/* Increment the reverse cursor */
+			v = rev(v);
+			v++;
+			v = rev(v);
+		}
+		else
+		{
+			t0 = &d->ht[0];
+			t1 = &d->ht[1];
+
+			/* Make sure t0 is the smaller and t1 is the bigger table */
+			if (t0->size > t1->size)
+			{
+				t0 = &d->ht[1];
+				t1 = &d->ht[0];
+			}
+			m0 = t0->sizemask;
+			m1 = t1->sizemask;
+
+			/* Emit entries at cursor */
+			_dictScanBucket(state, t0->table[v & m0]);
+
+			/* Iterate over indices in larger table that are the expansion
+			of the index pointed to by the cursor in the smaller table */
+			do
+			{
+				/* Emit entries at cursor */
+				_dictScanBucket(state, t1->table[v & m1]);
+
+				/* Increment the reverse cursor not covered by the smaller mask.*/
+				v |= ~m1;
+				v = rev(v);
+				v++;
+				v = rev(v);
+
+				/* Continue while bits covered by mask difference is non-zero */
+			} while (v & (m0 ^ m1));
+		}
+	} while (v != 0 && state->emitted < limit && state->buckets < limit * 10);
+	if (state->batchfn)
+		_dictScanFlush(state);
+	d->iterators--;
+	return v;
+}
+
+/* Visit with 'fn' the entries from the cursor 'v' up to the first non
+empty cursor (or the limit of empty buckets), and return the next
+cursor, 0 when done. Start with a cursor of 0. */
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata)
+{
+	dictScanState state;
+
+	state.fn = fn;
+	state.batchfn = NULL;
+	state.privdata = privdata;
+	state.count = state.emitted = state.buckets = 0;
+	return _dictScan(d, v, 1, &state);
+}
+
+/* Like dictScan(), but going on with the next cursors until at least
+'limit' entries were visited, whole buckets at a time, and giving them to
+'fn' up to DICT_SCAN_BATCH at a time. */
+unsigned long dictScanBatch(dict *d, unsigned long v, unsigned long limit,
+	dictScanBatchFunction *fn, void *privdata)
+{
+	dictScanState state;
+
+	state.fn = NULL;
+	state.batchfn = fn;
+	state.privdata = privdata;
+	state.count = state.emitted = state.buckets = 0;
+	return _dictScan(d, v, limit, &state);
+}
+
+/* A random cursor to start a partial scan from, to sample the dict. The
+cursor of an open addressing table is a slot index, so it must be below
+the table size; any value is valid for the chained tables. */
+unsigned long dictRandomCursor(dict *d)
+{
+	unsigned long cursor = ((unsigned long)random() << 31) ^ random();
+
+	if (d->swiss)
+		return cursor & (d->swiss->size - 1);
+	return cursor;
+}
+
+/* ------------------------- private functions ------------------------------ */
+
+/* Expand the hash table if needed */
+static int _dictExpandIfNeeded(dict *d)
+{
+	/* Incremental rehashing already in progress. Return. */
+	if (dictIsRehashing(d))
+		return DICT_OK;
+
+	/* If the hash table is empty expand it to the initial size. */
+	if (d->ht[0].size == 0)
+		return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+	/* If we reached the 1:1 ratio, and we are allowed to resize the hash
+	table (global setting) or we should avoid it but the ratio between
+	elements/buckets is over the "safe" threshold, we resize doubling
+	the number of buckets. */
+	if (d->ht[0].used >= d->ht[0].size &&
+		(dict_can_resize ||
+		 d->ht[0].used / d->ht[0].size > dict_force_resize_ratio))
+	{
+		return dictExpand(d, d->ht[0].used * 2);
+	}
+	return DICT_OK;
+}
+
+/* Shrink the table if it is used below dict_shrink_percent, see there.
+The shrinking is an incremental rehash to the smaller table, like an
+expand. A dict that becomes empty also gives back its entry slabs. Called
+after every delete, and by the server cron for the dicts that stopped
+being written while resizing was disabled. Returns DICT_OK if the dict
+was shrunk. */
+int dictShrinkIfNeeded(dict *d)
+{
+	/* A scan or a safe iterator holds entries of the current tables. */
+	if (d->iterators)
+		return DICT_ERR;
+	if (d->swiss)
+	{
+		dictSwiss *st = d->swiss;
+		unsigned long size = _dictNextPower(st->used * 2 + st->used / 4 + 1);
+
+		if (!dict_can_resize || !dict_shrink_percent || st->size <= DICT_SWISS_GROUP ||
+			st->used * 100 >= st->size * dict_shrink_percent || size >= st->size)
+			return DICT_ERR;
+		dict_alloc_stats.shrinks++;
+		dict_alloc_stats.reclaimed_bytes += (st->size - (size < DICT_SWISS_GROUP ?
+			DICT_SWISS_GROUP : size)) * (1 + sizeof(dictEntry));
+		return _dictSwissResize(d, size);
+	}
+
+	/* Keep the slabs of a dict that only had a few entries: it would
+	allocate them again with the next add. */
+	if (dictSize(d) == 0 && d->slabs && d->nretired == 0 && d->iterators == 0 &&
+		_dictSlabPoolGrown(d->slabs))
+		dict_alloc_stats.reclaimed_bytes += _dictSlabRelease(d);
+	if (!dict_can_resize || !dict_shrink_percent || dictIsRehashing(d) ||
+		d->ht[0].size <= DICT_HT_INITIAL_SIZE ||
+		d->ht[0].used * 100 >= d->ht[0].size * dict_shrink_percent)
+		return DICT_ERR;
+	return dictExpand(d, d->ht[0].used * 2);
+}
+
+/* Set the fill percentage under which the tables are shrunk, 0 to never
+shrink them. */
+void dictSetShrinkPercent(unsigned int percent)
+{
+	dict_shrink_percent = percent;
+}
+
+/* Our hash table capability is a power of two */
+static unsigned long _dictNextPower(unsigned long size)
+{
+	unsigned long i = DICT_HT_INITIAL_SIZE;
+
+	if (size >= LONG_MAX)
+		return LONG_MAX + 1LU;
+	while (1)
+	{
+		if (i >= size)
+			return i;
+		i *= 2;
+	}
+}
+
+/* Returns the index of a free slot that can be populated with a hash entry
+for the given 'key'. If the key already exists, -1 is returned and the optional
+output parameter may be filled.
+
+Note that if we are in the process of rehashing the hash table, the index is always
+returned in the context of the second (new) hash table. */
+
+
+/* static function could not be invoked in another file. */
+static long _dictKeyIndex(dict *d, const void* key, uint64_t hash, dictEntry** existing)
+{
+	unsigned long idx, table;
+	dictEntry *he;
+	if (existing)
+		*existing = NULL;
+
+	/* Expand the table if needed. */
+	if (_dictExpandIfNeeded(d) == DICT_ERR)
+		return -1;
+	for (table = 0; table <= 1; table++)
+	{
+		idx = hash & d->ht[table].sizemask;
+		/* Search if this slot does not already contain the given key. */
+		he = d->ht[table].table[idx];
 		while(he)
 		{
-			if (key == he->key || dictCompareKeys(d, key, he->key))
+			void *hekey = _dictEntryKey(he);
+
+			if (key == hekey || dictCompareKeys(d, key, hekey))
 			{
 				if (existing)
 					*existing = he;
 				return -1;
 			}
-			he = he->next;
+			he = _dictEntryNext(he);
 		}
 		if (!dictIsRehashing(d))
 			break;
 	}
 	return idx;
 }
+
+void dictEnableResize(void)
+{
+	dict_can_resize = 1;
+}
+
+void dictDisableResize(void)
+{
+	dict_can_resize = 0;
+}
+
+/* ------------------------- open addressing table -------------------------- */
+
+/* Bitmask of the slots of 'group' whose control byte is 'h2'. */
+static inline unsigned _dictSwissMatch(const int8_t *group, int8_t h2)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+#else
+	unsigned mask = 0;
+	for (int j = 0; j < DICT_SWISS_GROUP; j++)
+		if (group[j] == h2)
+			mask |= 1U << j;
+	return mask;
+#endif
+}
+
+/* Bitmask of the slots of 'group' that are empty or deleted. */
+static inline unsigned _dictSwissMatchFree(const int8_t *group)
+{
+#ifdef __SSE2__
+	return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	unsigned mask = 0;
+	for (int j = 0; j < DICT_SWISS_GROUP; j++)
+		if (group[j] < 0)
+			mask |= 1U << j;
+	return mask;
+#endif
+}
+
+/* Groups are probed quadratically (triangular numbers), which visits every
+group of a power of two table. A lookup stops at the first group having an
+empty slot: the key would have been stored there. */
+#define dictSwissForEachGroup(st, hash, g, step) \
+	for (g = DICT_SWISS_H1(hash) & ((st)->size / DICT_SWISS_GROUP - 1), step = 1; \
+		step <= (st)->size / DICT_SWISS_GROUP; \
+		g = (g + step++) & ((st)->size / DICT_SWISS_GROUP - 1))
+
+/* Return the slot of 'key', or -1 if it is not in the table. */
+static long _dictSwissFind(dict *d, const void *key, uint64_t hash)
+{
+	dictSwiss *st = d->swiss;
+	int8_t h2 = DICT_SWISS_H2(hash);
+	unsigned long g, step;
+
+	dictSwissForEachGroup(st, hash, g, step)
+	{
+		const int8_t *group = st->ctrl + g * DICT_SWISS_GROUP;
+		unsigned match = _dictSwissMatch(group, h2);
+
+		while (match)
+		{
+			unsigned long slot = g * DICT_SWISS_GROUP + __builtin_ctz(match);
+			dictEntry *he = &st->slots[slot];
+			if (key == he->key || dictCompareKeys(d, key, he->key))
+				return slot;
+			match &= match - 1;
+		}
+		if (_dictSwissMatch(group, DICT_SWISS_EMPTY))
+			return -1;
+	}
+	return -1;
+}
+
+/* Return the first empty or deleted slot on the probe sequence of 'hash'.
+The table always has one, see _dictSwissAddRaw(). */
+static unsigned long _dictSwissFindFree(dictSwiss *st, uint64_t hash)
+{
+	unsigned long g, step;
+
+	dictSwissForEachGroup(st, hash, g, step)
+	{
+		unsigned match = _dictSwissMatchFree(st->ctrl + g * DICT_SWISS_GROUP);
+		if (match)
+			return g * DICT_SWISS_GROUP + __builtin_ctz(match);
+	}
+	return 0; /* Not reached. */
+}
+
+/* Rehash the whole table into a new one of 'size' slots, dropping the
+tombstones. The entries are moved, so nothing is done while there are
+iterators on the dict, unless no slot is left for the next add. */
+static int _dictSwissResize(dict *d, unsigned long size)
+{
+	dictSwiss *st = d->swiss;
+	int8_t *ctrl = st->ctrl;
+	dictEntry *slots = st->slots;
+	unsigned long oldsize = st->size;
+
+	if (d->iterators && st->used + st->deleted < st->size)
+		return DICT_ERR;
+	if (size < DICT_SWISS_GROUP)
+		size = DICT_SWISS_GROUP;
+	st->ctrl = (int8_t*)zmalloc(size);
+	st->slots = (dictEntry*)zmalloc(size * sizeof(dictEntry));
+	memset(st->ctrl, DICT_SWISS_EMPTY, size);
+	st->size = size;
+	st->deleted = 0;
+
+	for (unsigned long j = 0; j < oldsize; j++)
+	{
+		uint64_t hash;
+		unsigned long slot;
+
+		if (ctrl[j] < 0)
+			continue;
+		hash = dictHashKey(d, slots[j].key);
+		slot = _dictSwissFindFree(st, hash);
+		st->ctrl[slot] = DICT_SWISS_H2(hash);
+		st->slots[slot] = slots[j];
+	}
+	zfree(ctrl);
+	zfree(slots);
+	return DICT_OK;
+}
+
+static dictEntry *_dictSwissAddRaw(dict *d, void *key, dictEntry **existing)
+{
+	dictSwiss *st = d->swiss;
+	uint64_t hash = dictHashKey(d, key);
+	long found = _dictSwissFind(d, key, hash);
+	unsigned long slot;
+
+	if (existing)
+		*existing = found == -1 ? NULL : &st->slots[found];
+	if (found != -1)
+		return NULL;
+
+	/* Keep at least one empty slot per probe sequence: double the table
+	when it is really full, or just drop the tombstones in place when they
+	are what fills it (live entries under 25/32 of the slots). */
+	if (st->used + st->deleted + 1 > DICT_SWISS_MAX_LOAD(st->size))
+	{
+		if ((st->used + 1) * 32 > st->size * 25)
+			_dictSwissResize(d, st->size * 2);
+		else
+			_dictSwissResize(d, st->size);
+	}
+
+	slot = _dictSwissFindFree(st, hash);
+	if (st->ctrl[slot] == DICT_SWISS_DELETED)
+		st->deleted--;
+	st->ctrl[slot] = DICT_SWISS_H2(hash);
+	st->used++;
+	dictSetKey(d, &st->slots[slot], key);
+	st->slots[slot].next = NULL;
+	return &st->slots[slot];
+}
+
+static int _dictSwissDelete(dict *d, const void *key)
+{
+	dictSwiss *st = d->swiss;
+	long slot = _dictSwissFind(d, key, dictHashKey(d, key));
+	int8_t *group;
+
+	if (slot == -1)
+		return DICT_ERR;
+	dictFreeKey(d, &st->slots[slot]);
+	dictFreeVal(d, &st->slots[slot]);
+	/* A group that still has an empty slot never made a probe sequence
+	move past it, so the slot can become empty again. Otherwise a
+	tombstone keeps the lookups going to the next groups. */
+	group = st->ctrl + (slot / DICT_SWISS_GROUP) * DICT_SWISS_GROUP;
+	if (_dictSwissMatch(group, DICT_SWISS_EMPTY))
+	{
+		st->ctrl[slot] = DICT_SWISS_EMPTY;
+	}
+	else
+	{
+		st->ctrl[slot] = DICT_SWISS_DELETED;
+		st->deleted++;
+	}
+	st->used--;
+	dictShrinkIfNeeded(d);
+	return DICT_OK;
+}
+
+static void _dictSwissClear(dict *d)
+{
+	dictSwiss *st = d->swiss;
+
+	for (unsigned long j = 0; j < st->size && st->used > 0; j++)
+	{
+		if (st->ctrl[j] < 0)
+			continue;
+		dictFreeKey(d, &st->slots[j]);
+		dictFreeVal(d, &st->slots[j]);
+		st->used--;
+	}
+	zfree(st->ctrl);
+	zfree(st->slots);
+	st->ctrl = NULL;
+	st->slots = NULL;
+	st->size = st->deleted = 0;
+}
+
+/* ----------------------------- entry slabs -------------------------------- */
+
+static const size_t dict_slab_class_size[DICT_SLAB_CLASSES] = {16, 24, 32, 48, 64};
+
+static unsigned long long dict_alloc_calls;  /* Objects allocated or freed. */
+static unsigned long long dict_slab_calls;   /* Slabs allocated or freed. */
+
+/* The slabs freed by _dictSlabRelease(). dictRelease() may run in another
+thread than the one owning the dicts, such as the lazy free thread, so
+these are kept apart from the counters above and updated atomically. */
+static unsigned long long dict_released_objects;
+static unsigned long long dict_released_malloc_bytes;
+static unsigned long long dict_released_slab_bytes;
+static unsigned long long dict_released_slabs;
+
+/* Index of the smallest class holding 'size' bytes, or -1 if the object
+is too big for the slabs. */
+static int _dictSlabClass(size_t size)
+{
+	for (int c = 0; c < DICT_SLAB_CLASSES; c++)
+		if (size <= dict_slab_class_size[c])
+			return c;
+	return -1;
+}
+
+/* What malloc() would take for 'size' bytes: a header word, rounded up
+to 16 bytes, as both glibc and jemalloc do for small sizes. */
+static size_t _dictMallocFootprint(size_t size)
+{
+	return (size + sizeof(size_t) + 15) & ~(size_t)15;
+}
+
+static void *_dictSlabAlloc(dict *d, size_t size)
+{
+	int c = _dictSlabClass(size);
+	dictSlabBin *bin;
+	void *obj;
+
+	if (c == -1)
+		return zmalloc(size);
+	if (d->slabs == NULL)
+		d->slabs = (dictSlabPool*)zcalloc(sizeof(dictSlabPool));
+	bin = &d->slabs->bins[c];
+
+	if (bin->freelist)
+	{
+		obj = bin->freelist;
+		bin->freelist = *(void**)obj;
+	}
+	else
+	{
+		if (bin->cur == bin->end)
+		{
+			size_t objects = bin->nextobjects ? bin->nextobjects : DICT_SLAB_MIN_OBJECTS;
+			size_t bytes = sizeof(dictSlab) + objects * dict_slab_class_size[c];
+			dictSlab *slab = (dictSlab*)zmalloc(bytes);
+
+			slab->bytes = bytes;
+			slab->next = bin->slabs;
+			bin->slabs = slab;
+			bin->cur = (char*)(slab + 1);
+			bin->end = bin->cur + objects * dict_slab_class_size[c];
+			bin->nextobjects = objects * 2 > DICT_SLAB_MAX_OBJECTS ?
+				DICT_SLAB_MAX_OBJECTS : objects * 2;
+			dict_alloc_stats.slab_bytes += bytes;
+			dict_slab_calls++;
+		}
+		obj = bin->cur;
+		bin->cur += dict_slab_class_size[c];
+	}
+	dict_alloc_stats.objects++;
+	dict_alloc_stats.malloc_bytes += _dictMallocFootprint(dict_slab_class_size[c]);
+	dict_alloc_calls++;
+	return obj;
+}
+
+/* Give back an object of 'size' bytes, the same size it was allocated
+with. */
+static void _dictSlabFree(dict *d, void *ptr, size_t size)
+{
+	int c = _dictSlabClass(size);
+	dictSlabBin *bin;
+
+	if (c == -1)
+	{
+		zfree(ptr);
+		return;
+	}
+	bin = &d->slabs->bins[c];
+	*(void**)ptr = bin->freelist;
+	bin->freelist = ptr;
+	dict_alloc_stats.objects--;
+	dict_alloc_stats.malloc_bytes -= _dictMallocFootprint(dict_slab_class_size[c]);
+	dict_alloc_calls++;
+}
+
+/* Bytes allocated for the entry 'de' out of the tables, as the slabs or
+malloc() hold it: none for a bare key or the slot of an open addressing
+table. */
+size_t dictEntryMemUsage(dict *d, const dictEntry *de)
+{
+	size_t size;
+	int c;
+
+	if (d->swiss || dictEntryIsKey(de))
+		return 0;
+	size = _dictEntrySize(d, de);
+	c = _dictSlabClass(size);
+	return c == -1 ? _dictMallocFootprint(size) : dict_slab_class_size[c];
+}
+
+/* Has the pool more than one slab in some class. */
+static int _dictSlabPoolGrown(dictSlabPool *pool)
+{
+	for (int c = 0; c < DICT_SLAB_CLASSES; c++)
+		if (pool->bins[c].slabs && pool->bins[c].slabs->next)
+			return 1;
+	return 0;
+}
+
+/* Free every slab of the dict, and so every entry still allocated.
+Returns the bytes of the slabs. */
+static size_t _dictSlabRelease(dict *d)
+{
+	unsigned long long objects = 0, malloc_bytes = 0, slab_bytes = 0, slabs = 0;
+
+	if (d->slabs == NULL)
+		return 0;
+	for (int c = 0; c < DICT_SLAB_CLASSES; c++)
+	{
+		dictSlabBin *bin = &d->slabs->bins[c];
+		dictSlab *slab = bin->slabs;
+		size_t size = dict_slab_class_size[c];
+		unsigned long long allocated = 0;
+
+		/* The objects still allocated are the ones handed out minus the
+		ones in the free list, account them as freed. The free list lives
+		in the slabs: walk it first. */
+		for (void *obj = bin->freelist; obj; obj = *(void**)obj)
+			allocated--;
+		while (slab)
+		{
+			dictSlab *next = slab->next;
+
+			allocated += (slab->bytes - sizeof(dictSlab)) / size;
+			if (slab == bin->slabs)
+				allocated -= (bin->end - bin->cur) / size;
+			slab_bytes += slab->bytes;
+			slabs++;
+			zfree(slab);
+			slab = next;
+		}
+		objects += allocated;
+		malloc_bytes += allocated * _dictMallocFootprint(size);
+	}
+	zfree(d->slabs);
+	d->slabs = NULL;
+	__atomic_add_fetch(&dict_released_objects, objects, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dict_released_malloc_bytes, malloc_bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dict_released_slab_bytes, slab_bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dict_released_slabs, slabs, __ATOMIC_RELAXED);
+	return slab_bytes;
+}
+
+/* Fill 'stats' with the counters of the entry slabs of every dict. The
+counters are updated by the thread owning the dicts without locking, but
+for the slabs released by dictRelease(). */
+void dictGetAllocStats(dictAllocStats *stats)
+{
+	unsigned long long slab_calls;
+
+	*stats = dict_alloc_stats;
+	stats->objects -= __atomic_load_n(&dict_released_objects, __ATOMIC_RELAXED);
+	stats->malloc_bytes -= __atomic_load_n(&dict_released_malloc_bytes, __ATOMIC_RELAXED);
+	stats->slab_bytes -= __atomic_load_n(&dict_released_slab_bytes, __ATOMIC_RELAXED);
+	stats->bytes_saved = (long long)stats->malloc_bytes - (long long)stats->slab_bytes;
+	slab_calls = dict_slab_calls + __atomic_load_n(&dict_released_slabs, __ATOMIC_RELAXED);
+	stats->calls_avoided = dict_alloc_calls > slab_calls ? dict_alloc_calls - slab_calls : 0;
+}
+
+/* --------------------------- concurrent dicts ----------------------------- */
+
+/* Read sections of every thread that ever entered one. A thread keeps its
+record until it exits, then the record is reused by the next thread. */
+typedef struct dictEpochThread
+{
+	uint64_t epoch;        /* Global epoch read on entering, 0 outside. */
+	int nesting;
+	int inuse;
+	struct dictEpochThread *next;
+} dictEpochThread;
+
+struct dictRetired
+{
+	dictRetired *next;
+	void *ptr;             /* Tagged entry, or table. */
+	uint64_t epoch;        /* Global epoch when it was unlinked. */
+	int what;
+};
+
+/* Retired objects of a dict between two scans of the readers. */
+#define DICT_RECLAIM_BATCH 64
+
+static uint64_t dict_epoch = 1;
+static dictEpochThread *dict_epoch_threads;
+static __thread dictEpochThread *dict_epoch_self;
+static pthread_key_t dict_epoch_key;
+static pthread_once_t dict_epoch_once = PTHREAD_ONCE_INIT;
+
+static void _dictEpochThreadExit(void *arg)
+{
+	dictEpochThread *t = (dictEpochThread*)arg;
+
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->inuse, 0, __ATOMIC_RELEASE);
+}
+
+static void _dictEpochInit(void)
+{
+	pthread_key_create(&dict_epoch_key, _dictEpochThreadExit);
+}
+
+static dictEpochThread *_dictEpochRegister(void)
+{
+	dictEpochThread *t;
+
+	pthread_once(&dict_epoch_once, _dictEpochInit);
+	for (t = __atomic_load_n(&dict_epoch_threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	{
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&t->inuse, &unused, 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+	if (t == NULL)
+	{
+		t = (dictEpochThread*)zcalloc(sizeof(*t));
+		t->inuse = 1;
+		t->next = __atomic_load_n(&dict_epoch_threads, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&dict_epoch_threads, &t->next, t, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(dict_epoch_key, t);
+	dict_epoch_self = t;
+	return t;
+}
+
+/* Start a read section: the entries found in concurrent dicts stay valid
+until the matching dictEpochExit(). Sections can be nested. */
+void dictEpochEnter(void)
+{
+	dictEpochThread *t = dict_epoch_self;
+
+	if (t == NULL)
+		t = _dictEpochRegister();
+	if (t->nesting++ == 0)
+	{
+		__atomic_store_n(&t->epoch, __atomic_load_n(&dict_epoch, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+		/* Published before reading any pointer: a writer either sees the
+		section, or unlinked what it retires before we look. */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void dictEpochExit(void)
+{
+	dictEpochThread *t = dict_epoch_self;
+
+	if (--t->nesting == 0)
+		__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Oldest epoch of the read sections in progress, UINT64_MAX if none. */
+static uint64_t _dictEpochMin(void)
+{
+	uint64_t min = UINT64_MAX;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (dictEpochThread *t = __atomic_load_n(&dict_epoch_threads, __ATOMIC_ACQUIRE);
+		t; t = t->next)
+	{
+		uint64_t epoch = __atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE);
+		if (epoch && epoch < min)
+			min = epoch;
+	}
+	return min;
+}
+
+/* Wait for the read sections started before the call to end. Must not be
+called inside a read section. */
+void dictEpochSynchronize(void)
+{
+	uint64_t target = __atomic_add_fetch(&dict_epoch, 1, __ATOMIC_SEQ_CST);
+
+	while (_dictEpochMin() < target)
+		sched_yield();
+}
+
+/* Free 'ptr', already unlinked, once the readers are done with it. */
+static void _dictRetire(dict *d, void *ptr, int what)
+{
+	dictRetired *r;
+
+	if (what == DICT_RETIRE_ENTRY && dictEntryIsKey(ptr))
+		return;
+	r = (dictRetired*)_dictSlabAlloc(d, sizeof(*r));
+	r->ptr = ptr;
+	r->what = what;
+	r->epoch = __atomic_fetch_add(&dict_epoch, 1, __ATOMIC_SEQ_CST);
+	r->next = d->retired;
+	d->retired = r;
+	if (++d->nretired % DICT_RECLAIM_BATCH == 0)
+		_dictReclaim(d, _dictEpochMin());
+}
+
+/* Free what was retired before 'minepoch'. The list is newest first, so
+that is a tail of it. */
+static void _dictReclaim(dict *d, uint64_t minepoch)
+{
+	dictRetired **link = &d->retired, *r;
+
+	while (*link && (*link)->epoch >= minepoch)
+		link = &(*link)->next;
+	r = *link;
+	*link = NULL;
+	while (r)
+	{
+		dictRetired *next = r->next;
+		dictEntry *de = (dictEntry*)r->ptr;
+
+		if (r->what & DICT_RETIRE_TABLE)
+		{
+			zfree(r->ptr);
+		}
+		else
+		{
+			if (r->what & DICT_RETIRE_KEY)
+				dictFreeKey(d, de);
+			if (r->what & DICT_RETIRE_VAL)
+				dictFreeVal(d, de);
+			_dictEntryFree(d, de);
+		}
+		_dictSlabFree(d, r, sizeof(*r));
+		d->nretired--;
+		r = next;
+	}
+}
+
+/* The link pointing to the entry of 'key', from a bucket or from the
+previous entry of the chain. The key must be in the dict. */
+static dictEntry **_dictFindLink(dict *d, const void *key)
+{
+	uint64_t h = dictHashKey(d, key);
+
+	for (int table = 0; table <= 1; table++)
+	{
+		dictEntry **link = &d->ht[table].table[h & d->ht[table].sizemask];
+
+		while (*link)
+		{
+			void *hekey = _dictEntryKey(*link);
+
+			if (key == hekey || dictCompareKeys(d, key, hekey))
+				return link;
+			link = _dictEntryNextRef(*link);
+		}
+	}
+	return NULL;
+}
+
+/* Rehash a bucket without touching its entries, some readers may still be
+walking them: link copies in the new table, then empty the bucket, then
+retire the old entries. */
+static void _dictRehashBucketConcurrent(dict *d, unsigned long idx)
+{
+	dictEntry *head = d->ht[0].table[idx], *de, *nextde;
+
+	for (de = head; de; de = _dictEntryNext(de))
+	{
+		dictEntry **bucket = &d->ht[1].table[dictHashKey(d, _dictEntryKey(de)) & d->ht[1].sizemask];
+
+		__atomic_store_n(bucket, _dictEntryCopy(d, de, *bucket), __ATOMIC_RELEASE);
+		d->ht[0].used--;
+		d->ht[1].used++;
+	}
+	__atomic_store_n(&d->ht[0].table[idx], NULL, __ATOMIC_RELEASE);
+	for (de = head; de; de = nextde)
+	{
+		nextde = _dictEntryNext(de);
+		_dictRetire(d, de, DICT_RETIRE_ENTRY);
+	}
+}
+
+/* Lookup of the readers: no rehash step, and every pointer loaded with
+acquire, as the writer keeps publishing entries. A miss is only trusted
+if the tables did not change meanwhile: an expand may have moved the key
+out of a table that the lookup did not know about. */
+static dictEntry *_dictFindConcurrent(dict *d, const void *key)
+{
+	uint64_t h = dictHashKey(d, key);
+
+	while (1)
+	{
+		dictEntry **tables[2];
+		unsigned long masks[2], seq;
+
+		do
+		{
+			seq = __atomic_load_n(&d->tableseq, __ATOMIC_ACQUIRE);
+			for (int table = 0; table <= 1; table++)
+			{
+				tables[table] = __atomic_load_n(&d->ht[table].table, __ATOMIC_RELAXED);
+				masks[table] = __atomic_load_n(&d->ht[table].sizemask, __ATOMIC_RELAXED);
+			}
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) || seq != __atomic_load_n(&d->tableseq, __ATOMIC_RELAXED));
+
+		for (int table = 0; table <= 1; table++)
+		{
+			dictEntry *he;
+
+			if (tables[table] == NULL)
+				continue;
+			he = __atomic_load_n(&tables[table][h & masks[table]], __ATOMIC_ACQUIRE);
+			while (he)
+			{
+				void *hekey = _dictEntryKey(he);
+
+				if (key == hekey || dictCompareKeys(d, key, hekey))
+					return he;
+				he = dictEntryIsKey(he) ? NULL :
+					__atomic_load_n(_dictEntryNextRef(he), __ATOMIC_ACQUIRE);
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&d->tableseq, __ATOMIC_RELAXED))
+			return NULL;
+	}
+}
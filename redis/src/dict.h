@@ -1,27 +1,83 @@
+/* Hash Tables Implementation.
+
+This file implements in-memory hash tables with insert/del/replace/find
+operations. Tables auto-resize if needed, and are either chained tables
+of power of two size, rehashed incrementally, or open addressing tables
+(see dictSwiss) for the dict types that ask for them. */
+
+#ifndef __DICT_H
+#define __DICT_H
+
+#include <stdint.h>
+#include <stddef.h>
 #include <vector>
 
+#define DICT_OK 0
+#define DICT_ERR 1
+
+typedef union dictVal { /* share memory*/
+	void* val;
+	uint64_t u64;
+	int64_t s64;
+	double d;
+} dictVal;
+
 typedef struct dictEntry
 {
 	void* key;
-	union { /* share memory*/
-		void* val;
-		uint64_t u64;
-		int64_t s64;
-		double d;
-	} v;
+	dictVal v;
 	struct dictEntry *next;
 } dictEntry;
 
+/* A chained dict does not always store a whole dictEntry per key: the
+buckets and the 'next' pointers are tagged with the layout of what they
+point to in their 3 low bits (the entries are at least 8 bytes aligned).
+- DICT_ENTRY_NORMAL: a dictEntry.
+- DICT_ENTRY_NO_VALUE: key and next only, for the dictType with 'noValue'.
+- DICT_ENTRY_EMBEDDED(_NO_VALUE): the bytes of the key are copied in the
+  entry by the 'embedKey' callback of the dictType, and are freed with it.
+- An odd pointer is the key itself, without any entry: a key only dict of
+  a dictType with 'keysAreOdd' stores the key in a bucket that holds no
+  other key, and at the tail of the chains.
+So a dictEntry pointer returned by the API must only be accessed with the
+dictGet / dictSet macros and functions below. Open addressing dicts always
+store plain dictEntry. */
+#define DICT_ENTRY_NORMAL 0
+#define DICT_ENTRY_NO_VALUE 2
+#define DICT_ENTRY_EMBEDDED 4
+#define DICT_ENTRY_EMBEDDED_NO_VALUE 6
+#define DICT_ENTRY_MASK 7
+#define dictEntryIsKey(de) ((uintptr_t)(de) & 1)
+#define dictEntryIsEmbedded(de) (((uintptr_t)(de) & 5) == DICT_ENTRY_EMBEDDED)
+
 class dictType
 {
+public:
 	/* function pointers */
-	uint64_t (*hashFunction)(const void* key);
-	void* (*keyDup)()
+	/* Built on dictGenHashFunction() (SipHash-1-2) for the keys sent by
+	the clients, dictGenFastHashFunction() for the internal ones, or
+	directly dictPtrHashFunction() for pointer keys. */
+	uint64_t (*hashFunction)(const void *key);
+	void *(*keyDup)(void *privdata, const void *key);
+	void *(*valDup)(void *privdata, const void *obj);
+	int (*keyCompare)(void *privdata, const void *key1, const void *key2);
+	void (*keyDestructor)(void *privdata, void *key);
+	void (*valDestructor)(void *privdata, void *obj);
+	int openAddressing; /* Store the entries in a dictSwiss table. */
+	int noValue;        /* Key only entries, for sets. */
+	int keysAreOdd;     /* The keys, once duplicated, always have their low
+	                       bit set: see dictEntryIsKey(). Needs noValue. */
+	/* Copy the key in 'buf' and store in 'keyoff' the offset in 'buf' of
+	the pointer that dictGetKey() should return, for instance past the
+	header of a sds. Returns the bytes used, and with a NULL 'buf' only
+	computes them. The key is not passed to keyDup nor keyDestructor. */
+	size_t (*embedKey)(unsigned char *buf, const void *key, unsigned char *keyoff);
+	int concurrent;     /* Lock-free lookups from any thread, see below. */
 };
 
 /* This is our hash table structure. Every dictionary has two of this
 as we implement incremental rehashing, for the old to the new table. */
-typedef struct dictht 
+typedef struct dictht
 {
 	dictEntry** table;
 	unsigned long size;
@@ -29,6 +85,87 @@ typedef struct dictht
 	unsigned long used;
 } dictht;
 
+/* Open addressing table in the style of the Swiss tables: the entries are
+stored inline in 'slots', without a 'next' pointer chase nor an allocation
+per key, and every slot has a control byte, either empty, deleted, or the
+7 low bits of the hash of its key. A lookup compares the control bytes of
+a whole group of DICT_SWISS_GROUP slots with one SSE2 instruction, and only
+touches the slots whose control byte matches.
+
+The table is rehashed all at once when it grows: there is no incremental
+rehashing, so it is meant for dicts whose size is known in advance (see
+dictExpand()) or that can afford the pause. */
+#define DICT_SWISS_GROUP 16
+
+typedef struct dictSwiss
+{
+	int8_t *ctrl;          /* One control byte per slot. */
+	dictEntry *slots;      /* Entries, 'next' is unused. */
+	unsigned long size;    /* Slots, power of two >= DICT_SWISS_GROUP. */
+	unsigned long used;
+	unsigned long deleted; /* Slots holding a tombstone. */
+} dictSwiss;
+
+/* Chained entries are carved from slabs owned by the dict instead of being
+allocated one by one: no malloc header nor rounding per key, no allocator
+call per insert or delete, and dictRelease() frees the slabs in bulk. Every
+size class has its own bin. Slabs double in size, from DICT_SLAB_MIN_OBJECTS
+up to DICT_SLAB_MAX_OBJECTS objects, so that small dicts stay small. Freed
+objects are reused by the same dict: the slabs are only returned to the
+system by dictRelease(). */
+#define DICT_SLAB_CLASSES 5       /* 16, 24, 32, 48 and 64 bytes. */
+#define DICT_SLAB_MIN_OBJECTS 16
+#define DICT_SLAB_MAX_OBJECTS 4096
+
+typedef struct dictSlab
+{
+	struct dictSlab *next;
+	size_t bytes;             /* Including this header. */
+} dictSlab;
+
+typedef struct dictSlabBin
+{
+	void *freelist;           /* Freed objects, linked by their first word. */
+	dictSlab *slabs;          /* Every slab of the class, newest first. */
+	char *cur, *end;          /* Never used objects of the newest slab. */
+	size_t nextobjects;       /* Objects of the next slab. */
+} dictSlabBin;
+
+typedef struct dictSlabPool
+{
+	dictSlabBin bins[DICT_SLAB_CLASSES];
+} dictSlabPool;
+
+/* Allocator and resize counters of all the dicts, see dictGetAllocStats(). */
+typedef struct dictAllocStats
+{
+	unsigned long long objects;       /* Entries currently allocated. */
+	unsigned long long slab_bytes;    /* Memory of the slabs. */
+	unsigned long long malloc_bytes;  /* Estimated memory of the same entries
+	                                     allocated one by one. */
+	long long bytes_saved;            /* malloc_bytes - slab_bytes */
+	unsigned long long calls_avoided; /* Allocator calls not performed. */
+	unsigned long long shrinks;       /* Tables shrunk. */
+	unsigned long long reclaimed_bytes; /* Freed by the shrinks: buckets, and
+	                                       the slabs of the emptied dicts. */
+} dictAllocStats;
+
+/* Concurrent dicts. dictFind(), dictFetchValue() and dictFindBatch() may
+run in any thread, between dictEpochEnter() and dictEpochExit(), while the
+writers, serialized by the caller as for any dict, keep modifying it.
+- The readers take no lock and never rehash. They read the tables under
+  'tableseq', odd while the writer swaps them.
+- An entry is never modified once visible: a replaced value or a rehashed
+  entry is a new entry, linked in place of the old one.
+- The unlinked entries, with their keys and values, and the old tables are
+  freed only when no reader that could still see them is left, that is
+  once every thread in a read section entered it after they were retired
+  (epoch-based reclamation).
+A concurrent dict is always chained. Its values must be given to dictAdd()
+or dictReplace(): the entry of dictAddRaw() is already visible to the
+readers. An entry found by a reader is valid until dictEpochExit(). */
+typedef struct dictRetired dictRetired;
+
 typedef struct dict
 {
 	dictType *type;
@@ -36,10 +173,53 @@ typedef struct dict
 	dictht ht[2];
 	long rehashidx; /* rehashing not in progress if rehashidx == -1 */
 	unsigned long iterators; /* number of iterators currently running */
+	dictSwiss *swiss; /* Used instead of ht[] if type->openAddressing. */
+	dictSlabPool *slabs; /* Entries of ht[], created with the first one. */
+	unsigned long tableseq; /* Concurrent dicts: odd while ht[] changes. */
+	dictRetired *retired;   /* Concurrent dicts: waiting for the readers. */
+	unsigned long nretired;
 } dict;
 
+/* Callbacks of dictScan() and dictScanBatch(). */
+typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
+typedef void (dictScanBatchFunction)(void *privdata, dictEntry **entries, unsigned long count);
+
+/* Entries given at most to a dictScanBatchFunction call. */
+#define DICT_SCAN_BATCH 64
+
+/* Keys looked up together by dictFindBatch(). */
+#define DICT_FIND_BATCH 16
+
+/* This is the initial size of every hash table */
+#define DICT_HT_INITIAL_SIZE 4
+
 /* -------------------------------- Macros -------------------------------- */
 
+#define dictFreeVal(d, entry) \
+	if ((d)->type->valDestructor) \
+		(d)->type->valDestructor((d)->privdata, dictGetVal(entry))
+
+#define dictSetVal(d, entry, _val_) do { \
+	if ((d)->type->valDup) \
+		dictEntryVal(entry)->val = (d)->type->valDup((d)->privdata, _val_); \
+	else \
+		dictEntryVal(entry)->val = (_val_); \
+} while(0)
+
+#define dictSetSignedIntegerVal(entry, _val_) \
+	do { dictEntryVal(entry)->s64 = _val_; } while(0)
+
+#define dictSetUnsignedIntegerVal(entry, _val_) \
+	do { dictEntryVal(entry)->u64 = _val_; } while(0)
+
+#define dictSetDoubleVal(entry, _val_) \
+	do { dictEntryVal(entry)->d = _val_; } while(0)
+
+#define dictFreeKey(d, entry) \
+	if ((d)->type->keyDestructor && !dictEntryIsEmbedded(entry)) \
+		(d)->type->keyDestructor((d)->privdata, dictGetKey(entry))
+
+/* Plain dictEntry only: chained entries get their key when created. */
 #define dictSetKey(d, entry, _key_) do { \
 	if ((d)->type->keyDup) \
 		(entry)->key = (d)->type->keyDup((d)->privdata, _key_); \
@@ -47,4 +227,61 @@ typedef struct dict
 		(entry)->key = (_key_); \
 } while(0)
 
+#define dictCompareKeys(d, key1, key2) \
+	(((d)->type->keyCompare) ? \
+		(d)->type->keyCompare((d)->privdata, key1, key2) : \
+		(key1) == (key2))
+
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
+#define dictGetSignedIntegerVal(he) (dictEntryVal(he)->s64)
+#define dictGetUnsignedIntegerVal(he) (dictEntryVal(he)->u64)
+#define dictGetDoubleVal(he) (dictEntryVal(he)->d)
+#define dictSlots(d) ((d)->swiss ? (d)->swiss->size : \
+	(d)->ht[0].size+(d)->ht[1].size)
+#define dictSize(d) ((d)->swiss ? (d)->swiss->used : \
+	(d)->ht[0].used+(d)->ht[1].used)
+#define dictIsRehashing(d) ((d)->rehashidx != -1)
+/* Keys still in the old table, 0 when not rehashing. */
+#define dictRehashPending(d) (dictIsRehashing(d) ? (d)->ht[0].used : 0)
+
+/* API */
+dict *dictCreate(dictType &type, void *privDataPtr);
+int dictExpand(dict *d, unsigned long size);
+int dictAdd(dict *d, void *key, void *val);
+dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
+int dictReplace(dict *d, void *key, void *val);
+int dictDelete(dict *d, const void *key);
+void dictRelease(dict *d);
+dictEntry *dictFind(dict *d, const void *key);
+void *dictFetchValue(dict *d, const void *key);
+unsigned long dictFindBatch(dict *d, const void **keys, unsigned long n, dictEntry **out);
+int dictResize(dict *d);
+int dictShrinkIfNeeded(dict *d);
+void dictSetShrinkPercent(unsigned int percent);
+void dictEnableResize(void);
+void dictDisableResize(void);
+int dictRehash(dict *d, int n);
+int dictRehashMilliseconds(dict *d, int ms);
+int dictRehashMicroseconds(dict *d, long long us);
+void dictSetHashFunctionSeed(uint8_t *seed);
+uint64_t dictGenHashFunction(const void *key, int len);
+uint64_t dictGenFastHashFunction(const void *key, int len);
+uint64_t dictGenIntHashFunction(uint64_t key);
+uint64_t dictPtrHashFunction(const void *key);
+void dictGetAllocStats(dictAllocStats *stats);
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
+unsigned long dictScanBatch(dict *d, unsigned long v, unsigned long limit,
+	dictScanBatchFunction *fn, void *privdata);
+unsigned long dictRandomCursor(dict *d);
+size_t dictEntryMemUsage(dict *d, const dictEntry *de);
+void dictEpochEnter(void);
+void dictEpochExit(void);
+void dictEpochSynchronize(void);
+void *dictGetKey(const dictEntry *de);
+void *dictGetVal(const dictEntry *de);
+dictVal *dictEntryVal(const dictEntry *de);
+
+/* Provided by siphash.c */
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+#endif /* __DICT_H */
@@ -1,12 +1,70 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "server.h"
+
+/* To improve the quality of the LRU approximation we take a set of keys
+that are good candidate for eviction across evictions.
+
+Entries inside the eviction pool are taken ordered by idle time, putting
+greater idle times to the right (ascending order).
+
+When an LFU policy is used instead, a reverse frequency indication is used
+instead of the idle time, so that we still evict by larger value (larger
+inverse frequency means to evict keys with the least frequent accesses).
+
+The pool is a fixed array, and the key names are copied into buffers
+allocated with the pool, so that populating it and picking a key from it
+never allocates while we are short of memory. Only the names longer than
+EVPOOL_CACHED_SDS_SIZE get an allocated copy. */
+#define EVPOOL_SIZE 16
+#define EVPOOL_CACHED_SDS_SIZE 255
+
 class evictionPoolEntry
 {
+public:
 	unsigned long long idle; /* Object idle time (inverse frequency for LFU) */
-	string key;		 /* Key name. */
-	string cached;		 /* Cached object for key name. */
-	int dbid;		 /* Key DB number */
+	sds key;                 /* Key name, NULL for an empty entry. */
+	sds cached;              /* Buffer of the key name, see above. */
+	int dbid;                /* Key DB number */
 };
 
-vector<evictionPoolEntry> EvictionPoolLRU;
+static evictionPoolEntry EvictionPoolLRU[EVPOOL_SIZE];
+
+/* ----------------------------------------------------------------------------
+Implementation of eviction, aging and LRU
+----------------------------------------------------------------------------- */
+
+/* Return the LRU clock, based on the clock resolution. This is a time
+in a reduced-bits format that can be used to set and check the
+object->lru field of redisObject structures. */
+unsigned int getLRUClock(void)
+{
+	return (ustime() / 1000 / LRU_CLOCK_RESOLUTION) & LRU_CLOCK_MAX;
+}
+
+/* This function is used to obtain the current LRU clock.
+If the current resolution is lower than the frequency we refresh the
+LRU clock (as it should be in production servers) we return the
+precomputed value, otherwise we need to resort to a system call. */
+unsigned int LRU_CLOCK(void)
+{
+	if (1000 / server.hz <= LRU_CLOCK_RESOLUTION)
+		return __atomic_load_n(&server.lruclock, __ATOMIC_RELAXED);
+	return getLRUClock();
+}
+
+/* Given an object returns the min number of milliseconds the object was never
+requested, using an approximated LRU algorithm. */
+unsigned long long estimateObjectIdleTime(robj *o)
+{
+	unsigned long long lruclock = LRU_CLOCK();
+
+	if (lruclock >= o->lru)
+		return (lruclock - o->lru) * LRU_CLOCK_RESOLUTION;
+	return (lruclock + (LRU_CLOCK_MAX - o->lru)) * LRU_CLOCK_RESOLUTION;
+}
+
 /* LRU approximation algorithm
 
 Redis uses an approximation of the LRU algorithm that runs in constant
@@ -30,14 +88,544 @@ in the whole database. */
 /* Create a new eviction pool. */
 void evictionPoolAlloc(void)
 {
-	vector<evictionPoolEntry> ep;
+	for (int j = 0; j < EVPOOL_SIZE; j++)
+	{
+		evictionPoolEntry *ep = EvictionPoolLRU + j;
+
+		if (ep->key && ep->key != ep->cached)
+			sdsfree(ep->key);
+		if (ep->cached == NULL)
+			ep->cached = sdsnewlen(NULL, EVPOOL_CACHED_SDS_SIZE);
+		ep->idle = 0;
+		ep->key = NULL;
+		ep->dbid = 0;
+	}
+}
+
+/* State of evictionPoolPopulate() across the dictScanBatch() callbacks. */
+class evictionSampler
+{
+public:
+	int dbid;
+	dict *sampledict;
+	dict *keydict;
+	int left;                        /* Samples still to take. */
+	evictionPoolEntry *pool;
+};
+
+/* Add the key of 'de', an entry of the sampled dict, to the pool if it is
+a better candidate than one of the keys already there. */
+static void evictionPoolInsert(evictionSampler *s, dictEntry *de)
+{
+	evictionPoolEntry *pool = s->pool;
+	unsigned long long idle;
+	sds key = (sds)dictGetKey(de), cached;
+	robj *o = NULL;
+	size_t klen;
+	int k;
 
-	for (int j = 0; j < EVPOOL_SIZE; ++j)
+	/* If the dictionary we are sampling from is not the main
+	dictionary (but the expires one) we need to lookup the key
+	again in the key dictionary to obtain the value object. */
+	if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL)
 	{
-		evictionPoolEntry t;
-		t.idle = 0;
-		t.dbid = 0;
-		ep.push_back(t);
+		if (s->sampledict != s->keydict)
+			de = dictFind(s->keydict, key);
+		o = (robj*)dictGetVal(de);
 	}
-	EvictionPoolLRU.assign(ep.begin(), ep.end());
+
+	/* Calculate the idle time according to the policy. This is called
+	idle just because the code initially handled LRU, but is in fact
+	just a score where an higher score means better candidate. */
+	if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU)
+		idle = estimateObjectIdleTime(o);
+	else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+		/* When we use an LRU policy, we sort the keys by idle time
+		so that we expire keys starting from greater idle time.
+		However when the policy is an LFU one, we have a frequency
+		estimation, and we want to evict keys with lower frequency
+		first. So inside the pool we put objects using the inverted
+		frequency subtracting the actual frequency to the maximum
+		frequency of 255. */
+		idle = 255 - LFUDecrAndReturn(o);
+	else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+		/* In this case the sooner the expire the better. */
+		idle = ULLONG_MAX - ((expireEntry*)dictGetVal(de))->when;
+	else
+		return;
+
+	/* Insert the element inside the pool.
+	First, find the first empty bucket or the first populated
+	bucket that has an idle time smaller than our idle time. */
+	k = 0;
+	while (k < EVPOOL_SIZE && pool[k].key && pool[k].idle < idle)
+		k++;
+	if (k == 0 && pool[EVPOOL_SIZE-1].key != NULL)
+	{
+		/* Can't insert if the element is < the worst element we have
+		and there are no empty buckets. */
+		return;
+	}
+	else if (k < EVPOOL_SIZE && pool[k].key == NULL)
+	{
+		/* Inserting into empty position. No setup needed before insert. */
+	}
+	else if (pool[EVPOOL_SIZE-1].key == NULL)
+	{
+		/* Inserting in the middle, there is free space on the right:
+		shift all the elements from k to end to the right. The buffer
+		of the empty last entry goes to the entry we insert. */
+		cached = pool[EVPOOL_SIZE-1].cached;
+		memmove(pool + k + 1, pool + k, sizeof(pool[0]) * (EVPOOL_SIZE - k - 1));
+		pool[k].cached = cached;
+	}
+	else
+	{
+		/* No free space on right? Insert at k-1 discarding the
+		first element, shifting the ones on the left. */
+		k--;
+		cached = pool[0].cached;
+		if (pool[0].key != pool[0].cached)
+			sdsfree(pool[0].key);
+		memmove(pool, pool + 1, sizeof(pool[0]) * k);
+		pool[k].cached = cached;
+	}
+
+	klen = sdslen(key);
+	if (klen > EVPOOL_CACHED_SDS_SIZE)
+	{
+		pool[k].key = sdsdup(key);
+	}
+	else
+	{
+		memcpy(pool[k].cached, key, klen + 1);
+		sdssetlen(pool[k].cached, klen);
+		pool[k].key = pool[k].cached;
+	}
+	pool[k].idle = idle;
+	pool[k].dbid = s->dbid;
+}
+
+static void evictionSampleCallback(void *privdata, dictEntry **entries, unsigned long count)
+{
+	evictionSampler *s = (evictionSampler*)privdata;
+
+	/* Scoring a sample reads its key and its object: load them for all
+	the samples first, so that the cache misses overlap. */
+	for (unsigned long j = 0; j < count && (long)j < s->left; j++)
+	{
+		__builtin_prefetch(dictGetKey(entries[j]));
+		if (s->sampledict == s->keydict)
+			__builtin_prefetch(dictGetVal(entries[j]));
+	}
+	for (unsigned long j = 0; j < count && s->left > 0; j++, s->left--)
+		evictionPoolInsert(s, entries[j]);
+}
+
+/* This is an helper function for evictionPoolBestKey(), it is used in order
+to populate the evictionPool with a few entries every time we want to
+expire a key. Keys with idle time bigger than one of the current
+keys are added. Keys are always added if there are free entries.
+
+The keys are sampled by a short dictScanBatch() from a random cursor, so
+they come from neighbouring buckets of a random point of the table.
+Returns the number of keys sampled. */
+int evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict,
+	evictionPoolEntry *pool)
+{
+	evictionSampler s;
+	unsigned long cursor = dictRandomCursor(sampledict);
+
+	s.dbid = dbid;
+	s.sampledict = sampledict;
+	s.keydict = keydict;
+	s.left = server.maxmemory_samples;
+	s.pool = pool;
+	while (s.left > 0)
+	{
+		cursor = dictScanBatch(sampledict, cursor, s.left, evictionSampleCallback, &s);
+		if (cursor == 0)
+			break;
+	}
+	return server.maxmemory_samples - s.left;
+}
+
+/* Find the best key to evict with the LRU, LFU and TTL policies, refilling
+the pool as needed. Returns the entry of the key in the keyspace of
+server.db[*bestdbid], or NULL if there is no key that can be evicted. The
+key is removed from the pool only if 'pop' is true. */
+static dictEntry *evictionPoolPick(int *bestdbid, int pop)
+{
+	evictionPoolEntry *pool = EvictionPoolLRU;
+
+	while (1)
+	{
+		unsigned long total_keys = 0, sampled = 0;
+
+		/* We don't want to make local-db choices when expiring keys,
+		so to start populate the eviction pool sampling keys from
+		every DB. */
+		for (int i = 0; i < server.dbnum; i++)
+		{
+			redisDb *db = server.db + i;
+			dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+				db->dictionary : db->expires;
+			unsigned long keys = dictSize(d);
+
+			if (keys != 0)
+			{
+				sampled += evictionPoolPopulate(i, d, db->dictionary, pool);
+				total_keys += keys;
+			}
+		}
+		if (!total_keys)
+			return NULL; /* No keys to evict. */
+
+		/* Go backward from best to worst element to evict. */
+		for (int k = EVPOOL_SIZE - 1; k >= 0; k--)
+		{
+			redisDb *db;
+			dictEntry *de;
+
+			if (pool[k].key == NULL)
+				continue;
+			db = server.db + pool[k].dbid;
+			de = dictFind((server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+				db->dictionary : db->expires, pool[k].key);
+			*bestdbid = pool[k].dbid;
+
+			/* Remove the entry from the pool, if we pick it or if the
+			key does not exist anymore: it is a ghost and we need to
+			try the next element. */
+			if (pop || de == NULL)
+			{
+				if (pool[k].key != pool[k].cached)
+					sdsfree(pool[k].key);
+				pool[k].key = NULL;
+				pool[k].idle = 0;
+			}
+			if (de)
+			{
+				if (!(server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS))
+					de = dictFind(db->dictionary, dictGetKey(de));
+				return de;
+			}
+		}
+		/* Only ghosts were left in the pool, and this round could not
+		sample any key to replace them: give up instead of spinning. */
+		if (!sampled)
+			return NULL;
+	}
+}
+
+dictEntry *evictionPoolBestKey(int *bestdbid)
+{
+	return evictionPoolPick(bestdbid, 1);
+}
+
+/* Like evictionPoolBestKey(), but the key stays in the pool. */
+dictEntry *evictionPoolPeekKey(int *bestdbid)
+{
+	return evictionPoolPick(bestdbid, 0);
+}
+
+/* ----------------------------------------------------------------------------
+LFU (Least Frequently Used) implementation.
+
+We have 24 total bits of space in each object in order to implement
+an LFU (Least Frequently Used) eviction policy, since we re-use the
+LRU field for this purpose.
+
+We split the 24 bits into two fields:
+
+         16 bits      8 bits
+    +----------------+--------+
+    + Last decr time | LOG_C  |
+    +----------------+--------+
+
+LOG_C is a logarithmic counter that provides an indication of the access
+frequency. However this field must also be decremented otherwise what used
+to be a frequently accessed key in the past, will remain ranked like that
+forever, while we want the algorithm to adapt to access pattern changes.
+
+So the remaining 16 bits are used in order to store the "decrement time",
+a reduced-precision Unix time (we take 16 bits of the time converted
+in minutes since we don't care about wrapping around) of the last time
+the LOG_C counter was decremented.
+
+New keys don't start at zero, in order to have the ability to collect
+some accesses before being trashed away, so they start at LFU_INIT_VAL.
+The logarithmic increment performed on LOG_C takes care of LFU_INIT_VAL
+when incrementing the key, so that keys starting at LFU_INIT_VAL
+(or having a smaller value) have a very high chance of being incremented
+on access.
+
+During decrement, the value of the logarithmic counter is decremented by
+one every lfu_decay_time minutes elapsed since the last decrement.
+----------------------------------------------------------------------------- */
+
+/* Return the current time in minutes, just taking the least significant
+16 bits. The returned time is suitable to be stored as LDT (last decrement
+time) for the LFU implementation. */
+unsigned long LFUGetTimeInMinutes(void)
+{
+	return (server.unixtime / 60) & 65535;
+}
+
+/* Given an object last access time, compute the minimum number of minutes
+that elapsed since the last access. Handle overflow (ldt greater than
+the current 16 bits minutes time) considering the time as wrapping
+exactly once. */
+static unsigned long LFUTimeElapsed(unsigned long ldt)
+{
+	unsigned long now = LFUGetTimeInMinutes();
+
+	if (now >= ldt)
+		return now - ldt;
+	return 65535 - ldt + now;
+}
+
+/* Logarithmically increment a counter. The greater is the current counter
+value the less likely is that it gets really implemented. Saturate it at
+255. With the default lfu_log_factor of 10, about a million accesses
+saturate the counter. */
+uint8_t LFULogIncr(uint8_t counter)
+{
+	double r, baseval, p;
+
+	if (counter == 255)
+		return 255;
+	r = (double)rand() / RAND_MAX;
+	baseval = counter - LFU_INIT_VAL;
+	if (baseval < 0)
+		baseval = 0;
+	p = 1.0 / (baseval * server.lfu_log_factor + 1);
+	if (r < p)
+		counter++;
+	return counter;
+}
+
+/* Return the LFU counter of the object, decremented by one for every
+server.lfu_decay_time minutes elapsed since its last decrement. The object
+itself is not updated: this is done by objectTouch() when the object is
+really accessed.
+
+This function is used in order to scan the dataset for the best object
+to fit: as we check for the candidate, we incrementally decrement the
+counter of the scanned objects if needed. */
+unsigned long LFUDecrAndReturn(robj *o)
+{
+	unsigned long ldt = o->lru >> 8;
+	unsigned long counter = o->lru & 255;
+	unsigned long num_periods = server.lfu_decay_time ?
+		LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+
+	if (num_periods)
+		counter = (num_periods > counter) ? 0 : counter - num_periods;
+	return counter;
+}
+
+/* Set the access information of a new object according to the policy:
+the current LRU clock, or an LFU counter of LFU_INIT_VAL. */
+void objectInitLRUOrLFU(robj *o)
+{
+	if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+		o->lru = (LFUGetTimeInMinutes() << 8) | LFU_INIT_VAL;
+	else
+		o->lru = LRU_CLOCK();
+}
+
+/* Update the access information of an object that was looked up by a
+command: the LFU counter is decremented of the elapsed decay periods,
+then logarithmically incremented. */
+void objectTouch(robj *o)
+{
+	if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+	{
+		unsigned long counter = LFUDecrAndReturn(o);
+
+		counter = LFULogIncr(counter);
+		o->lru = (LFUGetTimeInMinutes() << 8) | counter;
+	}
+	else
+	{
+		o->lru = LRU_CLOCK();
+	}
+}
+
+/* ----------------------------------------------------------------------------
+The external API for eviction: freeMemoryIfNeeded() is called by the
+server when there is data to add in order to make space if needed.
+----------------------------------------------------------------------------- */
+
+/* Return the memory used for the maxmemory limit: the memory of the
+values that the lazy free thread has still to release is not counted, as
+it is being freed already. */
+static size_t evictionUsedMemory(void)
+{
+	size_t used = zmalloc_used_memory(), pending = lazyfreeGetPendingBytes();
+
+	return used > pending ? used - pending : 0;
+}
+
+/* Get the memory status from the point of view of the maxmemory directive:
+if the memory used is under the maxmemory setting then C_OK is returned.
+Otherwise, if we are over the memory limit, the function returns
+C_ERR.
+
+The function may return additional info via reference, only if the
+pointers to the respective arguments is not NULL:
+
+'total'     total amount of bytes used, pending lazy frees included.
+'tofree'    the amount of memory that should be released
+            in order to return back into the memory limits. */
+int getMaxmemoryState(size_t *total, size_t *tofree)
+{
+	size_t mem_used;
+
+	if (total)
+		*total = zmalloc_used_memory();
+	if (!server.maxmemory)
+		return C_OK;
+	mem_used = evictionUsedMemory();
+	if (mem_used <= server.maxmemory)
+		return C_OK;
+	if (tofree)
+		*tofree = mem_used - server.maxmemory;
+	return C_ERR;
+}
+
+static void evictionRandomCallback(void *privdata, dictEntry **entries, unsigned long count)
+{
+	dictEntry **de = (dictEntry**)privdata;
+
+	if (*de == NULL && count)
+		*de = entries[0];
+}
+
+/* Return a random entry of 'd' for the random policies, NULL if empty. */
+static dictEntry *evictionRandomEntry(dict *d)
+{
+	unsigned long cursor;
+	dictEntry *de = NULL;
+
+	if (dictSize(d) == 0)
+		return NULL;
+	cursor = dictRandomCursor(d);
+	do
+		cursor = dictScanBatch(d, cursor, 1, evictionRandomCallback, &de);
+	while (de == NULL);
+	return de;
+}
+
+/* Delete a key chosen by the eviction, in background if it is expensive
+to free and lazyfree_lazy_eviction is set. Returns 1 if the value was
+handed to the lazy free thread. */
+static int evictionDeleteKey(redisDb *db, sds key)
+{
+	if (server.lazyfree_lazy_eviction)
+	{
+		int deleted;
+
+		return dbAsyncDelete(db, key, &deleted) != 0;
+	}
+	removeExpire(db, key);
+	dictDelete(db->dictionary, key);
+	return 0;
+}
+
+/* This function is periodically called to see if there is memory to free
+according to the current "maxmemory" settings. In case we are over the
+memory limit, the function will try to free some memory to return back
+under the limit.
+
+With lazyfree-lazy-eviction the values that are expensive to free are
+handed to the lazy free thread: the memory they hold counts as freed, so
+we stop evicting as soon as enough of it is on its way out, instead of
+evicting more keys while the thread works.
+
+The function returns C_OK if we are under the memory limit or if we
+were over the limit, but the attempt to free memory was successful.
+Otherwise if we are over the memory limit, but not enough memory
+was freed to return back under the limit, the function returns C_ERR. */
+int freeMemoryIfNeeded(void)
+{
+	static unsigned int next_db = 0;
+	size_t mem_tofree, mem_freed = 0;
+
+	if (getMaxmemoryState(NULL, &mem_tofree) == C_OK)
+		return C_OK;
+	if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
+		return C_ERR; /* We need to free memory, but policy forbids. */
+
+	while (mem_freed < mem_tofree)
+	{
+		dictEntry *de = NULL;
+		int bestdbid = 0;
+
+		if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU | MAXMEMORY_FLAG_LFU) ||
+			server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+		{
+			de = evictionPoolBestKey(&bestdbid);
+		}
+		else
+		{
+			/* When evicting a random key, we try to evict a key for
+			each DB, so we use the static 'next_db' variable to
+			incrementally visit all DBs. */
+			for (int i = 0; i < server.dbnum && de == NULL; i++)
+			{
+				redisDb *db;
+
+				bestdbid = (++next_db) % server.dbnum;
+				db = server.db + bestdbid;
+				de = evictionRandomEntry(server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ?
+					db->dictionary : db->expires);
+				if (de && db->expires != NULL && server.maxmemory_policy != MAXMEMORY_ALLKEYS_RANDOM)
+					de = dictFind(db->dictionary, dictGetKey(de));
+			}
+		}
+		if (de == NULL)
+			return C_ERR; /* Nothing to free... */
+
+		/* Finally remove the selected key. We compute the amount of
+		memory freed by the deletion alone, with the memory handed to
+		the lazy free thread. */
+		size_t before = evictionUsedMemory(), after;
+
+		if (evictionDeleteKey(server.db + bestdbid, (sds)dictGetKey(de)))
+			server.stat_lazyfree_evictions++;
+		after = evictionUsedMemory();
+		if (before > after)
+			mem_freed += before - after;
+		server.stat_evictedkeys++;
+	}
+	return C_OK;
+}
+
+/* With an admission policy, called after 'key' was added to 'db' while the
+memory is over maxmemory: making room for it means evicting the key the
+pool would pick next. The new key is kept only if it was accessed more
+often than that victim, according to the TinyLFU sketch (see tinylfu.cpp).
+Otherwise it is deleted right away and the victim stays.
+
+Returns 1 if the key was admitted, 0 if it was deleted, then 'key' must
+not be used anymore if it was the sds of the keyspace. */
+int evictionAdmitKey(redisDb *db, sds key)
+{
+	dictEntry *victim;
+	int dbid;
+
+	if (!(server.maxmemory_policy & MAXMEMORY_FLAG_ADMISSION) ||
+		getMaxmemoryState(NULL, NULL) == C_OK)
+		return 1;
+	/* If the victim is the new key itself, deleting it is what the
+	eviction would do anyway. */
+	victim = evictionPoolPeekKey(&dbid);
+	if (victim == NULL ||
+		tinylfuEstimate(key) > tinylfuEstimate((sds)dictGetKey(victim)))
+		return 1;
+	evictionDeleteKey(db, key);
+	server.stat_admission_rejected++;
+	return 0;
 }
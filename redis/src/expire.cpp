@@ -0,0 +1,169 @@
+/* Expiration of the keys with a time to live.
+
+Every key with an expire has an expireEntry, the value of the key in the
+expires dict of its DB. The entries are also queued by expire time in the
+timing wheel of the DB, the expires_index (see timewheel.h), so that the
+cron pops the keys that are due without sampling the expires dict: the
+memory of a dead key is reclaimed within a cron period, whatever the
+number of keys with a TTL.
+
+The wheel counts in ticks of EXPIRE_TICK_MS milliseconds. Ticks shorter
+than the cron period would not expire the keys any sooner, and with them
+the wheels span 49 days instead of 18 hours: only the keys expiring later
+wait in the overflow list of the wheel, that is requeued every 18 hours.
+
+activeExpireCycle() deletes the due keys within a time limit that adapts
+to the backlog. The limit starts at ACTIVE_EXPIRE_CYCLE_MIN_PERC of the
+cron period and doubles every time the cycle stops on it with keys still
+due, up to active_expire_max_cpu percent. It halves back once the backlog
+is gone. The steady trickle of expires takes short slices of the cron,
+while a wave of keys expiring together gets the CPU to go away quickly. */
+
+#include "server.h"
+
+#define EXPIRE_TICK_BITS 6
+#define EXPIRE_TICK_MS (1 << EXPIRE_TICK_BITS)
+
+#define ACTIVE_EXPIRE_CYCLE_MIN_PERC 1 /* Of the cron period. */
+#define ACTIVE_EXPIRE_CYCLE_CHECK_EVERY 16 /* Keys deleted between clock reads. */
+
+/* Tick a key expiring at 'when' is queued at. It is rounded up, so that
+the cycle never deletes a key before its time. */
+static long long expireTick(long long when)
+{
+	return (when + EXPIRE_TICK_MS - 1) >> EXPIRE_TICK_BITS;
+}
+
+void expireIndexInit(redisDb *db)
+{
+	db->expires_index = (twWheel*)zmalloc(sizeof(twWheel));
+	twInit(db->expires_index, (ustime() / 1000) >> EXPIRE_TICK_BITS);
+}
+
+/* Return the expire time of the specified key, or -1 if no expire
+is associated with this key (i.e. the key is non volatile). */
+long long getExpire(redisDb *db, sds key)
+{
+	dictEntry *de;
+
+	if (dictSize(db->expires) == 0 || (de = dictFind(db->expires, key)) == NULL)
+		return -1;
+	return ((expireEntry*)dictGetVal(de))->when;
+}
+
+/* Set an expire to the specified key, that must exist in the keyspace.
+'when' is the unix time in milliseconds the key expires at. */
+void setExpire(redisDb *db, sds key, long long when)
+{
+	dictEntry *kde, *de, *existing;
+	expireEntry *ee;
+
+	/* Reuse the sds from the main dict in the expire dict */
+	kde = dictFind(db->dictionary, key);
+	if (kde == NULL)
+		serverPanic("setExpire() called on a missing key");
+	de = dictAddRaw(db->expires, dictGetKey(kde), &existing);
+	if (de == NULL)
+	{
+		ee = (expireEntry*)dictGetVal(existing);
+		twCancel(db->expires_index, &ee->timer);
+	}
+	else
+	{
+		ee = (expireEntry*)zmalloc(sizeof(*ee));
+		ee->timer.head = NULL;
+		ee->key = (sds)dictGetKey(kde);
+		dictSetVal(db->expires, de, ee);
+	}
+	ee->when = when;
+	ee->timer.when = expireTick(when);
+	twAdd(db->expires_index, &ee->timer);
+}
+
+/* Remove the expire of the specified key, from the expires dict and the
+index. Returns 1 if the key had an expire, 0 otherwise. The key is not
+touched, its sds is shared with the keyspace. */
+int removeExpire(redisDb *db, sds key)
+{
+	dictEntry *de;
+	expireEntry *ee;
+
+	if (dictSize(db->expires) == 0 || (de = dictFind(db->expires, key)) == NULL)
+		return 0;
+	ee = (expireEntry*)dictGetVal(de);
+	/* Does nothing if activeExpireCycle() popped the entry already. */
+	twCancel(db->expires_index, &ee->timer);
+	dictDelete(db->expires, key);
+	zfree(ee);
+	return 1;
+}
+
+/* Delete a key whose time passed, freeing its value in background if
+lazyfree_lazy_expire is set and the value is expensive to free. */
+static void deleteExpiredKey(redisDb *db, sds key)
+{
+	int deleted;
+
+	if (server.lazyfree_lazy_expire)
+	{
+		dbAsyncDelete(db, key, &deleted);
+	}
+	else
+	{
+		removeExpire(db, key);
+		dictDelete(db->dictionary, key);
+	}
+	server.stat_expiredkeys++;
+}
+
+/* Delete the keys whose time passed, called by databasesCron(). Every call
+resumes from the DB where the previous one ran out of time, and the time
+limit adapts to the backlog as explained at the top of the file. */
+void activeExpireCycle(void)
+{
+	static int resume_db = 0;
+	static long long budget_us = 0;
+	long long period_us = 1000000 / server.hz;
+	long long min_us = period_us * ACTIVE_EXPIRE_CYCLE_MIN_PERC / 100;
+	long long max_us = period_us * server.active_expire_max_cpu / 100;
+	long long start = ustime(), now_tick = (start / 1000) >> EXPIRE_TICK_BITS;
+	long long elapsed, deleted = 0;
+	int timelimit_exit = 0;
+
+	if (budget_us < min_us)
+		budget_us = min_us;
+	if (budget_us > max_us)
+		budget_us = max_us;
+
+	for (int j = 0; j < server.dbnum && !timelimit_exit; j++)
+	{
+		int dbid = (resume_db + j) % server.dbnum;
+		redisDb *db = &server.db[dbid];
+		twTimer *timer;
+
+		while ((timer = twPopExpired(db->expires_index, now_tick)) != NULL)
+		{
+			deleteExpiredKey(db, ((expireEntry*)timer)->key);
+			if (++deleted % ACTIVE_EXPIRE_CYCLE_CHECK_EVERY == 0 &&
+				ustime() - start >= budget_us)
+			{
+				timelimit_exit = 1;
+				resume_db = dbid;
+				break;
+			}
+		}
+	}
+
+	elapsed = ustime() - start;
+	server.stat_expire_cycle_budget_us = budget_us;
+	server.stat_expire_cycle_time_used += elapsed;
+	if (timelimit_exit)
+	{
+		server.stat_expired_time_cap_reached_count++;
+		budget_us *= 2;
+	}
+	else
+	{
+		budget_us /= 2;
+	}
+}
@@ -0,0 +1,161 @@
+/* Lazy freeing of the values of the deleted keys.
+
+Freeing a value made of millions of elements takes as many free() calls,
+a stall of seconds for the clients. Such values are unlinked from the
+keyspace by the main thread, that is O(1), and freed by the BIO_LAZY_FREE
+thread of bio.c. Small values are still freed in place, since a job costs
+more than a few free() calls.
+
+The memory of a value handed to the background thread is still allocated
+until the thread gets to it. It is estimated when the job is created and
+accounted in lazyfree_pending_bytes until the value is freed, so that the
+eviction does not evict more keys to free memory that is already on its
+way out. */
+
+#include "server.h"
+
+static size_t lazyfree_objects = 0;
+static size_t lazyfree_pending_bytes = 0;
+
+/* Return the number of currently pending objects to free. */
+size_t lazyfreeGetPendingObjectsCount(void)
+{
+	return __atomic_load_n(&lazyfree_objects, __ATOMIC_RELAXED);
+}
+
+/* Return the estimated memory of the objects waiting to be freed. */
+size_t lazyfreeGetPendingBytes(void)
+{
+	return __atomic_load_n(&lazyfree_pending_bytes, __ATOMIC_RELAXED);
+}
+
+/* Return the amount of work needed in order to free an object.
+The return value is not always the actual number of allocations the
+object is composed of, but a number proportional to it.
+
+For strings the function always returns 1.
+
+For aggregated objects represented by hash tables the number of elements
+is returned, the other encodings are single allocations. */
+size_t lazyfreeGetFreeEffort(robj *obj)
+{
+	if ((obj->type == OBJ_SET || obj->type == OBJ_HASH) &&
+		obj->encoding == OBJ_ENCODING_HT)
+		return dictSize((dict*)obj->ptr);
+	return 1;
+}
+
+/* Elements sampled by lazyfreeEstimateBytes(). */
+#define LAZYFREE_SIZE_SAMPLES 8
+
+class lazyfreeSizeSample
+{
+public:
+	dict *d;
+	size_t bytes;
+	unsigned long count;
+};
+
+static void lazyfreeSizeCallback(void *privdata, dictEntry **entries, unsigned long count)
+{
+	lazyfreeSizeSample *s = (lazyfreeSizeSample*)privdata;
+
+	for (unsigned long j = 0; j < count && s->count < LAZYFREE_SIZE_SAMPLES; j++)
+	{
+		sds ele = (sds)dictGetKey(entries[j]);
+		sds val = (sds)dictGetVal(entries[j]);
+
+		s->bytes += dictEntryMemUsage(s->d, entries[j]) +
+			sdsAllocSize(ele) + (val ? sdsAllocSize(val) : 0);
+		s->count++;
+	}
+}
+
+/* Estimate the memory of an object that lazyfreeGetFreeEffort() found
+expensive to free: the tables of its dict, and the average size of a few
+elements, entries included, times their number. The slots of an open
+addressing table hold the entries, with a control byte each. */
+size_t lazyfreeEstimateBytes(robj *obj)
+{
+	size_t bytes = sizeof(*obj);
+
+	if ((obj->type == OBJ_SET || obj->type == OBJ_HASH) &&
+		obj->encoding == OBJ_ENCODING_HT)
+	{
+		dict *d = (dict*)obj->ptr;
+		lazyfreeSizeSample s;
+		unsigned long cursor = 0;
+
+		s.d = d;
+		s.bytes = s.count = 0;
+		do
+			cursor = dictScanBatch(d, cursor, LAZYFREE_SIZE_SAMPLES - s.count,
+				lazyfreeSizeCallback, &s);
+		while (cursor && s.count < LAZYFREE_SIZE_SAMPLES);
+		bytes += sizeof(*d) + dictSlots(d) *
+			(d->swiss ? sizeof(dictEntry) + 1 : sizeof(dictEntry*));
+		if (s.count)
+			bytes += s.bytes / s.count * dictSize(d);
+	}
+	return bytes;
+}
+
+/* Free the object, in place if it is cheap, otherwise with a
+BIO_LAZY_FREE job. Returns the bytes handed to the background thread,
+0 if the object was freed in place. */
+#define LAZYFREE_THRESHOLD 64
+size_t freeObjAsync(robj *obj)
+{
+	size_t free_effort = lazyfreeGetFreeEffort(obj), bytes;
+
+	/* If releasing the object is too much work, do it in the background.
+	The object must not be shared: the background thread would free it
+	while the main thread is still using it. */
+	if (free_effort > LAZYFREE_THRESHOLD && obj->refcount == 1)
+	{
+		bytes = lazyfreeEstimateBytes(obj);
+		__atomic_add_fetch(&lazyfree_objects, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&lazyfree_pending_bytes, bytes, __ATOMIC_RELAXED);
+		server.bio.createBackgroundJob(BIO_LAZY_FREE, obj, (void*)bytes, NULL);
+		return bytes;
+	}
+	decrRefCount(obj);
+	return 0;
+}
+
+/* Delete a key, value, and associated expiration entry if any, from the
+DB. The key is unlinked right away, the value is freed by freeObjAsync().
+Returns the bytes handed to the background thread, or 0 if the value was
+freed in place or the key was not found, then '*deleted' is 0. */
+size_t dbAsyncDelete(redisDb *db, sds key, int *deleted)
+{
+	dictEntry *de;
+	size_t bytes;
+	robj *val;
+
+	/* Deleting an entry from the expires dict will not free the sds of
+	the key, because it is shared with the main dictionary. */
+	removeExpire(db, key);
+
+	de = dictFind(db->dictionary, key);
+	*deleted = de != NULL;
+	if (de == NULL)
+		return 0;
+
+	/* Detach the value from the entry, so that deleting the key does not
+	free it, and the valDestructor of the keyspace skips NULL values. */
+	val = (robj*)dictGetVal(de);
+	dictSetVal(db->dictionary, de, NULL);
+	bytes = freeObjAsync(val);
+	dictDelete(db->dictionary, key);
+	return bytes;
+}
+
+/* Release objects from the lazyfree thread. It's just decrRefCount()
+updating the count of objects to release and the pending bytes. */
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t bytes)
+{
+	decrRefCount(o);
+	__atomic_sub_fetch(&lazyfree_pending_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&lazyfree_objects, 1, __ATOMIC_RELAXED);
+}
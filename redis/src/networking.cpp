@@ -3,4 +3,22 @@ void acceptTcpHandler(aeEventLoop *el, int fd, void* privdata, int mask)
 {
 	int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
 	char cip[NET_IP_STR_LEN];
+
+	while (max--)
+	{
+		cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+		if (cfd == ANET_ERR)
+		{
+			if (errno != EWOULDBLOCK)
+				serverLog(LL_WARNING, "Accepting client connection: %s", server.neterr);
+			return;
+		}
+		/* Busy poll the socket on the low latency tier, see anetSetBusyPoll(). */
+		if (server.so_busy_poll_usecs &&
+			anetSetBusyPoll(server.neterr, cfd, server.so_busy_poll_usecs,
+				server.so_prefer_busy_poll, server.so_busy_poll_budget) == ANET_ERR)
+			serverLog(LL_VERBOSE, "Busy polling not enabled for client: %s", server.neterr);
+		serverLog(LL_VERBOSE, "Accepted %s:%d", cip, cport);
+		acceptCommonHandler(cfd, 0, cip);
+	}
 }
@@ -0,0 +1,59 @@
+/* Redis objects, the values of the keyspace.
+
+Besides the type, the encoding and the reference count, every object has
+24 bits of access information used by the maxmemory policies: the LRU
+clock of the last access, or with the LFU policies a logarithmic access
+counter with the time it was last decremented (see evict.cpp). */
+
+#ifndef __OBJECT_H
+#define __OBJECT_H
+
+#include <limits.h>
+
+/* The actual Redis Object */
+#define OBJ_STRING 0    /* String object. */
+#define OBJ_LIST 1      /* List object. */
+#define OBJ_SET 2       /* Set object. */
+#define OBJ_ZSET 3      /* Sorted set object. */
+#define OBJ_HASH 4      /* Hash object. */
+
+/* Objects encoding. Some kind of objects like Strings and Hashes can be
+internally represented in multiple ways. The 'encoding' field of the object
+is set to one of this fields for this object. */
+#define OBJ_ENCODING_RAW 0     /* Raw representation */
+#define OBJ_ENCODING_INT 1     /* Encoded as integer */
+#define OBJ_ENCODING_HT 2      /* Encoded as hash table */
+#define OBJ_ENCODING_ZIPMAP 3  /* Encoded as zipmap */
+#define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
+#define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
+#define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
+#define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
+#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+
+#define OBJ_SHARED_REFCOUNT INT_MAX
+
+#define LRU_BITS 24
+#define LRU_CLOCK_MAX ((1 << LRU_BITS) - 1) /* Max value of obj->lru */
+#define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
+
+/* New keys start with this LFU counter, so that they survive long enough
+to collect some accesses before being evicted. */
+#define LFU_INIT_VAL 5
+
+class redisObject
+{
+public:
+	unsigned type:4;
+	unsigned encoding:4;
+	unsigned lru:LRU_BITS; /* LRU time (relative to the global lruclock) or
+	                          LFU data (least significant 8 bits frequency
+	                          and most significant 16 bits decrement time). */
+	int refcount;
+	void *ptr;
+};
+typedef redisObject robj;
+
+void decrRefCount(robj *o);
+
+#endif
@@ -83,6 +83,18 @@ void redisServer::bugReportStart()
 	}
 }
 
+/* Return the UNIX time in microseconds */
+long long ustime(void)
+{
+	struct timeval tv;
+	long long ust;
+
+	gettimeofday(&tv, NULL);
+	ust = ((long long)tv.tv_sec) * 1000000;
+	ust += tv.tv_usec;
+	return ust;
+}
+
 /* We store a cached value of the unix time in the global state because
 when accuracy is not needed, with virtual memory and aging, at every object 
 access, accessing a global var is a lot faster than calling time(NULL). */ 
@@ -103,6 +115,108 @@ void updateCachedTime()
 
 }
 
+/* Rehash the dicts of the databases that are in the middle of a
+rehashing, spending at most 'us' microseconds for all of them. A dict that
+stopped receiving writes would otherwise keep both tables, and every
+lookup would probe both, forever. Every call resumes from the DB where
+the previous one ran out of time, so that the DBs at the end are not
+starved by a big rehashing at the start. */
+static void incrementallyRehash(long long us)
+{
+	static int resume_db = 0;
+	long long start = ustime(), elapsed = 0;
+
+	for (int j = 0; j < server.dbnum && elapsed < us; j++)
+	{
+		redisDb *db = &server.db[(resume_db + j) % server.dbnum];
+		dict *dicts[] = {db->dictionary, db->expires, db->blocking_keys,
+			db->ready_keys, db->watched_keys};
+
+		for (dict *d : dicts)
+		{
+			if (!dictIsRehashing(d))
+				continue;
+			server.stat_active_rehash_steps +=
+				dictRehashMicroseconds(d, us - elapsed);
+			elapsed = ustime() - start;
+			if (elapsed >= us)
+			{
+				resume_db = (resume_db + j) % server.dbnum;
+				break;
+			}
+		}
+	}
+	server.stat_active_rehash_us += elapsed;
+}
+
+/* Shrink the DB dicts that stayed sparse: the deletes shrink them as they
+go, unless resizing was disabled at the time. */
+static void tryResizeHashTables(void)
+{
+	for (int j = 0; j < server.dbnum; j++)
+	{
+		redisDb *db = &server.db[j];
+		dict *all[] = {db->dictionary, db->expires, db->blocking_keys,
+			db->ready_keys, db->watched_keys};
+
+		for (dict *d : all)
+			dictShrinkIfNeeded(d);
+	}
+}
+
+/* Sample how far the rehashing of the DB dicts is, for the stats. */
+static void updateRehashStats(void)
+{
+	int dicts = 0;
+	unsigned long pending = 0;
+	dictAllocStats alloc;
+
+	for (int j = 0; j < server.dbnum; j++)
+	{
+		redisDb *db = &server.db[j];
+		dict *all[] = {db->dictionary, db->expires, db->blocking_keys,
+			db->ready_keys, db->watched_keys};
+
+		for (dict *d : all)
+		{
+			if (!dictIsRehashing(d))
+				continue;
+			dicts++;
+			pending += dictRehashPending(d);
+		}
+	}
+	server.stat_rehashing_dicts = dicts;
+	server.stat_rehash_pending = pending;
+	dictGetAllocStats(&alloc);
+	server.stat_dict_shrinks = alloc.shrinks;
+	server.stat_dict_reclaimed_bytes = alloc.reclaimed_bytes;
+}
+
+/* This function handles 'background' operations we are required to do
+incrementally in Redis databases, such as active key expiring and
+rehashing. */
+void databasesCron(void)
+{
+	activeExpireCycle();
+	tryResizeHashTables();
+	if (server.activerehashing)
+		incrementallyRehash(server.active_rehash_budget_us);
+	updateRehashStats();
+}
+
+/* This is our timer interrupt, called server.hz times per second, on the
+main event loop. */
+int serverCron(aeEventLoop *eventLoop, long long id, void *clientData)
+{
+	updateCachedTime();
+
+	/* The LRU clock of the objects has LRU_CLOCK_RESOLUTION, refreshing it
+	here saves a system call at every key access. */
+	__atomic_store_n(&server.lruclock, getLRUClock(), __ATOMIC_RELAXED);
+	databasesCron();
+	return 1000 / server.hz;
+}
+
 /* Initialize a set of file descriptors to listen to the specified
 'port' binding the addresses specified in the Redis server configuration.
 
@@ -119,11 +233,19 @@ On success the function returns C_OK.
 On error the function returns C_ERR. For the function to be on error, at
 least one of the server.bindaddr addresses was impossible to bind, or no 
 bind addresses were specified in the server configuration but the function
-is not able to bind * for at least one of the IPv4 or IPv6 protocols. */
+is not able to bind * for at least one of the IPv4 or IPv6 protocols.
 
-int redisServer::listenToPort(int port, int *fds, int& count)
+When 'reuseport' is non zero the sockets are created with SO_REUSEPORT,
+so that every event loop can bind its own set of listeners to the same
+addresses. */
+
+int redisServer::listenToPort(int port, int *fds, int& count, int reuseport)
 {
 	int j;
+	int (*tcpServer)(char*, int, char*, int) =
+		reuseport ? anetTcpReusePortServer : anetTcpServer;
+	int (*tcp6Server)(char*, int, char*, int) =
+		reuseport ? anetTcp6ReusePortServer : anetTcp6Server;
 	/* Force binding of 0.0.0.0 (IP address of localhost) if no bind 
 	address is specified, always entering the loop if j == 0. */
 	if (bindaddr_count == 0) 
@@ -135,7 +257,7 @@ int redisServer::listenToPort(int port, int *fds, int& count)
 			int unsupported = 0;
 			/* Bind * for both IPv6 and IPv4, we enter here only
 			if bindaddr_count == 0. */
-			fds[count] = anetTcp6Server(neterr, port, NULL, tcp_backlog);
+			fds[count] = tcp6Server(neterr, port, NULL, tcp_backlog);
 			if (fds[count] != ANET_ERR)
 			{
 				anetNonBlock(NULL, fds[count]);
@@ -150,7 +272,7 @@ int redisServer::listenToPort(int port, int *fds, int& count)
 			if (count == 1 || unsupported)
 			{
 				/* Bind the IPv4 address as well. */
-				fds[count] = anetTcpServer(neterr, port, NULL, tcp_backlog);
+				fds[count] = tcpServer(neterr, port, NULL, tcp_backlog);
 				if (fds[count] != ANET_ERR)
 				{
 					anetNonBlock(NULL, fds[count]);
@@ -172,12 +294,12 @@ int redisServer::listenToPort(int port, int *fds, int& count)
 		else if (strchr(bindaddr[j], ':'))
 		{
 			/* Bind IPv6 address. */
-			fds[count] = anetTcp6Server(neterr, port, bindaddr[j], tcp_backlog);
+			fds[count] = tcp6Server(neterr, port, bindaddr[j], tcp_backlog);
 		}
 		else
 		{
 			/* Bind IPv4 address. */
-			fds[count] = anetTcpServer(neterr, port, bindaddr[j], tcp_backlog);
+			fds[count] = tcpServer(neterr, port, bindaddr[j], tcp_backlog);
 		}
 		if (fds[count] == ANET_ERR)
 		{
@@ -202,11 +324,40 @@ void redisServer::init()
 	slavesldb = -1; /* Force to emit the first SELECT command. */
 	get_ack_from_slaves = 0;
 	clients_paused = 0;
-	el = aeCreateEventLoop(maxclients + CONFIG_FDSET_INCR);
-	/* Open TCP listening socket for the user commands. */
+	/* Create one event loop per configured thread. The vector is sized
+	once here: the loops are referenced by address from their threads, so
+	it must never reallocate afterwards. */
+	el.resize(el_count);
+	for (j = 0; j < el_count; ++j)
+	{
+		if (aeCreateEventLoop(el[j], maxclients + CONFIG_FDSET_INCR, ae_api) == AE_ERR)
+		{
+			log(LL_WARNING, "Failed creating the event loop. Error message: '%s'",
+				strerror(errno));
+			exit(1);
+		}
+		el[j].id = j;
+		aeSetDrainBudget(&el[j], el_drain_budget);
+		aeSetBusyPoll(&el[j], el_busy_poll_usecs);
+		if (el_stats)
+			aeEnableLoopStats(&el[j], el_slow_handler_us);
+	}
+	if (ae_api != AE_API_DEFAULT && el[0].api != ae_api)
+		log(LL_WARNING, "io_uring is not available, using %s instead.",
+			aeGetApiName(&el[0]));
+	/* Open TCP listening socket for the user commands. With more than one
+	event loop every loop gets its own SO_REUSEPORT sockets. */
 	if (port != 0
-		&& listenToPort(port, ipfd, ipfd_count) == C_ERR)
+		&& listenToPort(port, ipfd, ipfd_count, el_count > 1) == C_ERR)
 		exit(1);
+	el_listeners.resize(el_count);
+	for (j = 1; j < el_count && port != 0; ++j)
+	{
+		el_listeners[j].ipfd_count = 0;
+		if (listenToPort(port, el_listeners[j].ipfd,
+			el_listeners[j].ipfd_count, 1) == C_ERR)
+			exit(1);
+	}
 	 
 	/* Open the listening Unix domain socket. */
 	if (unixsocket != NULL)
@@ -221,36 +372,55 @@ void redisServer::init()
 	}
 	
 	/* Create the Redis databases, and initialize other internal state. */
+	dictSetShrinkPercent(dict_shrink_percent);
 	for (j = 0; j < dbnum; ++j)
 	{
-		db[j].dict = dictCreate(&dbDickType, NULL);
+		db[j].dictionary = dictCreate(&dbDickType, NULL);
 		db[j].expires = dictCreate(&keyptrDictType, NULL);
 		db[j].blocking_keys = dictCreate(&keylistDictType, NULL);
 		db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType, NULL);
 		db[j].watched_keys = dictCreate(&keylistDictType, NULL);
 		db[j].id = j;
 		db[j].avg_ttl = 0;
+		expireIndexInit(&db[j]);
 		db[j].defrag_later = listCreate(); 
 	}
 	evictionPoolAlloc();
 	pubsub_channels = dictCreate(&keylistDictType, NULL);
 	pubsub_patterns = listCreate();
 	
+	/* Create the timer callback, this is our way to process many background
+	operations incrementally, like rehashing the databases. */
+	if (aeCreateTimeEvent(&el[0], 1, serverCron, NULL, NULL) == AE_ERR)
+		panic(__FILE__, __LINE__, "Can't create event loop timers.");
+
 	/* Create an event handler for accepting new connections in TCP and Unix 
 	domain sockets. */
 	for (j = 0; j < ipfd_count; ++j)
 	{
-		if (aeCreateFileEvent(el, ipfd[j], AE_READABLE, 
+		if (aeCreateFileEvent(&el[0], ipfd[j], AE_READABLE, 
 			acceptTcpHandler, NULL) == AE_ERR)
 			panic(__FILE__, __LINE__, "Uncoverable error creating ipfd file event.");
 	}
-	if (sofd > 0 && aeCreateFileEvent(sl, sofd, AE_READABLE, acceptUnixHandler, 
+	/* Every other loop accepts on its own SO_REUSEPORT sockets. Note that
+	acceptTcpHandler() does not pass its loop on to acceptCommonHandler(),
+	so the clients are not bound to the loop that accepted them yet. */
+	for (int l = 1; l < el_count; ++l)
+	{
+		for (j = 0; j < el_listeners[l].ipfd_count; ++j)
+		{
+			if (aeCreateFileEvent(&el[l], el_listeners[l].ipfd[j], AE_READABLE,
+				acceptTcpHandler, NULL) == AE_ERR)
+				panic(__FILE__, __LINE__, "Uncoverable error creating ipfd file event.");
+		}
+	}
+	if (sofd > 0 && aeCreateFileEvent(&el[0], sofd, AE_READABLE, acceptUnixHandler, 
 		NULL) == AE_ERR)
 		panic(__FILE__, __LINE__, "Uncoverable error creating server sofd file event.");	
 	
 	/* Register a readable event for the pipe used to awake the event loop
 	when a blocked client in a module needs attention. */
-	if (aeCreateFileEvent(server.el, server.module_blocked_pipe[0], AE_READABLE,
+	if (aeCreateFileEvent(&server.el[0], server.module_blocked_pipe[0], AE_READABLE,
 		moduleBlockedClientPipeReadable, NULL) == AE_ERR)
 		panic("Error registering the readable event for module blocked clients subsystem");
 
@@ -264,10 +434,67 @@ void redisServer::init()
 		maxmemory = 3072LL * (1024 * 1024);
 		maxmemory_policy = MAXMEMORY_NO_EVICTION;
 	}
-	bioInit();
+	bio.init(bio_threads);
+	/* Register a readable event for the fd the background workers signal
+	when the jobs created with a completion callback are done. */
+	if (aeCreateFileEvent(&el[0], bio.completionFd(), AE_READABLE,
+		bioCompletionHandler, &bio) == AE_ERR)
+		panic("Error registering the readable event for background job completions");
 	server.initial_memory_usage = zmalloc_used_memory();
 }
 
+/* Body of the threads running the event loops el[1..el_count-1]. The
+argument is the index of the loop. When pinning is enabled loop 'j' is bound
+to CPU 'j' (modulo the online CPUs), the main thread keeps running el[0]. */
+void *eventLoopThreadMain(void *arg)
+{
+	int id = (int)(unsigned long) arg;
+
+#ifdef __linux__
+	if (server.el_pinning)
+	{
+		cpu_set_t cpuset;
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(ncpu > 0 ? id % ncpu : 0, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+			serverLog(LL_WARNING, "Warning: can't pin event loop %d to a CPU", id);
+	}
+#endif
+	aeMain(&server.el[id]);
+	return NULL;
+}
+
+/* Spawn one thread per additional event loop. Must be called after init(),
+once every loop has its listeners registered. */
+void redisServer::startEventLoopThreads()
+{
+	pthread_t thread;
+
+#ifdef __linux__
+	if (el_count > 1 && el_pinning)
+	{
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(0, &cpuset);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	}
+#endif
+	for (int j = 1; j < el_count; ++j)
+	{
+		void *arg = (void*)(unsigned long) j;
+		if (pthread_create(&thread, NULL, eventLoopThreadMain, arg) != 0)
+		{
+			log(LL_WARNING, "Fatal: Can't spawn event loop thread %d.", j);
+			exit(1);
+		}
+		el_threads.push_back(thread);
+	}
+	if (el_count > 1)
+		log(LL_NOTICE, "Running %d event loops with SO_REUSEPORT listeners.", el_count);
+}
+
 void redisServer::initConfig(void)
 {
 	int j;
@@ -278,6 +505,35 @@ void redisServer::initConfig(void)
 	sofd = -1;
 	arch_bits = (sizeof(long) == 8) ? 64 : 32;
 	port = CONFIG_DEFAULT_SERVER_PORT;
+	el_count = CONFIG_DEFAULT_EVENT_LOOPS;
+	el_pinning = CONFIG_DEFAULT_EVENT_LOOP_PINNING;
+	ae_api = CONFIG_DEFAULT_AE_API;
+	el_drain_budget = CONFIG_DEFAULT_DRAIN_BUDGET;
+	el_busy_poll_usecs = CONFIG_DEFAULT_BUSY_POLL_USECS;
+	el_stats = CONFIG_DEFAULT_EL_STATS;
+	el_slow_handler_us = CONFIG_DEFAULT_EL_SLOW_HANDLER_US;
+	bio_threads = CONFIG_DEFAULT_BIO_THREADS;
+	so_busy_poll_usecs = CONFIG_DEFAULT_SO_BUSY_POLL_USECS;
+	so_prefer_busy_poll = CONFIG_DEFAULT_SO_PREFER_BUSY_POLL;
+	so_busy_poll_budget = CONFIG_DEFAULT_SO_BUSY_POLL_BUDGET;
+	activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
+	active_rehash_budget_us = CONFIG_DEFAULT_ACTIVE_REHASH_BUDGET_US;
+	dict_shrink_percent = CONFIG_DEFAULT_DICT_SHRINK_PERCENT;
+	active_expire_max_cpu = CONFIG_DEFAULT_ACTIVE_EXPIRE_MAX_CPU;
+	lruclock = getLRUClock();
+	stat_active_rehash_steps = 0;
+	stat_active_rehash_us = 0;
+	stat_rehashing_dicts = 0;
+	stat_rehash_pending = 0;
+	stat_dict_shrinks = 0;
+	stat_dict_reclaimed_bytes = 0;
+	stat_evictedkeys = 0;
+	stat_lazyfree_evictions = 0;
+	stat_admission_rejected = 0;
+	stat_expiredkeys = 0;
+	stat_expired_time_cap_reached_count = 0;
+	stat_expire_cycle_time_used = 0;
+	stat_expire_cycle_budget_us = 0;
 	backlog = CONFIG_DEFAULT_TCP_BACKLOG;
 	verbosity = CONFIG_DEFAULT_VERBOSITY;
 	logfile = CONFIG_DEFAULT_LOGFILE;
@@ -285,6 +541,12 @@ void redisServer::initConfig(void)
 	syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
 	maxmemory = CONFIG_DEFAULT_MAXMEMORY;
 	maxmemory_policy = CONFIG_DETAULT_MAXMEMORY_POLICY;	
+	maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+	lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
+	lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
+	tinylfu_sketch_bytes = CONFIG_DEFAULT_TINYLFU_SKETCH_BYTES;
+	lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
+	lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
 }
 
 void redisServer::loadConfig(string cf, string opts)
@@ -469,4 +731,7 @@ int main(int argc, char* argv[])
 	#endif
 		moduleLoadFromQueue();
 	}
+	server.startEventLoopThreads();
+	aeMain(&server.el[0]);
+	return 0;
 }
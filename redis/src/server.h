@@ -5,6 +5,9 @@
 #include <list>
 #include "client.h"
 #include "dict.h"
+#include "object.h"
+#include "bio.h"
+#include "timewheel.h"
 using namespace std;
 
 struct moduleLoadQueueEntry
@@ -14,46 +17,114 @@ struct moduleLoadQueueEntry
 	robj **argv;
 };
 
+/* A key with a time to live. The entry is the value of the key in the
+expires dict, and is queued by expire time in the expires_index of the
+DB. */
+class expireEntry
+{
+public:
+	twTimer timer;  /* Must be the first member, see activeExpireCycle(). */
+	long long when; /* Unix time in milliseconds the key expires at. */
+	sds key;        /* Shared with the keyspace. */
+};
+
 class redisDb 
 {
-	dict dictionary;     /* The keyspace for this DB. */
-	dict expires;        /* Timeout of keys with a timeout set. */
-	dict blocking_keys;  /* Keys with clients waiting for data. */
-	dict ready_keys;     /* Blocked keys that received a PUSH. */
-	dict watched_keys;   /* WATCHED keys for MULTI/EXEC CAS. */
+public:
+	dict *dictionary;     /* The keyspace for this DB. */
+	dict *expires;        /* Timeout of keys with a timeout set. */
+	twWheel *expires_index; /* The expireEntry of the expires by time, see expire.cpp */
+	dict *blocking_keys;  /* Keys with clients waiting for data. */
+	dict *ready_keys;     /* Blocked keys that received a PUSH. */
+	dict *watched_keys;   /* WATCHED keys for MULTI/EXEC CAS. */
 	int id;              /* Database ID. */
 	long long avg_ttl;   /* Average TTL, just for stats. */
 	//list ;               /* list of key names to attempt to defrag one by one, gradually. */
 
 };
 
+/* Listening sockets of one event loop. When more than one event loop is
+configured every loop opens its own SO_REUSEPORT sockets, so the kernel
+balances incoming connections among them. */
+class eventLoopListeners
+{
+public:
+	int ipfd[CONFIG_BINDADDR_MAX];       /* TCP socket descriptors */
+	int ipfd_count;                      /* Used slots in ipfd[] */
+};
+
 class redisServer
 {
-	int hz;
 	pid_t pid;
-	Bio bio; /* Background I/O service */	
 
 public:
+	Bio bio; /* Background I/O service */	
 	/* General */
+	int hz;                   /* serverCron() calls frequency in hertz */
 	string configfile;	  /* Absolute config file path or NULL. */
 	vector<string> exec_argv; /* Executable argv vector (copy). */
 	string executable;        /* Absolute executable file path. */
-	vector<aeEventLoop> el;	  /* event list */
+	vector<aeEventLoop> el;	  /* event list, el[0] runs in the main thread */
+	int el_count;             /* Number of event loops (and threads) to run. */
+	int el_pinning;           /* Pin the event loop threads to CPUs. */
+	int ae_api;               /* Preferred multiplexing backend, AE_API_* */
+	size_t el_drain_budget;   /* Bytes an AE_EDGE handler may move per iteration. */
+	long long el_busy_poll_usecs; /* Spin without blocking this long after an event. */
+	int el_stats;             /* Record event loop latency histograms. */
+	long long el_slow_handler_us; /* Threshold to log a handler as slow. */
+	vector<pthread_t> el_threads; /* Threads running el[1..el_count-1]. */
+	int bio_threads;          /* Workers of the background jobs. */
 	int arch_bits;            /* 32 or 64 depending on sizeof(long) */
+	redisDb *db;
+	int dbnum;                /* Total number of configured DBs */
+	int activerehashing;      /* Incremental rehash in serverCron() */
+	long long active_rehash_budget_us; /* Rehash time per cron tick, all DBs */
+	int dict_shrink_percent;  /* Shrink the dict tables used below this. */
+	int active_expire_max_cpu; /* Max percentage of the cron period to expire keys. */
+	unsigned int lruclock;    /* Clock for LRU eviction, see getLRUClock() */
 	/* Networking */
 	int port;                            /* TCP listening port */
 	string bindaddr[CONFIG_BINDADDR_MAX];/* Addresses we should bind to. */
 	int bindaddr_count;                  /* Number of addresses in bindaddr[] */
 	int ipfd[CONFIG_BINDADDR_MAX];       /* TCP socket descriptors */
 	int ipfd_count;                      /* Used slots in ipfd[] */
+	vector<eventLoopListeners> el_listeners; /* Listeners of el[j], j > 0 (el[0] uses ipfd) */
 	int sofd;			     /* Unix socket file descriptor */
 	string neterr;                       /* Error buffer for anet.c */
 	int tcp_backlop;                     /* TCP listen() backlog */	
+	int so_busy_poll_usecs;              /* SO_BUSY_POLL of client sockets */
+	int so_prefer_busy_poll;             /* SO_PREFER_BUSY_POLL of client sockets */
+	int so_busy_poll_budget;             /* SO_BUSY_POLL_BUDGET of client sockets */
 
 	list<client> clients;
 	list<client> clients_to_close;
 	client current_client;
 
+	/* Fields used only for stats */
+	long long stat_active_rehash_steps;  /* Buckets migrated by the cron */
+	long long stat_active_rehash_us;     /* Time spent rehashing in the cron */
+	int stat_rehashing_dicts;            /* DB dicts still rehashing */
+	unsigned long stat_rehash_pending;   /* Keys they still have to move */
+	unsigned long long stat_dict_shrinks;         /* Dict tables shrunk */
+	unsigned long long stat_dict_reclaimed_bytes; /* Memory the shrinks freed */
+	long long stat_evictedkeys;          /* Number of evicted keys (maxmemory) */
+	long long stat_lazyfree_evictions;   /* Evicted keys freed in background */
+	long long stat_admission_rejected;   /* New keys deleted by the admission */
+	long long stat_expiredkeys;          /* Number of expired keys */
+	long long stat_expired_time_cap_reached_count; /* Expire cycles out of time */
+	long long stat_expire_cycle_time_used; /* Time spent expiring keys, in us */
+	long long stat_expire_cycle_budget_us; /* Time given to the last cycle */
+
+	/* Limits */
+	unsigned long long maxmemory;   /* Max number of memory bytes to use */
+	int maxmemory_policy;           /* Policy for key eviction */
+	int maxmemory_samples;          /* Precision of random sampling */
+	int lfu_log_factor;             /* LFU logarithmic counter factor. */
+	int lfu_decay_time;             /* LFU counter decay factor. */
+	size_t tinylfu_sketch_bytes;    /* Memory of the admission sketch. */
+	int lazyfree_lazy_eviction;     /* Free expensive evicted values in background. */
+	int lazyfree_lazy_expire;       /* Free expensive expired values in background. */
+
 	/* Logging */
 	int verbosity;			     /* Loglevel in redis.conf */
 	string logfile;                      /* Path of log file */
@@ -77,7 +148,50 @@ public:
 	void logRaw(int, const char*);
 	void log();
 	void updateCachedTime();
-	int listenToPort(int, int*, int);
+	int listenToPort(int, int*, int&, int);
+	void startEventLoopThreads();
 	void panic();
 };
+
+extern redisServer server;
+
+long long ustime(void);
+
+/* Keys eviction, evict.cpp */
+void evictionPoolAlloc(void);
+unsigned int getLRUClock(void);
+unsigned int LRU_CLOCK(void);
+unsigned long long estimateObjectIdleTime(robj *o);
+unsigned long LFUGetTimeInMinutes(void);
+uint8_t LFULogIncr(uint8_t counter);
+unsigned long LFUDecrAndReturn(robj *o);
+void objectInitLRUOrLFU(robj *o);
+void objectTouch(robj *o);
+dictEntry *evictionPoolBestKey(int *bestdbid);
+dictEntry *evictionPoolPeekKey(int *bestdbid);
+int evictionAdmitKey(redisDb *db, sds key);
+int getMaxmemoryState(size_t *total, size_t *tofree);
+int freeMemoryIfNeeded(void);
+
+/* Admission sketch, tinylfu.cpp */
+void tinylfuResize(size_t bytes);
+void tinylfuRecordAccess(sds key);
+unsigned int tinylfuEstimate(sds key);
+size_t tinylfuGetMemory(void);
+
+/* Keys expiration, expire.cpp */
+void expireIndexInit(redisDb *db);
+long long getExpire(redisDb *db, sds key);
+void setExpire(redisDb *db, sds key, long long when);
+int removeExpire(redisDb *db, sds key);
+void activeExpireCycle(void);
+
+/* Lazy free, lazyfree.cpp */
+size_t lazyfreeGetPendingObjectsCount(void);
+size_t lazyfreeGetPendingBytes(void);
+size_t lazyfreeGetFreeEffort(robj *obj);
+size_t lazyfreeEstimateBytes(robj *obj);
+size_t freeObjAsync(robj *obj);
+size_t dbAsyncDelete(redisDb *db, sds key, int *deleted);
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t bytes);
 #endif
@@ -0,0 +1,91 @@
+/* SipHash reference C implementation, reduced to SipHash-1-2: one
+compression round per 8 bytes block and two finalization rounds instead of
+the 2 and 4 of SipHash-2-4. This is what Redis uses for the hash tables:
+the keys come from the clients, so the hash must be keyed to resist hash
+flooding, but dict hashes are never exposed, which is what makes the
+reduced rounds acceptable.
+
+SipHash was designed by Jean-Philippe Aumasson and Daniel J. Bernstein. */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef SIPHASH_CROUNDS
+#define SIPHASH_CROUNDS 1
+#endif
+#ifndef SIPHASH_DROUNDS
+#define SIPHASH_DROUNDS 2
+#endif
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+/* Little endian load, the compiler turns the memcpy into a plain load. */
+static inline uint64_t U8TO64_LE(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+/* Hash 'inlen' bytes of 'in' with the 16 bytes key 'k'. */
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k)
+{
+	uint64_t v0 = 0x736f6d6570736575ULL;
+	uint64_t v1 = 0x646f72616e646f6dULL;
+	uint64_t v2 = 0x6c7967656e657261ULL;
+	uint64_t v3 = 0x7465646279746573ULL;
+	uint64_t k0 = U8TO64_LE(k);
+	uint64_t k1 = U8TO64_LE(k + 8);
+	uint64_t m;
+	const uint8_t *end = in + inlen - (inlen % sizeof(uint64_t));
+	const int left = inlen & 7;
+	uint64_t b = ((uint64_t)inlen) << 56;
+
+	v3 ^= k1;
+	v2 ^= k0;
+	v1 ^= k1;
+	v0 ^= k0;
+
+	for (; in != end; in += 8)
+	{
+		m = U8TO64_LE(in);
+		v3 ^= m;
+		for (int i = 0; i < SIPHASH_CROUNDS; i++)
+			SIPROUND;
+		v0 ^= m;
+	}
+
+	switch (left)
+	{
+	case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+	case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+	case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+	case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+	case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+	case 2: b |= ((uint64_t)in[1]) << 8;  /* fall through */
+	case 1: b |= ((uint64_t)in[0]); break;
+	case 0: break;
+	}
+
+	v3 ^= b;
+	for (int i = 0; i < SIPHASH_CROUNDS; i++)
+		SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	for (int i = 0; i < SIPHASH_DROUNDS; i++)
+		SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,343 @@
+/* Hierarchical timing wheel, see timewheel.h for the design. */
+
+#include "timewheel.h"
+
+#define TW_ROOT_MASK (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK (TW_LEVEL_SIZE - 1)
+#define TW_ROOT_WORDS (TW_ROOT_SIZE / 64)
+
+/* Shift of the slot index of the upper wheel 'l' (0 based). Wheel 'l'
+holds the timers expiring less than 1 << TW_SHIFT(l+1) ms from now. */
+#define TW_SHIFT(l) (TW_ROOT_BITS + (l) * TW_LEVEL_BITS)
+
+/* ----------------------------- List helpers ----------------------------- */
+
+void twListInit(twTimer *head)
+{
+	head->prev = head->next = head;
+	head->head = NULL;
+}
+
+int twListEmpty(twTimer *head)
+{
+	return head->next == head;
+}
+
+static void twListAppend(twTimer *head, twTimer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+	timer->head = head;
+}
+
+static void twListUnlink(twTimer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = timer->head = NULL;
+}
+
+/* --------------------------- Slot bookkeeping --------------------------- */
+
+/* Distance, going forward circularly, from root slot 'from' to the first
+non empty root slot, or -1 if the root wheel is empty. */
+static int twFindRoot(twWheel *wheel, int from)
+{
+	int word = from >> 6;
+	uint64_t m = wheel->rootmap[word] & (~0ULL << (from & 63));
+
+	/* The last word visited is the first one again, this time with the
+	bits before 'from' that are the slots of the next rotation. */
+	for (int i = 0; i <= TW_ROOT_WORDS; i++)
+	{
+		if (m)
+			return ((word << 6) + __builtin_ctzll(m) - from) & TW_ROOT_MASK;
+		word = (word + 1) % TW_ROOT_WORDS;
+		m = wheel->rootmap[word];
+	}
+	return -1;
+}
+
+/* Same as twFindRoot() for the upper wheel 'l'. The slot 'from' is
+included in the search only if 'pending' is true, that is, if it was not
+cascaded yet: otherwise its timers belong to the next rotation and the
+returned distance is in the range 1..TW_LEVEL_SIZE. */
+static int twFindLevel(twWheel *wheel, int l, int from, int pending)
+{
+	uint64_t m = wheel->levelmap[l];
+	int start = pending ? from : (from + 1) & TW_LEVEL_MASK;
+
+	if (!m)
+		return -1;
+	m = (m >> start) | (start ? m << (TW_LEVEL_SIZE - start) : 0);
+	return __builtin_ctzll(m) + !pending;
+}
+
+/* Link 'timer' in the slot matching its expire time. */
+static void twQueue(twWheel *wheel, twTimer *timer)
+{
+	long long delta = timer->when - wheel->current;
+
+	if (delta < TW_ROOT_SIZE)
+	{
+		/* Timers already expired go in the current slot. */
+		int idx = (delta < 0 ? wheel->current : timer->when) & TW_ROOT_MASK;
+		twListAppend(&wheel->root[idx], timer);
+		wheel->rootmap[idx >> 6] |= 1ULL << (idx & 63);
+		return;
+	}
+	for (int l = 0; l < TW_LEVELS - 1; l++)
+	{
+		if (delta < (1LL << TW_SHIFT(l + 1)))
+		{
+			int idx = (timer->when >> TW_SHIFT(l)) & TW_LEVEL_MASK;
+			twListAppend(&wheel->levels[l][idx], timer);
+			wheel->levelmap[l] |= 1ULL << idx;
+			return;
+		}
+	}
+	twListAppend(&wheel->overflow, timer);
+}
+
+/* Clear the bitmap bit of the slot whose sentinel is 'head' if the slot is
+empty. Returns 0 if 'head' is not a list of the wheel. */
+static int twSlotUpdate(twWheel *wheel, twTimer *head)
+{
+	if (head >= wheel->root && head < wheel->root + TW_ROOT_SIZE)
+	{
+		int idx = head - wheel->root;
+		if (twListEmpty(head))
+			wheel->rootmap[idx >> 6] &= ~(1ULL << (idx & 63));
+		return 1;
+	}
+	for (int l = 0; l < TW_LEVELS - 1; l++)
+	{
+		if (head >= wheel->levels[l] && head < wheel->levels[l] + TW_LEVEL_SIZE)
+		{
+			int idx = head - wheel->levels[l];
+			if (twListEmpty(head))
+				wheel->levelmap[l] &= ~(1ULL << idx);
+			return 1;
+		}
+	}
+	return head == &wheel->overflow;
+}
+
+/* Re-queue every timer of the list 'head'. */
+static void twRequeue(twWheel *wheel, twTimer *head)
+{
+	twTimer pending;
+
+	if (twListEmpty(head))
+		return;
+	/* Move the list away first: timers may be queued back in the very
+	same slot if they belong to the next rotation. */
+	pending.next = head->next;
+	pending.prev = head->prev;
+	pending.next->prev = &pending;
+	pending.prev->next = &pending;
+	twListInit(head);
+	twSlotUpdate(wheel, head);
+
+	while (!twListEmpty(&pending))
+	{
+		twTimer *timer = pending.next;
+		twListUnlink(timer);
+		twQueue(wheel, timer);
+	}
+}
+
+/* Called when the root wheel starts a new rotation: spread the timers of
+the current slot of the upper wheels in the lower ones. An upper wheel is
+cascaded only when the one below it starts a new rotation as well, and the
+overflow list is checked at every slot of the last wheel. */
+static void twCascade(twWheel *wheel)
+{
+	for (int l = 0; l < TW_LEVELS - 1; l++)
+	{
+		int idx = (wheel->current >> TW_SHIFT(l)) & TW_LEVEL_MASK;
+		twRequeue(wheel, &wheel->levels[l][idx]);
+		if (l == TW_LEVELS - 2)
+			twRequeue(wheel, &wheel->overflow);
+		if (idx != 0)
+			break;
+	}
+}
+
+/* ------------------------------ Public API ------------------------------ */
+
+void twInit(twWheel *wheel, long long now)
+{
+	wheel->current = now;
+	wheel->cascaded = 0;
+	wheel->count = 0;
+	for (int j = 0; j < TW_ROOT_SIZE; j++)
+		twListInit(&wheel->root[j]);
+	for (int l = 0; l < TW_LEVELS - 1; l++)
+	{
+		for (int j = 0; j < TW_LEVEL_SIZE; j++)
+			twListInit(&wheel->levels[l][j]);
+		wheel->levelmap[l] = 0;
+	}
+	for (int j = 0; j < TW_ROOT_WORDS; j++)
+		wheel->rootmap[j] = 0;
+	twListInit(&wheel->overflow);
+}
+
+/* Add 'timer', whose 'when' field must be set. O(1). */
+void twAdd(twWheel *wheel, twTimer *timer)
+{
+	twQueue(wheel, timer);
+	wheel->count++;
+}
+
+/* Remove 'timer' from the wheel, or from the list of expired timers
+returned by twExpire() it is linked to. Does nothing if the timer is not
+queued anywhere. O(1). */
+void twCancel(twWheel *wheel, twTimer *timer)
+{
+	twTimer *head = timer->head;
+
+	if (head == NULL)
+		return;
+	twListUnlink(timer);
+	if (twSlotUpdate(wheel, head))
+		wheel->count--;
+}
+
+/* Move 'current' past the root slot 'idx', that was emptied: to the next
+non empty slot of this rotation, or to the start of the next rotation
+that needs a cascade, but never past 'now' + 1. */
+static void twAdvance(twWheel *wheel, int idx, long long now)
+{
+	int next = TW_ROOT_SIZE;
+	long long target;
+
+	if (idx + 1 < TW_ROOT_SIZE)
+	{
+		int d = twFindRoot(wheel, idx + 1);
+		if (d != -1 && idx + 1 + d < TW_ROOT_SIZE)
+			next = idx + 1 + d;
+	}
+	target = wheel->current - idx + next;
+	wheel->current = target > now + 1 ? now + 1 : target;
+	wheel->cascaded = 0;
+}
+
+/* Move every timer expiring at or before 'now' to the list 'expired',
+that must be initialized with twListInit(). Empty root slots are
+skipped, so the cost does not depend on the time elapsed since the last
+call but on the timers and the rotations in between. */
+void twExpire(twWheel *wheel, long long now, twTimer *expired)
+{
+	while (wheel->current <= now)
+	{
+		int idx;
+
+		if (wheel->count == 0)
+		{
+			/* Nothing to cascade, jump straight to now. */
+			wheel->current = now + 1;
+			wheel->cascaded = 0;
+			break;
+		}
+
+		idx = wheel->current & TW_ROOT_MASK;
+		if (idx == 0 && !wheel->cascaded)
+			twCascade(wheel);
+
+		while (!twListEmpty(&wheel->root[idx]))
+		{
+			twTimer *timer = wheel->root[idx].next;
+			twListUnlink(timer);
+			twListAppend(expired, timer);
+			wheel->count--;
+		}
+		twSlotUpdate(wheel, &wheel->root[idx]);
+		twAdvance(wheel, idx, now);
+	}
+}
+
+/* Unlink and return one timer expiring at or before 'now', or NULL if
+there are none. Unlike twExpire() the work of a call does not depend on
+the number of timers due at the same time, so that the caller can stop
+in the middle of a large batch of them and resume later. */
+twTimer *twPopExpired(twWheel *wheel, long long now)
+{
+	while (wheel->current <= now)
+	{
+		int idx;
+
+		if (wheel->count == 0)
+		{
+			wheel->current = now + 1;
+			wheel->cascaded = 0;
+			return NULL;
+		}
+
+		/* The slot may be left with timers in it: remember that its
+		cascade was done, it must not happen again on the next call. */
+		idx = wheel->current & TW_ROOT_MASK;
+		if (idx == 0 && !wheel->cascaded)
+		{
+			twCascade(wheel);
+			wheel->cascaded = 1;
+		}
+
+		if (!twListEmpty(&wheel->root[idx]))
+		{
+			twTimer *timer = wheel->root[idx].next;
+			twListUnlink(timer);
+			twSlotUpdate(wheel, &wheel->root[idx]);
+			wheel->count--;
+			return timer;
+		}
+		twAdvance(wheel, idx, now);
+	}
+	return NULL;
+}
+
+/* Return the milliseconds from 'now' to the next time twExpire() may have
+something to do: the nearest timer in the root wheel, or the start of the
+nearest non empty slot of an upper wheel, that must be cascaded. Returns
+0 if a timer is already expired, and -1 if there are no timers at all,
+that is, the event loop may block forever. */
+long long twNextTimeout(twWheel *wheel, long long now)
+{
+	long long nearest = -1;
+	int d;
+
+	if (wheel->count == 0)
+		return -1;
+
+	d = twFindRoot(wheel, wheel->current & TW_ROOT_MASK);
+	if (d != -1)
+		nearest = wheel->current + d;
+	for (int l = 0; l < TW_LEVELS - 1; l++)
+	{
+		/* When 'current' starts a rotation of the wheel below, the slot
+		of this wheel was not cascaded yet. */
+		int pending = !wheel->cascaded &&
+			(wheel->current & ((1LL << TW_SHIFT(l)) - 1)) == 0;
+		long long slot = wheel->current >> TW_SHIFT(l);
+		d = twFindLevel(wheel, l, slot & TW_LEVEL_MASK, pending);
+		if (d == -1)
+			continue;
+		slot = (slot + d) << TW_SHIFT(l);
+		if (nearest == -1 || slot < nearest)
+			nearest = slot;
+	}
+	if (!twListEmpty(&wheel->overflow))
+	{
+		int shift = TW_SHIFT(TW_LEVELS - 2);
+		long long slot = wheel->current >> shift;
+		if ((wheel->current & ((1LL << shift) - 1)) || wheel->cascaded)
+			slot++;
+		slot <<= shift;
+		if (nearest == -1 || slot < nearest)
+			nearest = slot;
+	}
+	return nearest > now ? nearest - now : 0;
+}
@@ -0,0 +1,65 @@
+/* Hierarchical timing wheel, used by the event loop for time events, and
+by the databases to index the keys by expire time (see expire.cpp).
+
+Timers are kept in TW_LEVELS wheels of slots with millisecond resolution.
+The root wheel has one slot per millisecond for the next 256 ms, every
+upper wheel has 64 slots, each one covering a whole rotation of the wheel
+below it. Timers too far in the future for the last wheel wait in an
+overflow list. When time crosses the end of a rotation, the current slot
+of the upper wheel is cascaded: its timers are re-inserted and fall into
+the lower wheels.
+
+Insert and cancel are O(1): a timer is linked in the doubly linked list
+of its slot, that has a sentinel node so that it can be unlinked without
+knowing where it is. Bitmaps of the non empty slots let twNextTimeout()
+find the nearest timer without scanning the timers themselves.
+
+twExpire() collects every timer due at once, twPopExpired() returns them
+one at a time, for the callers that have to bound the work of a call. */
+
+#ifndef __TIMEWHEEL_H
+#define __TIMEWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TW_LEVELS 4
+#define TW_ROOT_BITS 8
+#define TW_ROOT_SIZE (1 << TW_ROOT_BITS)    /* 256 ms */
+#define TW_LEVEL_BITS 6
+#define TW_LEVEL_SIZE (1 << TW_LEVEL_BITS)  /* 16 s, 17 min, 18 h */
+
+/* A timer. It is meant to be embedded as first member in the structure
+of the user, see aeTimeEvent. */
+class twTimer
+{
+public:
+	long long when;      /* Absolute expire time in milliseconds. */
+	twTimer *prev;
+	twTimer *next;
+	twTimer *head;       /* Sentinel of the list the timer is in, or NULL. */
+};
+
+class twWheel
+{
+public:
+	long long current;   /* Every timer expiring before this ms was expired. */
+	int cascaded;        /* The cascade of 'current' was done, see twPopExpired(). */
+	size_t count;        /* Number of timers in the wheel. */
+	twTimer root[TW_ROOT_SIZE];
+	twTimer levels[TW_LEVELS-1][TW_LEVEL_SIZE];
+	twTimer overflow;
+	uint64_t rootmap[TW_ROOT_SIZE/64];  /* Non empty root slots. */
+	uint64_t levelmap[TW_LEVELS-1];     /* Non empty upper wheel slots. */
+};
+
+void twListInit(twTimer *head);
+int twListEmpty(twTimer *head);
+void twInit(twWheel *wheel, long long now);
+void twAdd(twWheel *wheel, twTimer *timer);
+void twCancel(twWheel *wheel, twTimer *timer);
+void twExpire(twWheel *wheel, long long now, twTimer *expired);
+twTimer *twPopExpired(twWheel *wheel, long long now);
+long long twNextTimeout(twWheel *wheel, long long now);
+
+#endif
@@ -0,0 +1,134 @@
+/* TinyLFU admission: the access frequency of the keys, evicted or never
+stored, estimated by a count-min sketch.
+
+With the allkeys-lru-tinylfu policy a key added while the memory is full
+is kept only if it was accessed more often than the key the eviction
+would pick in its place, see evictionAdmitKey(). Without it, every key
+read once by a scan pushes a hot key out of the cache.
+
+The sketch has TINYLFU_DEPTH rows of 4 bits counters, packed 16 to a
+word, and counts every access, hits and misses. A key increments one
+counter per row, chosen by its hash, and its frequency is the smallest
+of them: collisions can only make it bigger. Only the counters holding
+that minimum are incremented (conservative update), which keeps the
+overestimation of the cold keys low.
+
+Every 'sample' increments, ten times the counters of a row, all the
+counters are halved, so that what was hot long ago fades away. The
+memory of the sketch is fixed by tinylfu_sketch_bytes, and so is the
+number of keys it tells apart. */
+
+#include "server.h"
+
+#define TINYLFU_DEPTH 4
+#define TINYLFU_COUNTER_MAX 15
+#define TINYLFU_SAMPLE_FACTOR 10
+#define TINYLFU_MIN_WIDTH 64  /* Counters in a row, at least four words. */
+
+class tinylfuSketch
+{
+public:
+	uint64_t *table;         /* TINYLFU_DEPTH rows of 'width' counters. */
+	unsigned long width;     /* Counters in a row, a power of two. */
+	unsigned long additions; /* Increments since the last aging. */
+	unsigned long sample;    /* Increments between two agings. */
+	size_t bytes;            /* Memory of the table. */
+};
+
+static tinylfuSketch sketch;
+
+/* Size the sketch to at most 'bytes' of counters, but TINYLFU_MIN_WIDTH
+counters a row, forgetting every count. The sketch is allocated on the
+first access with an admission policy, with tinylfu_sketch_bytes. */
+void tinylfuResize(size_t bytes)
+{
+	unsigned long width = TINYLFU_MIN_WIDTH;
+
+	while ((width * 2) * TINYLFU_DEPTH / 2 <= bytes)
+		width *= 2;
+	zfree(sketch.table);
+	sketch.width = width;
+	sketch.bytes = width * TINYLFU_DEPTH / 2;
+	sketch.table = (uint64_t*)zcalloc(sketch.bytes);
+	sketch.additions = 0;
+	sketch.sample = width * TINYLFU_SAMPLE_FACTOR;
+}
+
+/* Fill 'idx' with the counter of 'key' in every row. The rows take their
+index by double hashing from the two halves of the same hash. */
+static void tinylfuIndexes(sds key, unsigned long *idx)
+{
+	uint64_t h = dictGenFastHashFunction(key, sdslen(key));
+	uint64_t step = (h >> 32) | 1;
+
+	for (int r = 0; r < TINYLFU_DEPTH; r++)
+		idx[r] = r * sketch.width + ((h + r * step) & (sketch.width - 1));
+}
+
+static unsigned int tinylfuCounter(unsigned long idx)
+{
+	return (sketch.table[idx >> 4] >> ((idx & 15) << 2)) & 15;
+}
+
+/* Halve every counter. The shift moves the low bit of a counter in the
+high bit of the one below it: the mask clears it. */
+static void tinylfuAge(void)
+{
+	for (size_t j = 0; j < sketch.bytes / sizeof(uint64_t); j++)
+		sketch.table[j] = (sketch.table[j] >> 1) & 0x7777777777777777ULL;
+	sketch.additions /= 2;
+}
+
+/* Count an access to 'key', whether it exists or not. Does nothing unless
+the policy is an admission one. */
+void tinylfuRecordAccess(sds key)
+{
+	unsigned long idx[TINYLFU_DEPTH];
+	unsigned int min = TINYLFU_COUNTER_MAX;
+
+	if (!(server.maxmemory_policy & MAXMEMORY_FLAG_ADMISSION))
+		return;
+	if (sketch.table == NULL)
+		tinylfuResize(server.tinylfu_sketch_bytes);
+	tinylfuIndexes(key, idx);
+	for (int r = 0; r < TINYLFU_DEPTH; r++)
+	{
+		unsigned int c = tinylfuCounter(idx[r]);
+		if (c < min)
+			min = c;
+	}
+	if (min == TINYLFU_COUNTER_MAX)
+		return;
+	for (int r = 0; r < TINYLFU_DEPTH; r++)
+	{
+		if (tinylfuCounter(idx[r]) == min)
+			sketch.table[idx[r] >> 4] += 1ULL << ((idx[r] & 15) << 2);
+	}
+	if (++sketch.additions >= sketch.sample)
+		tinylfuAge();
+}
+
+/* Estimated accesses to 'key' since the counters were last halved, plus
+half the ones before, saturated at TINYLFU_COUNTER_MAX. */
+unsigned int tinylfuEstimate(sds key)
+{
+	unsigned long idx[TINYLFU_DEPTH];
+	unsigned int min = TINYLFU_COUNTER_MAX;
+
+	if (sketch.table == NULL)
+		return 0;
+	tinylfuIndexes(key, idx);
+	for (int r = 0; r < TINYLFU_DEPTH; r++)
+	{
+		unsigned int c = tinylfuCounter(idx[r]);
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+/* Memory used by the sketch, for INFO. */
+size_t tinylfuGetMemory(void)
+{
+	return sketch.table ? sketch.bytes : 0;
+}
@@ -0,0 +1,87 @@
+/* Regression test of the epoll changelist: an fd deleted, closed, and
+whose number is reused by a new socket registered with the same mask, all
+in one loop iteration, must be registered again in the kernel. The final
+mask equals the one the kernel knew for the old file, so a flush comparing
+the two alone would skip the new socket, and its events would never fire.
+
+g++ -O2 -I../src ae_epoll_reuse_test.cpp ../src/timewheel.cpp -o ae_epoll_reuse_test */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ae.cpp"
+
+static int fired;
+
+static void readHandler(aeEventLoop *el, int fd, void *clientData, int mask)
+{
+	char buf[16];
+
+	fired++;
+	if (read(fd, buf, sizeof(buf)) <= 0)
+		aeDeleteFileEvent(el, fd, AE_READABLE);
+}
+
+static int wakeUp(aeEventLoop *el, long long id, void *clientData)
+{
+	return AE_NOMORE;
+}
+
+/* Run iterations until the handler fired or about 200 ms passed. */
+static int waitFired(aeEventLoop *el)
+{
+	for (int j = 0; j < 20 && !fired; j++)
+	{
+		aeCreateTimeEvent(el, 10, wakeUp, NULL, NULL);
+		aeProcessEvents(el, AE_ALL_EVENTS);
+	}
+	return fired;
+}
+
+static int check(const char *what, int ok)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	aeEventLoop el;
+	int a[2], b[2], failed = 0;
+
+	if (aeCreateEventLoop(el, 1024, AE_API_DEFAULT) == AE_ERR)
+	{
+		fprintf(stderr, "aeCreateEventLoop failed\n");
+		return 1;
+	}
+	printf("backend: %s\n", aeGetApiName(&el));
+
+	/* The old socket, known by the kernel after one iteration. */
+	socketpair(AF_UNIX, SOCK_STREAM, 0, a);
+	aeCreateFileEvent(&el, a[0], AE_READABLE, readHandler, NULL);
+	write(a[1], "x", 1);
+	failed += check("old socket fires", waitFired(&el));
+
+	/* Delete, close, reuse the number, re-add with the same mask. */
+	socketpair(AF_UNIX, SOCK_STREAM, 0, b);
+	aeDeleteFileEvent(&el, a[0], AE_READABLE);
+	close(a[0]);
+	dup2(b[0], a[0]);
+	close(b[0]);
+	aeCreateFileEvent(&el, a[0], AE_READABLE, readHandler, NULL);
+	fired = 0;
+	write(b[1], "y", 1);
+	failed += check("new socket on the reused fd fires", waitFired(&el));
+
+	/* Delete and re-add with the same mask without closing: still works. */
+	aeDeleteFileEvent(&el, a[0], AE_READABLE);
+	aeCreateFileEvent(&el, a[0], AE_READABLE, readHandler, NULL);
+	fired = 0;
+	write(b[1], "z", 1);
+	failed += check("fd deleted and re-added fires", waitFired(&el));
+
+	close(a[0]);
+	close(a[1]);
+	close(b[1]);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/* Benchmark of the event loop file event table layouts with 100k fds:
+the array of aeFileEvent structures indexed by fd it used to be, against
+the parallel arrays of aeEventLoop (masks, rfileProcs, wfileProcs,
+clientData). Both run the dispatch of aeProcessEvents() over the same
+random fired events, and the maxfd scan of aeDeleteFileEvent().
+
+g++ -O2 ae_layout_bench.cpp -o ae_layout_bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define NUM_FDS 100000
+#define FIRED_PER_ITER 512
+#define ITERATIONS 20000
+
+#define AE_NONE 0
+#define AE_READABLE 1
+#define AE_WRITABLE 2
+#define AE_BARRIER 4
+
+typedef void aeFileProc(void *eventloop, int fd, void *clientData, int mask);
+
+class aeFileEvent
+{
+public:
+	int mask;
+	aeFileProc *rfileProc;
+	aeFileProc *wfileProc;
+	void *clientData;
+};
+
+class aeFiredEvent
+{
+public:
+	int fd;
+	int mask;
+};
+
+static long long calls;
+
+static void handler(void *eventloop, int fd, void *clientData, int mask)
+{
+	calls += fd & 1;
+}
+
+static long long ustime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* Array of structures: one 32 bytes entry per fd. */
+static void dispatchAoS(aeFileEvent *events, aeFiredEvent *fired, int numevents)
+{
+	for (int j = 0; j < numevents; j++)
+	{
+		aeFileEvent *fe = &events[fired[j].fd];
+		int mask = fired[j].mask;
+		int fd = fired[j].fd;
+		int done = 0;
+		int invert = fe->mask & AE_BARRIER;
+
+		if (!invert && fe->mask & mask & AE_READABLE)
+		{
+			fe->rfileProc(NULL, fd, fe->clientData, mask);
+			done++;
+		}
+		if (fe->mask & mask & AE_WRITABLE)
+		{
+			if (!done || fe->wfileProc != fe->rfileProc)
+			{
+				fe->wfileProc(NULL, fd, fe->clientData, mask);
+				done++;
+			}
+		}
+		if (invert && fe->mask & mask & AE_READABLE)
+		{
+			if (!done || fe->wfileProc != fe->rfileProc)
+				fe->rfileProc(NULL, fd, fe->clientData, mask);
+		}
+	}
+}
+
+/* Parallel arrays, as in aeEventLoop. */
+static void dispatchSoA(unsigned char *masks, aeFileProc **rfileProcs,
+	aeFileProc **wfileProcs, void **clientData, aeFiredEvent *fired, int numevents)
+{
+	for (int j = 0; j < numevents; j++)
+	{
+		int fd = fired[j].fd;
+		int mask = fired[j].mask;
+		int done = 0;
+		int invert = masks[fd] & AE_BARRIER;
+
+		if (!invert && masks[fd] & mask & AE_READABLE)
+		{
+			rfileProcs[fd](NULL, fd, clientData[fd], mask);
+			done++;
+		}
+		if (masks[fd] & mask & AE_WRITABLE)
+		{
+			if (!done || wfileProcs[fd] != rfileProcs[fd])
+			{
+				wfileProcs[fd](NULL, fd, clientData[fd], mask);
+				done++;
+			}
+		}
+		if (invert && masks[fd] & mask & AE_READABLE)
+		{
+			if (!done || wfileProcs[fd] != rfileProcs[fd])
+				rfileProcs[fd](NULL, fd, clientData[fd], mask);
+		}
+	}
+}
+
+int main()
+{
+	aeFileEvent *events = new aeFileEvent[NUM_FDS];
+	unsigned char *masks = new unsigned char[NUM_FDS];
+	aeFileProc **rfileProcs = new aeFileProc*[NUM_FDS];
+	aeFileProc **wfileProcs = new aeFileProc*[NUM_FDS];
+	void **clientData = new void*[NUM_FDS];
+	aeFiredEvent *fired = new aeFiredEvent[FIRED_PER_ITER * ITERATIONS];
+	long long start, elapsed;
+	volatile int maxfd;
+
+	/* Every fd is readable, one in eight is writable too, as clients
+	with pending replies. */
+	for (int fd = 0; fd < NUM_FDS; fd++)
+	{
+		int mask = AE_READABLE | (fd % 8 == 0 ? AE_WRITABLE : 0);
+		events[fd].mask = masks[fd] = mask;
+		events[fd].rfileProc = rfileProcs[fd] = handler;
+		events[fd].wfileProc = wfileProcs[fd] = handler;
+		events[fd].clientData = clientData[fd] = &events[fd];
+	}
+	srand(1);
+	for (int j = 0; j < FIRED_PER_ITER * ITERATIONS; j++)
+	{
+		fired[j].fd = rand() % NUM_FDS;
+		fired[j].mask = AE_READABLE | (rand() % 4 == 0 ? AE_WRITABLE : 0);
+	}
+
+	printf("table size: %zu bytes as structures, %zu bytes as arrays "
+		"(%zu bytes of masks)\n", sizeof(aeFileEvent) * NUM_FDS,
+		(sizeof(unsigned char) + 3 * sizeof(void*)) * NUM_FDS,
+		sizeof(unsigned char) * NUM_FDS);
+
+	start = ustime();
+	for (int i = 0; i < ITERATIONS; i++)
+		dispatchAoS(events, fired + i * FIRED_PER_ITER, FIRED_PER_ITER);
+	elapsed = ustime() - start;
+	printf("dispatch, structures: %.1f ns/event\n",
+		elapsed * 1000.0 / (FIRED_PER_ITER * ITERATIONS));
+
+	start = ustime();
+	for (int i = 0; i < ITERATIONS; i++)
+		dispatchSoA(masks, rfileProcs, wfileProcs, clientData,
+			fired + i * FIRED_PER_ITER, FIRED_PER_ITER);
+	elapsed = ustime() - start;
+	printf("dispatch, arrays:     %.1f ns/event\n",
+		elapsed * 1000.0 / (FIRED_PER_ITER * ITERATIONS));
+
+	/* The maxfd update after the highest fd is closed, with every other
+	fd free: a full scan of the table. */
+	for (int fd = 1; fd < NUM_FDS; fd++)
+		events[fd].mask = masks[fd] = AE_NONE;
+
+	start = ustime();
+	for (int i = 0; i < 1000; i++)
+	{
+		int j;
+		for (j = NUM_FDS - 1; j >= 0; j--)
+			if (events[j].mask != AE_NONE)
+				break;
+		maxfd = j;
+	}
+	elapsed = ustime() - start;
+	printf("maxfd scan, structures: %.1f us/scan\n", elapsed / 1000.0);
+
+	start = ustime();
+	for (int i = 0; i < 1000; i++)
+	{
+		int j;
+		for (j = NUM_FDS - 1; j >= 0; j--)
+			if (masks[j] != AE_NONE)
+				break;
+		maxfd = j;
+	}
+	elapsed = ustime() - start;
+	printf("maxfd scan, arrays:     %.1f us/scan (maxfd %d, %lld calls)\n",
+		elapsed / 1000.0, maxfd, calls);
+	return 0;
+}
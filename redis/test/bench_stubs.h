@@ -0,0 +1,154 @@
+/* The parts of the server that the benchmarks and tests of this directory
+build against, so that they all share one copy of them.
+
+zmalloc.h and siphash.c are always stubbed: the allocations are counted
+for zmalloc_used_memory(). With BENCH_SERVER defined, this also includes
+dict.c and the modules built against server.h (evict.cpp, lazyfree.cpp,
+expire.cpp, tinylfu.cpp, timewheel.cpp and bio.c), with a copy of the
+parts of server.h they use. The classes below must keep the fields of the
+ones of server.h that the modules access: change them together.
+
+The bench defines ustime() and decrRefCount(), that depend on how it
+simulates time and on its values. */
+#ifndef __BENCH_STUBS_H
+#define __BENCH_STUBS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+static size_t zmalloc_used;
+
+static inline void *zmalloc(size_t size)
+{
+	size_t *p = (size_t*)malloc(size + 16);
+
+	*p = size;
+	__atomic_add_fetch(&zmalloc_used, size, __ATOMIC_RELAXED);
+	return p + 2;
+}
+
+static inline void *zcalloc(size_t size)
+{
+	return memset(zmalloc(size), 0, size);
+}
+
+static inline void zfree(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	__atomic_sub_fetch(&zmalloc_used, ((size_t*)ptr)[-2], __ATOMIC_RELAXED);
+	free((size_t*)ptr - 2);
+}
+
+static inline size_t zmalloc_used_memory(void)
+{
+	return __atomic_load_n(&zmalloc_used, __ATOMIC_RELAXED);
+}
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k) { return 0; }
+
+#ifdef BENCH_SERVER
+#include "dict.c"
+#include "config.h"
+#include "object.h"
+#include "bio.h"
+#include "timewheel.h"
+
+typedef char *sds;
+
+static sds sdsnewlen(const void *init, size_t len)
+{
+	size_t *sh = (size_t*)zmalloc(sizeof(size_t) + len + 1);
+
+	*sh = len;
+	if (init)
+		memcpy(sh + 1, init, len);
+	else
+		memset(sh + 1, 0, len);
+	((char*)(sh + 1))[len] = '\0';
+	return (sds)(sh + 1);
+}
+
+static size_t sdslen(const sds s) { return ((size_t*)s)[-1]; }
+static void sdssetlen(sds s, size_t len) { ((size_t*)s)[-1] = len; }
+static sds sdsdup(const sds s) { return sdsnewlen(s, sdslen(s)); }
+static void sdsfree(sds s) { zfree((size_t*)s - 1); }
+static size_t sdsAllocSize(sds s) { return sizeof(size_t) + sdslen(s) + 1; }
+
+class expireEntry
+{
+public:
+	twTimer timer;  /* Must be the first member, see activeExpireCycle(). */
+	long long when;
+	sds key;
+};
+
+class redisDb
+{
+public:
+	dict *dictionary;
+	dict *expires;
+	twWheel *expires_index;
+};
+
+class redisServer
+{
+public:
+	Bio bio;
+	int hz;
+	unsigned int lruclock;
+	time_t unixtime;
+	redisDb *db;
+	int dbnum;
+	unsigned long long maxmemory;
+	int maxmemory_policy;
+	int maxmemory_samples;
+	int lfu_log_factor;
+	int lfu_decay_time;
+	size_t tinylfu_sketch_bytes;
+	int lazyfree_lazy_eviction;
+	int lazyfree_lazy_expire;
+	int active_expire_max_cpu;
+	long long stat_evictedkeys;
+	long long stat_lazyfree_evictions;
+	long long stat_admission_rejected;
+	long long stat_expiredkeys;
+	long long stat_expired_time_cap_reached_count;
+	long long stat_expire_cycle_time_used;
+	long long stat_expire_cycle_budget_us;
+};
+
+redisServer server;
+
+#define serverLog(level, ...) fprintf(stderr, __VA_ARGS__)
+#define serverPanic(msg) abort()
+
+static long long realtime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+long long ustime(void);
+void decrRefCount(robj *o);
+unsigned long LFUDecrAndReturn(robj *o);
+size_t lazyfreeGetPendingBytes(void);
+size_t dbAsyncDelete(redisDb *db, sds key, int *deleted);
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t bytes);
+int removeExpire(redisDb *db, sds key);
+unsigned int tinylfuEstimate(sds key);
+
+#define __REDIS_H
+#include "evict.cpp"
+#include "lazyfree.cpp"
+#include "expire.cpp"
+#include "tinylfu.cpp"
+#include "timewheel.cpp"
+#include "bio.c"
+#endif
+
+#endif
@@ -0,0 +1,376 @@
+/* Cost of queueing jobs to the background threads of bio.c: the pool of
+workers with 1 worker ('ring') and with 4 ('pool'), and the lists guarded
+by a mutex and two condition variables with a thread per type that the
+lock free rings replaced ('locked').
+
+'burst' queues N lazy free jobs from the main thread as fast as it can
+while the workers process them: the queue fills and the producer waits
+for room. 'paced' queues a job every 200 us, sleeping in between as the
+main thread does in the event loop: the workers sleep too, so that every
+job pays a wakeup. 'producers' queues N jobs from
+1, 2 and 4 threads at once. The jobs do nothing.
+
+'blocked' queues a job blocking for 100 ms, as an fsync or the close() of
+a big file would, followed by 10000 short jobs of the same type. Reported
+is the time the short jobs wait. 'fsync' queues N AOF fsync jobs from 4
+threads on the pool, and checks that they are processed one at a time and
+in the order each producer queued them.
+
+'completions' queues N jobs with a completion callback on the pool, the
+main thread waiting the completion fd with poll() as the event loop does,
+and reports the wakeups of the main thread and the time from the creation
+of a job to its callback. The jobs are queued 1000 at a time, the
+completions delivered in between. 'paced completions' queues a job every
+200 us.
+
+Reported: the ns a createBackgroundJob() call takes in the producer, and
+the jobs processed per second.
+
+g++ -O2 -pthread -I../src bio_bench.cpp -o bio_bench
+./bio_bench 1000000 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <list>
+
+/* bio.c is built against server.h, that needs the whole server. These
+are the parts of it that it uses. */
+#include "bench_stubs.h"
+#include "config.h"
+#include "object.h"
+#include "dict.h"
+#include "bio.h"
+
+#define LL_WARNING 3
+#define serverLog(level, ...) fprintf(stderr, __VA_ARGS__)
+#define serverPanic(msg) abort()
+
+/* The jobs carry their producer and their rank in arg1. A lazy free job
+sleeps for the microseconds in arg2. */
+#define MAX_PRODUCERS 8
+#define JOB(producer, rank) ((void*)(((uintptr_t)(producer) << 40) | ((rank) + 1)))
+
+static unsigned long last_rank[MAX_PRODUCERS];
+static int fsyncing;
+
+void lazyfreeFreeObjectFromBioThread(robj *o, size_t bytes)
+{
+	if (bytes)
+		usleep(bytes);
+}
+
+static int benchFsync(long fd)
+{
+	unsigned long producer = fd >> 40, rank = fd & ((1ULL << 40) - 1);
+
+	if (__atomic_add_fetch(&fsyncing, 1, __ATOMIC_RELAXED) != 1)
+	{
+		fprintf(stderr, "two fsync jobs at once\n");
+		abort();
+	}
+	if (rank <= last_rank[producer])
+	{
+		fprintf(stderr, "producer %lu: fsync %lu after %lu\n", producer, rank,
+			last_rank[producer]);
+		abort();
+	}
+	last_rank[producer] = rank;
+	__atomic_sub_fetch(&fsyncing, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+#undef redis_fsync
+#define redis_fsync benchFsync
+
+#define __REDIS_H
+#include "bio.c"
+
+/* The queue of bio.c before the rings, for the BIO_LAZY_FREE type only. */
+class lockedBio
+{
+public:
+	pthread_mutex_t mutex;
+	pthread_cond_t newjob_cond;
+	pthread_cond_t step_cond;
+	std::list<bio_job*> jobs;
+	unsigned long long pending;
+
+	static void *processBackgroundJobs(void *arg)
+	{
+		lockedBio *bio = (lockedBio*)arg;
+		bio_job *job;
+
+		pthread_mutex_lock(&bio->mutex);
+		while (1)
+		{
+			if (bio->jobs.empty())
+			{
+				pthread_cond_wait(&bio->newjob_cond, &bio->mutex);
+				continue;
+			}
+			job = bio->jobs.front();
+			pthread_mutex_unlock(&bio->mutex);
+			lazyfreeFreeObjectFromBioThread((robj*)job->arg1, (size_t)job->arg2);
+			delete job;
+			pthread_mutex_lock(&bio->mutex);
+			bio->jobs.pop_front();
+			bio->pending--;
+			pthread_cond_broadcast(&bio->step_cond);
+		}
+	}
+
+	void init()
+	{
+		pthread_t thread;
+
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&newjob_cond, NULL);
+		pthread_cond_init(&step_cond, NULL);
+		pending = 0;
+		pthread_create(&thread, NULL, processBackgroundJobs, this);
+	}
+
+	void createBackgroundJob(int type, void *arg1, void *arg2, void *arg3)
+	{
+		bio_job *job = new bio_job;
+
+		job->time = time(NULL);
+		job->arg1 = arg1;
+		job->arg2 = arg2;
+		job->arg3 = arg3;
+		pthread_mutex_lock(&mutex);
+		jobs.push_back(job);
+		pending++;
+		pthread_cond_signal(&newjob_cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	unsigned long long waitStepOfType(int type)
+	{
+		unsigned long long val;
+
+		pthread_mutex_lock(&mutex);
+		val = pending;
+		if (val != 0)
+		{
+			pthread_cond_wait(&step_cond, &mutex);
+			val = pending;
+		}
+		pthread_mutex_unlock(&mutex);
+		return val;
+	}
+};
+
+static lockedBio locked;
+static Bio ring, pool;
+
+static long long nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+template <class B> static void drain(B *bio, int type)
+{
+	while (bio->waitStepOfType(type))
+		;
+	memset(last_rank, 0, sizeof(last_rank));
+}
+
+template <class B> static void burst(const char *name, B *bio, unsigned long n)
+{
+	long long start = nstime(), queued;
+
+	for (unsigned long j = 0; j < n; j++)
+		bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, j), NULL, NULL);
+	queued = nstime();
+	drain(bio, BIO_LAZY_FREE);
+	printf("burst     %-8s %7.1f ns/job queued %9.0f jobs/s\n", name,
+		(double)(queued - start) / n, n * 1e9 / (nstime() - start));
+}
+
+template <class B> static void paced(const char *name, B *bio, unsigned long n)
+{
+	long long total = 0, max = 0;
+
+	for (unsigned long j = 0; j < n; j++)
+	{
+		long long start = nstime(), elapsed;
+
+		bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, j), NULL, NULL);
+		elapsed = nstime() - start;
+		total += elapsed;
+		if (elapsed > max)
+			max = elapsed;
+		usleep(200);
+	}
+	printf("paced     %-8s %7.1f ns/job queued %9.1f us max\n", name,
+		(double)total / n, max / 1000.0);
+	drain(bio, BIO_LAZY_FREE);
+}
+
+template <class B> class producerArg
+{
+public:
+	B *bio;
+	int id;
+	int type;
+	unsigned long n;
+	long long elapsed;
+};
+
+template <class B> static void *producerMain(void *arg)
+{
+	producerArg<B> *p = (producerArg<B>*)arg;
+	long long start = nstime();
+
+	for (unsigned long j = 0; j < p->n; j++)
+		p->bio->createBackgroundJob(p->type, JOB(p->id, j), NULL, NULL);
+	p->elapsed = nstime() - start;
+	return NULL;
+}
+
+template <class B> static void producers(const char *name, B *bio, int type,
+	unsigned long n, int count)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	producerArg<B> args[MAX_PRODUCERS];
+	long long start = nstime(), elapsed = 0;
+
+	for (int j = 0; j < count; j++)
+	{
+		args[j].bio = bio;
+		args[j].id = j;
+		args[j].type = type;
+		args[j].n = n / count;
+		pthread_create(&threads[j], NULL, producerMain<B>, &args[j]);
+	}
+	for (int j = 0; j < count; j++)
+	{
+		pthread_join(threads[j], NULL);
+		elapsed += args[j].elapsed;
+	}
+	drain(bio, type);
+	printf("%-9s %-8s %d: %7.1f ns/job queued %9.0f jobs/s\n",
+		type == BIO_AOF_FSYNC ? "fsync" : "producers", name, count,
+		(double)elapsed / (n / count * count), n * 1e9 / (nstime() - start));
+}
+
+template <class B> static void blocked(const char *name, B *bio)
+{
+	long long start;
+
+	bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, 0), (void*)100000, NULL);
+	usleep(1000);
+	start = nstime();
+	for (unsigned long j = 0; j < 10000; j++)
+		bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, j + 1), NULL, NULL);
+	while (bio->waitStepOfType(BIO_LAZY_FREE) > 1)
+		;
+	printf("blocked   %-8s %7.1f ms for the short jobs\n", name,
+		(nstime() - start) / 1e6);
+	drain(bio, BIO_LAZY_FREE);
+}
+
+/* Completions: the callback gets the creation time of its job. */
+static unsigned long completed;
+static long long completion_latency, completion_max_latency;
+
+static void benchCompletion(void *privdata)
+{
+	long long latency = nstime() - (long long)(intptr_t)privdata;
+
+	completed++;
+	completion_latency += latency;
+	if (latency > completion_max_latency)
+		completion_max_latency = latency;
+}
+
+/* Deliver the completions as the event loop would, waiting up to
+'timeout' ms for the completion fd. Returns 1 if it was readable. */
+static int deliverCompletions(Bio *bio, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = bio->completionFd();
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) != 1)
+		return 0;
+	bioCompletionHandler(NULL, pfd.fd, bio, 0);
+	return 1;
+}
+
+/* Queue the jobs 1000 at a time, and deliver the completions between two
+batches, as the event loop between two rounds of commands. */
+static void completions(const char *name, Bio *bio, unsigned long n)
+{
+	long long start = nstime();
+	unsigned long wakeups = 0;
+
+	completed = completion_latency = completion_max_latency = 0;
+	for (unsigned long j = 0; j < n; j++)
+	{
+		bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, j), NULL, NULL,
+			benchCompletion, (void*)(intptr_t)nstime());
+		if (j % 1000 == 999)
+			wakeups += deliverCompletions(bio, 0);
+	}
+	while (completed < n)
+		wakeups += deliverCompletions(bio, 1000);
+	printf("completions %-6s %9.0f jobs/s %6lu wakeups %6.1f per wakeup %8.1f us avg latency\n",
+		name, n * 1e9 / (nstime() - start), wakeups, (double)n / wakeups,
+		completion_latency / 1e3 / n);
+	drain(bio, BIO_LAZY_FREE);
+}
+
+static void pacedCompletions(const char *name, Bio *bio, unsigned long n)
+{
+	completed = completion_latency = completion_max_latency = 0;
+	for (unsigned long j = 0; j < n; j++)
+	{
+		bio->createBackgroundJob(BIO_LAZY_FREE, JOB(0, j), NULL, NULL,
+			benchCompletion, (void*)(intptr_t)nstime());
+		while (completed < j + 1)
+			deliverCompletions(bio, 1000);
+		usleep(200);
+	}
+	printf("paced completions %-6s %7.1f us avg latency %7.1f us max\n", name,
+		completion_latency / 1e3 / n, completion_max_latency / 1e3);
+	drain(bio, BIO_LAZY_FREE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+	locked.init();
+	ring.init(1);
+	pool.init(4);
+
+	burst("locked", &locked, n);
+	burst("ring", &ring, n);
+	burst("pool", &pool, n);
+	paced("locked", &locked, 5000);
+	paced("ring", &ring, 5000);
+	paced("pool", &pool, 5000);
+	for (int count = 1; count <= 4; count *= 2)
+	{
+		producers("locked", &locked, BIO_LAZY_FREE, n, count);
+		producers("ring", &ring, BIO_LAZY_FREE, n, count);
+		producers("pool", &pool, BIO_LAZY_FREE, n, count);
+	}
+	blocked("locked", &locked);
+	blocked("ring", &ring);
+	blocked("pool", &pool);
+	producers("pool", &pool, BIO_AOF_FSYNC, n, 4);
+	completions("pool", &pool, n);
+	pacedCompletions("pool", &pool, 5000);
+	return 0;
+}
@@ -0,0 +1,320 @@
+/* Benchmark of the dict tables: chained dictht against the open addressing
+dictSwiss table, for insert, lookup (hits and misses) and delete. The
+chained table is also run with key only entries ('keyonly'), and the
+memory of string keys is compared with and without embedded keys.
+'batch' is the hit lookup again with dictFindBatch(), BATCH keys at a time
+as a pipelined MGET would look them up. 'scan' walks the dict with
+dictScanBatch() while keys are added between the calls, so that the
+tables grow and rehash under the cursor, and checks that every key was
+returned. 'scandel' deletes every entry from the callbacks of
+dictScanBatch(), which must not rehash nor resize the tables under the
+batch (build with -fsanitize=address to check it). 'purge' deletes 99% of the keys, then adds and deletes keys
+around the size reached, and reports the shrinks and the bytes reclaimed.
+
+Keys are integers stored in the key pointer, hashed with a 64 bit mixer
+and compared by value, so that the numbers are about the tables and not
+about the keys. The key counts are the arguments, 1M and 10M by default;
+100M keys take about 10GB for the two tables.
+
+g++ -O2 -msse2 -I../src dict_bench.cpp -o dict_bench
+./dict_bench 1000000 10000000 100000000 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "bench_stubs.h"
+#include "dict.c"
+
+static uint64_t intHash(const void *key)
+{
+	uint64_t x = (uint64_t)key;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static dictType chainedType = {intHash, NULL, NULL, NULL, NULL, NULL, 0};
+static dictType swissType = {intHash, NULL, NULL, NULL, NULL, NULL, 1};
+static dictType keyOnlyType = {intHash, NULL, NULL, NULL, NULL, NULL, 0, 1, 1};
+
+/* String keys, NUL terminated. */
+static uint64_t strHash(const void *key)
+{
+	uint64_t h = 1469598103934665603ULL;
+	for (const char *p = (const char*)key; *p; p++)
+		h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	return intHash((void*)h);
+}
+
+static int strCompare(void *privdata, const void *key1, const void *key2)
+{
+	return strcmp((const char*)key1, (const char*)key2) == 0;
+}
+
+static void *strDup(void *privdata, const void *key)
+{
+	return strdup((const char*)key);
+}
+
+static void strDestructor(void *privdata, void *key)
+{
+	free(key);
+}
+
+static size_t strEmbed(unsigned char *buf, const void *key, unsigned char *keyoff)
+{
+	size_t len = strlen((const char*)key) + 1;
+
+	*keyoff = 0;
+	if (buf)
+		memcpy(buf, key, len);
+	return len;
+}
+
+static dictType strType = {strHash, strDup, NULL, strCompare, strDestructor, NULL, 0};
+static dictType strEmbeddedType = {strHash, NULL, NULL, strCompare, NULL, NULL, 0, 0, 0, strEmbed};
+
+static long long ustime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+#define KEY(j) ((void*)(uintptr_t)((j) * 2 + 1)) /* Never NULL. */
+#define MISSING_KEY(j) ((void*)(uintptr_t)((j) * 2 + 2))
+#define BATCH 256
+
+static void bench(const char *name, dictType &type, long count, uint64_t *order)
+{
+	dict *d = dictCreate(type, NULL);
+	long long start, found = 0;
+	dictAllocStats stats;
+
+	start = ustime();
+	for (long j = 0; j < count; j++)
+		dictAdd(d, KEY(j), NULL);
+	printf("%-8s %10ld keys  insert %6.1f ns", name, count,
+		(ustime() - start) * 1000.0 / count);
+	dictGetAllocStats(&stats);
+	if (!d->swiss)
+		printf("  [%.1f bytes/key, slabs: %lld bytes saved, %llu allocator calls avoided]",
+			(double)(stats.slab_bytes + dictSlots(d) * sizeof(dictEntry*)) / count,
+			stats.bytes_saved, stats.calls_avoided);
+
+	/* Random order: the working set does not fit the caches. */
+	start = ustime();
+	for (long j = 0; j < count; j++)
+		found += dictFind(d, KEY(order[j])) != NULL;
+	printf("  hit %6.1f ns", (ustime() - start) * 1000.0 / count);
+
+	start = ustime();
+	for (long j = 0; j < count; j += BATCH)
+	{
+		const void *keys[BATCH];
+		dictEntry *entries[BATCH];
+		long n = count - j < BATCH ? count - j : BATCH;
+
+		for (long i = 0; i < n; i++)
+			keys[i] = KEY(order[j + i]);
+		found += dictFindBatch(d, keys, n, entries);
+	}
+	printf("  batch %6.1f ns", (ustime() - start) * 1000.0 / count);
+
+	start = ustime();
+	for (long j = 0; j < count; j++)
+		found += dictFind(d, MISSING_KEY(order[j])) != NULL;
+	printf("  miss %6.1f ns", (ustime() - start) * 1000.0 / count);
+
+	start = ustime();
+	for (long j = 0; j < count; j++)
+		dictDelete(d, KEY(order[j]));
+	printf("  delete %6.1f ns  (%lld found, %lu left)\n",
+		(ustime() - start) * 1000.0 / count, found, dictSize(d));
+	dictRelease(d);
+}
+
+typedef struct scanCheck
+{
+	unsigned char *seen;
+	long count, visits;
+} scanCheck;
+
+static void scanCallback(void *privdata, dictEntry **entries, unsigned long count)
+{
+	scanCheck *check = (scanCheck*)privdata;
+
+	for (unsigned long j = 0; j < count; j++)
+	{
+		long k = ((uintptr_t)dictGetKey(entries[j]) - 1) / 2;
+		if (k < check->count)
+			check->seen[k] = 1;
+	}
+	check->visits += count;
+}
+
+static void benchScan(const char *name, dictType &type, long count)
+{
+	dict *d = dictCreate(type, NULL);
+	scanCheck check = {(unsigned char*)calloc(count, 1), count, 0};
+	long long start, elapsed = 0, missed = 0, added = count;
+	unsigned long cursor = 0;
+
+	for (long j = 0; j < count; j++)
+		dictAdd(d, KEY(j), NULL);
+	do
+	{
+		start = ustime();
+		cursor = dictScanBatch(d, cursor, 1000, scanCallback, &check);
+		elapsed += ustime() - start;
+		for (int j = 0; j < 100; j++, added++)
+			dictAdd(d, KEY(added), NULL);
+	} while (cursor);
+	for (long j = 0; j < count; j++)
+		missed += !check.seen[j];
+	printf("%-8s %10ld keys  scan %6.1f ns/entry  (%lld added meanwhile, %lld missed)\n",
+		name, count, elapsed * 1000.0 / check.visits, added - count, missed);
+	free(check.seen);
+	dictRelease(d);
+}
+
+/* A scan whose callback deletes the entries it gets. */
+typedef struct scanDelete
+{
+	dict *d;
+	long deleted;
+} scanDelete;
+
+static void scanDeleteCallback(void *privdata, dictEntry **entries, unsigned long count)
+{
+	scanDelete *sd = (scanDelete*)privdata;
+
+	for (unsigned long j = 0; j < count; j++)
+		sd->deleted += dictDelete(sd->d, dictGetKey(entries[j])) == DICT_OK;
+}
+
+static void benchScanDelete(const char *name, dictType &type, long count)
+{
+	scanDelete sd = {dictCreate(type, NULL), 0};
+	long long start;
+	unsigned long cursor = 0;
+
+	for (long j = 0; j < count; j++)
+		dictAdd(sd.d, KEY(j), NULL);
+	start = ustime();
+	do
+		cursor = dictScanBatch(sd.d, cursor, 1000, scanDeleteCallback, &sd);
+	while (cursor);
+	/* An open addressing table shrinks between the calls: the keys that
+	moved to slots already scanned may be left. */
+	printf("%-8s %10ld keys  scandel %6.1f ns/entry  (%ld deleted, %lu left)\n",
+		name, count, (ustime() - start) * 1000.0 / count, sd.deleted, dictSize(sd.d));
+	dictRelease(sd.d);
+}
+
+static void benchPurge(const char *name, dictType &type, long count)
+{
+	dict *d = dictCreate(type, NULL);
+	dictAllocStats before, purged, after;
+	unsigned long slots;
+	long long start;
+	long left = count / 100;
+
+	for (long j = 0; j < count; j++)
+		dictAdd(d, KEY(j), NULL);
+	slots = dictSlots(d);
+	dictGetAllocStats(&before);
+	start = ustime();
+	for (long j = left; j < count; j++)
+		dictDelete(d, KEY(j));
+	/* What the server cron does for a dict that is no longer written. */
+	while (dictIsRehashing(d) || dictShrinkIfNeeded(d) == DICT_OK)
+		dictRehashMicroseconds(d, 1000);
+	dictGetAllocStats(&purged);
+	printf("%-8s %10ld keys  purge %6.1f ns  slots %lu -> %lu (%llu shrinks, %llu bytes reclaimed)",
+		name, count, (ustime() - start) * 1000.0 / (count - left), slots, dictSlots(d),
+		purged.shrinks - before.shrinks, purged.reclaimed_bytes - before.reclaimed_bytes);
+
+	/* Hysteresis: going back and forth around the size must not resize. */
+	for (long j = 0; j < 100000; j++)
+	{
+		dictAdd(d, KEY(count + j % 1000), NULL);
+		if (j % 1000 == 999)
+			for (long k = 0; k < 1000; k++)
+				dictDelete(d, KEY(count + k));
+	}
+	dictGetAllocStats(&after);
+	printf("  churn: %llu shrinks\n", after.shrinks - purged.shrinks);
+	dictRelease(d);
+}
+
+/* Memory per key of 'count' string keys of 'len' bytes, keys included:
+a strdup() costs a malloc() chunk, an embedded key the slab class. */
+static void benchStrings(const char *name, dictType &type, long count, int len)
+{
+	dict *d = dictCreate(type, NULL);
+	dictAllocStats stats;
+	char key[64];
+	long long start = ustime(), bytes;
+
+	for (long j = 0; j < count; j++)
+	{
+		snprintf(key, sizeof(key), "%0*ld", len, j);
+		dictAdd(d, key, NULL);
+	}
+	printf("%-8s %10ld keys  insert %6.1f ns", name, count,
+		(ustime() - start) * 1000.0 / count);
+	dictGetAllocStats(&stats);
+	bytes = stats.slab_bytes + dictSlots(d) * sizeof(dictEntry*);
+	if (!type.embedKey)
+		bytes += count * _dictMallocFootprint(len + 1);
+	printf("  %.1f bytes/key (%d bytes keys)\n", (double)bytes / count, len);
+	dictRelease(d);
+}
+
+int main(int argc, char **argv)
+{
+	long counts[16] = {1000000, 10000000};
+	int ncounts = 2;
+
+	if (argc > 1)
+	{
+		ncounts = argc - 1 > 16 ? 16 : argc - 1;
+		for (int j = 0; j < ncounts; j++)
+			counts[j] = atol(argv[j + 1]);
+	}
+	for (int i = 0; i < ncounts; i++)
+	{
+		long count = counts[i];
+		uint64_t *order = (uint64_t*)malloc(sizeof(uint64_t) * count);
+
+		srand(1);
+		for (long j = 0; j < count; j++)
+			order[j] = j;
+		for (long j = count - 1; j > 0; j--)
+		{
+			long k = ((long)rand() * RAND_MAX + rand()) % (j + 1);
+			uint64_t tmp = order[j];
+			order[j] = order[k];
+			order[k] = tmp;
+		}
+		bench("chained", chainedType, count, order);
+		bench("keyonly", keyOnlyType, count, order);
+		bench("swiss", swissType, count, order);
+		benchScan("chained", chainedType, count);
+		benchScan("keyonly", keyOnlyType, count);
+		benchScanDelete("chained", chainedType, count);
+		benchScanDelete("swiss", swissType, count);
+		benchPurge("chained", chainedType, count);
+		benchPurge("swiss", swissType, count);
+		benchStrings("strdup", strType, count, 16);
+		benchStrings("embedded", strEmbeddedType, count, 16);
+		free(order);
+	}
+	return 0;
+}
@@ -0,0 +1,170 @@
+/* Benchmark of the concurrent dicts: reader threads look up random keys
+while one writer keeps inserting (so expanding and rehashing), replacing
+values and deleting keys. The same readers are also run on a regular dict
+behind a mutex, the global lock that the concurrent dicts avoid.
+
+The readers check every lookup: a key that was inserted and never
+deleted must be found, with a value that is still allocated and belongs
+to it. Build it with -fsanitize=address to catch an early free.
+
+g++ -O2 -pthread -I../src dict_concurrent_bench.cpp -o dict_concurrent_bench
+./dict_concurrent_bench 1000000 1 2 4 8 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "bench_stubs.h"
+#include "dict.c"
+
+#define KEY(j) ((void*)(uintptr_t)((j) * 2 + 1)) /* Never NULL. */
+#define DURATION_US 1000000
+
+static uint64_t intHash(const void *key)
+{
+	return dictGenIntHashFunction((uint64_t)key);
+}
+
+/* Values are allocated and hold their key, so a reader can check that
+it did not get the value of another key, nor a freed one. */
+static void valDestructor(void *privdata, void *val)
+{
+	free(val);
+}
+
+static dictType concurrentType = {intHash, NULL, NULL, NULL, NULL, valDestructor,
+	0, 0, 0, NULL, 1};
+static dictType lockedType = {intHash, NULL, NULL, NULL, NULL, valDestructor, 0};
+
+static dict *d;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int locked;               /* Readers and writer take 'lock'. */
+static long stable;              /* Keys [0, stable) are never deleted. */
+static long published;           /* Stable keys inserted so far. */
+static int stop;
+
+static long long ustime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void *newVal(long j)
+{
+	long *val = (long*)malloc(sizeof(long));
+	*val = j;
+	return val;
+}
+
+static void *reader(void *arg)
+{
+	long lookups = 0;
+	unsigned seed = (unsigned)(uintptr_t)arg;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+	{
+		long max = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+
+		if (max == 0)
+			continue;
+		if (locked)
+			pthread_mutex_lock(&lock);
+		else
+			dictEpochEnter();
+		for (int i = 0; i < 64; i++)
+		{
+			long j = rand_r(&seed) % max;
+			dictEntry *de = dictFind(d, KEY(j));
+
+			if (de == NULL || *(long*)dictGetVal(de) != j)
+			{
+				fprintf(stderr, "key %ld: %s\n", j, de ? "wrong value" : "not found");
+				abort();
+			}
+		}
+		lookups += 64;
+		if (locked)
+			pthread_mutex_unlock(&lock);
+		else
+			dictEpochExit();
+	}
+	return (void*)lookups;
+}
+
+/* Insert the stable keys, then churn: replace stable values, insert and
+delete other keys, until the readers are stopped. */
+static void writer(void)
+{
+	long long start = ustime();
+	long volatileKey = stable;
+	unsigned seed = 1;
+
+	for (long j = 0; j < stable; j++)
+	{
+		if (locked)
+			pthread_mutex_lock(&lock);
+		dictAdd(d, KEY(j), newVal(j));
+		if (locked)
+			pthread_mutex_unlock(&lock);
+		__atomic_store_n(&published, j + 1, __ATOMIC_RELEASE);
+	}
+	while (ustime() - start < DURATION_US)
+	{
+		long j = rand_r(&seed) % stable;
+
+		if (locked)
+			pthread_mutex_lock(&lock);
+		dictReplace(d, KEY(j), newVal(j));
+		dictAdd(d, KEY(volatileKey), newVal(volatileKey));
+		if (volatileKey - stable >= 1000)
+			dictDelete(d, KEY(volatileKey - 1000));
+		volatileKey++;
+		if (locked)
+			pthread_mutex_unlock(&lock);
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+}
+
+static void bench(const char *name, dictType &type, int nreaders)
+{
+	pthread_t threads[64];
+	long long start = ustime(), lookups = 0;
+
+	d = dictCreate(type, NULL);
+	locked = !type.concurrent;
+	published = 0;
+	stop = 0;
+	for (int j = 0; j < nreaders; j++)
+		pthread_create(&threads[j], NULL, reader, (void*)(uintptr_t)(j + 1));
+	writer();
+	for (int j = 0; j < nreaders; j++)
+	{
+		void *count;
+		pthread_join(threads[j], &count);
+		lookups += (long)count;
+	}
+	printf("%-10s %2d readers  %8.2f M lookups/s\n", name, nreaders,
+		lookups / (double)(ustime() - start));
+	dictRelease(d);
+}
+
+int main(int argc, char **argv)
+{
+	int readers[16] = {1, 2, 4, 8}, nreaders = 4;
+
+	stable = argc > 1 ? atol(argv[1]) : 1000000;
+	if (argc > 2)
+	{
+		nreaders = argc - 2 > 16 ? 16 : argc - 2;
+		for (int j = 0; j < nreaders; j++)
+			readers[j] = atoi(argv[j + 2]) > 64 ? 64 : atoi(argv[j + 2]);
+	}
+	for (int j = 0; j < nreaders; j++)
+	{
+		bench("mutex", lockedType, readers[j]);
+		bench("concurrent", concurrentType, readers[j]);
+	}
+	return 0;
+}
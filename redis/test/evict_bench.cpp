@@ -0,0 +1,383 @@
+/* Hit rate of the eviction policies on a cache workload skewed on hot keys:
+the accesses follow a Zipf distribution over 1M keys, and a part of them
+('scan') reads keys that are never read again, as a batch job walking the
+dataset would. A miss adds the key, and keys are evicted with
+evictionPoolBestKey() as long as the cache holds more than 'capacity' keys.
+With lru-tinylfu the new key is first checked by evictionAdmitKey(), that
+may delete it instead, with the default sketch and with a 16KB one.
+
+'storm' is a write storm on a full cache, every write evicting keys until
+the memory used is back under maxmemory. It reports the cost of eviction
+per key and per KB freed. 'bigvalues' evicts hashes of 1M fields with
+freeMemoryIfNeeded(), freeing them in place or in the lazy free thread.
+
+Time is simulated, every access takes 10 us, so that the LRU clock and the
+LFU decay run as on a server doing 100k accesses per second. The time of
+the evictions alone is measured with the real clock.
+
+g++ -O2 -pthread -I../src evict_bench.cpp -o evict_bench
+./evict_bench 50000 [storm|bigvalues] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+using namespace std;
+
+#define BENCH_SERVER
+#include "bench_stubs.h"
+
+static long long now_us; /* Simulated time. */
+
+long long ustime(void) { return now_us; }
+
+/* Values are strings with a payload, or hashes of sds fields and values. */
+void decrRefCount(robj *o)
+{
+	if (o->encoding == OBJ_ENCODING_HT)
+		dictRelease((dict*)o->ptr);
+	else
+		zfree(o->ptr);
+	zfree(o);
+}
+
+#define NUM_KEYS 1000000
+#define ACCESSES 5000000
+#define ACCESS_US 10
+
+static uint64_t keyHash(const void *key)
+{
+	return dictGenFastHashFunction(key, sdslen((sds)key));
+}
+
+static int keyCompare(void *privdata, const void *key1, const void *key2)
+{
+	return sdslen((sds)key1) == sdslen((sds)key2) &&
+		memcmp(key1, key2, sdslen((sds)key1)) == 0;
+}
+
+static size_t used_memory; /* Of the keys and values, for the storm. */
+
+static void keyDestructor(void *privdata, void *key)
+{
+	used_memory -= sdslen((sds)key);
+	sdsfree((sds)key);
+}
+
+/* The values of the storm have a payload, that starts with its size. The
+values detached by dbAsyncDelete() are NULL. */
+static void valDestructor(void *privdata, void *val)
+{
+	robj *o = (robj*)val;
+
+	if (o == NULL)
+		return;
+	if (o->ptr && o->encoding != OBJ_ENCODING_HT)
+		used_memory -= *(size_t*)o->ptr;
+	decrRefCount(o);
+}
+
+static void sdsDestructor(void *privdata, void *val)
+{
+	if (val)
+		sdsfree((sds)val);
+}
+
+static dictType keyspaceType = {keyHash, NULL, NULL, keyCompare, keyDestructor, valDestructor, 0};
+static dictType expiresType = {keyHash, NULL, NULL, keyCompare, NULL, NULL, 0};
+static dictType hashType = {keyHash, NULL, NULL, keyCompare, sdsDestructor, sdsDestructor, 0};
+
+static double *zipf;     /* Cumulative distribution of the key ranks. */
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static long zipfKey(void)
+{
+	double u = (xorshift() >> 11) * (1.0 / 9007199254740992.0);
+	long lo = 0, hi = NUM_KEYS - 1;
+
+	while (lo < hi)
+	{
+		long mid = (lo + hi) / 2;
+
+		if (zipf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void run(const char *name, int policy, int log_factor,
+	unsigned long capacity, int scan_percent)
+{
+	redisDb db;
+	long long hits = 0, start = ustime(), evictions = 0, evict_us = 0;
+	long scanned = NUM_KEYS;
+
+	db.dictionary = dictCreate(keyspaceType, NULL);
+	db.expires = dictCreate(expiresType, NULL);
+	server.db = &db;
+	server.maxmemory_policy = policy;
+	server.lfu_log_factor = log_factor;
+	server.lazyfree_lazy_eviction = 0;
+	if (policy & MAXMEMORY_FLAG_ADMISSION)
+		tinylfuResize(server.tinylfu_sketch_bytes);
+	rng = 88172645463325252ULL;
+	srand(1);
+	evictionPoolAlloc();
+	for (long j = 0; j < ACCESSES; j++)
+	{
+		char buf[32];
+		long id = (long)(xorshift() % 100) < scan_percent ? scanned++ : zipfKey();
+		int len = snprintf(buf, sizeof(buf), "key:%ld", id);
+		sds key = sdsnewlen(buf, len);
+		dictEntry *de;
+
+		tinylfuRecordAccess(key);
+		de = dictFind(db.dictionary, key);
+		now_us += ACCESS_US;
+		server.lruclock = getLRUClock();
+		server.unixtime = now_us / 1000000;
+		if (de)
+		{
+			hits++;
+			objectTouch((robj*)dictGetVal(de));
+			sdsfree(key);
+			continue;
+		}
+
+		robj *o = (robj*)zcalloc(sizeof(robj));
+		objectInitLRUOrLFU(o);
+		dictAdd(db.dictionary, key, o);
+		if (dictSize(db.dictionary) <= capacity)
+			continue;
+
+		/* The cache is full: with a maxmemory of 1 byte getMaxmemoryState()
+		says so to evictionAdmitKey(). */
+		long long t = realtime();
+		server.maxmemory = 1;
+		if (evictionAdmitKey(&db, key))
+		{
+			while (dictSize(db.dictionary) > capacity)
+			{
+				int dbid;
+
+				de = evictionPoolBestKey(&dbid);
+				dictDelete(db.dictionary, dictGetKey(de));
+			}
+		}
+		server.maxmemory = 0;
+		evictions++;
+		evict_us += realtime() - t;
+	}
+	printf("%-16s scan %2d%%  hit rate %5.2f%%  %6.0f ns/eviction\n", name,
+		scan_percent, hits * 100.0 / ACCESSES,
+		evict_us * 1000.0 / (evictions ? evictions : 1));
+	dictRelease(db.expires);
+	dictRelease(db.dictionary);
+	now_us = start + 3600LL * 1000000; /* Cold start for the next run. */
+}
+
+/* A write storm on a full cache: 'count' new keys are written, and each
+write evicts keys until the memory used is back under maxmemory. Keys are
+16 to 64 bytes, one in ten from 256 to 512 bytes, values 16 bytes to 4KB. */
+static void storm(const char *name, int policy, unsigned long keys, unsigned long count)
+{
+	redisDb db;
+	size_t maxmemory = 0, freed = 0;
+	long long evict_us = 0, evictions = 0;
+
+	db.dictionary = dictCreate(keyspaceType, NULL);
+	db.expires = NULL;
+	server.db = &db;
+	server.maxmemory_policy = policy;
+	server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
+	rng = 88172645463325252ULL;
+	evictionPoolAlloc();
+	for (unsigned long j = 0; j < keys + count; j++)
+	{
+		char buf[600];
+		size_t klen = xorshift() % 10 ? 16 + xorshift() % 49 : 256 + xorshift() % 257;
+		size_t vlen = 16 + xorshift() % 4081;
+		robj *o = (robj*)zcalloc(sizeof(robj));
+
+		memset(buf, 'k', klen);
+		snprintf(buf, sizeof(buf), "%lu:", j);
+		buf[strlen(buf)] = 'k';
+		o->ptr = zmalloc(vlen);
+		*(size_t*)o->ptr = vlen;
+		objectInitLRUOrLFU(o);
+		dictAdd(db.dictionary, sdsnewlen(buf, klen), o);
+		used_memory += klen + vlen;
+		now_us += ACCESS_US;
+		server.lruclock = getLRUClock();
+		server.unixtime = now_us / 1000000;
+		if (j == keys - 1)
+			maxmemory = used_memory;
+		if (j < keys)
+			continue;
+
+		long long t = realtime();
+		size_t before = used_memory;
+		while (used_memory > maxmemory)
+		{
+			int dbid;
+			dictEntry *de = evictionPoolBestKey(&dbid);
+
+			dictDelete(db.dictionary, dictGetKey(de));
+			evictions++;
+		}
+		freed += before - used_memory;
+		evict_us += realtime() - t;
+	}
+	printf("%-16s storm  %6.0f ns/eviction  %6.1f ns/KB freed\n", name,
+		evict_us * 1000.0 / evictions, evict_us * 1000.0 / (freed / 1024.0));
+	dictRelease(db.dictionary);
+	used_memory = 0;
+}
+
+static void tick(void)
+{
+	now_us += ACCESS_US;
+	server.lruclock = getLRUClock();
+	server.unixtime = now_us / 1000000;
+}
+
+static robj *createString(size_t len)
+{
+	robj *o = (robj*)zcalloc(sizeof(robj));
+
+	o->type = OBJ_STRING;
+	o->encoding = OBJ_ENCODING_RAW;
+	o->refcount = 1;
+	o->ptr = zmalloc(len);
+	*(size_t*)o->ptr = len;
+	objectInitLRUOrLFU(o);
+	return o;
+}
+
+/* Eviction of big values: 16 hashes of 'fields' fields, written an hour
+before 200k strings of 100 bytes to 1KB, so that LRU picks the hashes
+among the first keys it evicts. 200k more strings are then written under
+maxmemory, with a freeMemoryIfNeeded() call after every write as the
+server would do. A hash freed in place stalls the write that evicts it.
+With lazy eviction it goes to the lazy free thread, and its memory counts
+as freed while the thread releases it. 'memory' is the memory used once
+the thread is done, against maxmemory: the keys evicted in excess. */
+static void bigvalues(const char *name, int lazy, unsigned long fields)
+{
+	redisDb db;
+	long long worst = 0, total = 0, evicted = server.stat_evictedkeys;
+	long long lazy_evicted = server.stat_lazyfree_evictions;
+	char buf[64];
+
+	db.dictionary = dictCreate(keyspaceType, NULL);
+	db.expires = dictCreate(expiresType, NULL);
+	expireIndexInit(&db);
+	server.db = &db;
+	server.maxmemory = 0;
+	server.maxmemory_policy = MAXMEMORY_ALLKEYS_LRU;
+	server.lazyfree_lazy_eviction = lazy;
+	evictionPoolAlloc();
+	for (int h = 0; h < 16; h++)
+	{
+		robj *o = (robj*)zcalloc(sizeof(robj));
+		dict *d = dictCreate(hashType, NULL);
+
+		for (unsigned long f = 0; f < fields; f++)
+		{
+			int flen = snprintf(buf, sizeof(buf), "field:%lu", f);
+			sds field = sdsnewlen(buf, flen);
+			int vlen = snprintf(buf, sizeof(buf), "value:%lu", f * 7);
+
+			dictAdd(d, field, sdsnewlen(buf, vlen));
+		}
+		o->type = OBJ_HASH;
+		o->encoding = OBJ_ENCODING_HT;
+		o->refcount = 1;
+		o->ptr = d;
+		objectInitLRUOrLFU(o);
+		dictAdd(db.dictionary, sdsnewlen(buf, snprintf(buf, sizeof(buf), "hash:%d", h)), o);
+	}
+	now_us += 3600LL * 1000000;
+	for (unsigned long j = 0; j < 400000; j++)
+	{
+		int klen = snprintf(buf, sizeof(buf), "string:%lu", j);
+
+		tick();
+		dictAdd(db.dictionary, sdsnewlen(buf, klen), createString(100 + xorshift() % 925));
+		if (j == 199999)
+			server.maxmemory = zmalloc_used_memory();
+		if (j < 200000)
+			continue;
+
+		long long t = realtime(), elapsed;
+
+		freeMemoryIfNeeded();
+		elapsed = realtime() - t;
+		total += elapsed;
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+	while (server.bio.waitStepOfType(BIO_LAZY_FREE))
+		;
+	printf("%-16s max stall %8.2f ms  avg %5.2f us  evicted %6lld keys (%2lld lazy)  memory %+.2f%%\n",
+		name, worst / 1000.0, total / 200000.0, server.stat_evictedkeys - evicted,
+		server.stat_lazyfree_evictions - lazy_evicted,
+		((double)zmalloc_used_memory() - server.maxmemory) * 100.0 / server.maxmemory);
+	dictRelease(db.expires);
+	dictRelease(db.dictionary);
+	zfree(db.expires_index);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long capacity = argc > 1 ? atol(argv[1]) : 50000;
+	double sum = 0;
+
+	zipf = (double*)malloc(sizeof(double) * NUM_KEYS);
+	for (long j = 0; j < NUM_KEYS; j++)
+		zipf[j] = (sum += 1.0 / pow(j + 1, 0.9));
+	for (long j = 0; j < NUM_KEYS; j++)
+		zipf[j] /= sum;
+
+	server.hz = 10;
+	server.dbnum = 1;
+	server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+	server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
+	now_us = 1000000000LL * 1000000;
+	server.bio.init(CONFIG_DEFAULT_BIO_THREADS);
+	if (argc > 2 && !strcmp(argv[2], "bigvalues"))
+	{
+		bigvalues("sync", 0, 1000000);
+		bigvalues("lazy", 1, 1000000);
+		return 0;
+	}
+	storm("allkeys-lru", MAXMEMORY_ALLKEYS_LRU, 1000000, 1000000);
+	storm("allkeys-lfu", MAXMEMORY_ALLKEYS_LFU, 1000000, 1000000);
+	if (argc > 2 && !strcmp(argv[2], "storm"))
+		return 0;
+	for (int scan = 0; scan <= 30; scan += 30)
+	{
+		run("allkeys-lru", MAXMEMORY_ALLKEYS_LRU, 0, capacity, scan);
+		run("allkeys-lfu", MAXMEMORY_ALLKEYS_LFU, CONFIG_DEFAULT_LFU_LOG_FACTOR, capacity, scan);
+		run("allkeys-lfu/1", MAXMEMORY_ALLKEYS_LFU, 1, capacity, scan);
+		run("allkeys-lfu/100", MAXMEMORY_ALLKEYS_LFU, 100, capacity, scan);
+		server.tinylfu_sketch_bytes = CONFIG_DEFAULT_TINYLFU_SKETCH_BYTES;
+		run("lru-tinylfu", MAXMEMORY_ALLKEYS_LRU_TINYLFU, 0, capacity, scan);
+		server.tinylfu_sketch_bytes = 16 * 1024;
+		run("lru-tinylfu/16k", MAXMEMORY_ALLKEYS_LRU_TINYLFU, 0, capacity, scan);
+	}
+	return 0;
+}
@@ -0,0 +1,279 @@
+/* Active expiry of a session store: how long the dead keys stay in memory
+and the time the cron spends to delete them, with the expires index of
+expire.cpp against the random sampling of the expires dict that Redis
+used before it ("sampling": 20 keys at a time, again while more than a
+quarter of them expired, within 25% of the cron period).
+
+'steady' writes 50k sessions per second with a TTL of 5 to 15 seconds for
+60 seconds, and reports the keys whose time passed still in memory at
+every cron call after the first 20 seconds. 'wave' sets 1M keys to expire
+at the same millisecond, and reports the longest cron call and the time
+to delete them all.
+
+Time is simulated, the cron runs every 100 ms of it. The cron calls are
+measured with the real clock, that also drives their time limit.
+
+g++ -O2 -pthread -I../src expire_bench.cpp -o expire_bench
+./expire_bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <malloc.h>
+using namespace std;
+
+#define BENCH_SERVER
+#include "bench_stubs.h"
+
+/* Simulated time, plus the real time elapsed in the cron call running. */
+static long long now_us, cron_start;
+
+long long ustime(void)
+{
+	return now_us + (cron_start ? realtime() - cron_start : 0);
+}
+
+void decrRefCount(robj *o)
+{
+	zfree(o->ptr);
+	zfree(o);
+}
+
+#define CRON_US 100000
+
+static uint64_t keyHash(const void *key)
+{
+	return dictGenFastHashFunction(key, sdslen((sds)key));
+}
+
+static int keyCompare(void *privdata, const void *key1, const void *key2)
+{
+	return sdslen((sds)key1) == sdslen((sds)key2) &&
+		memcmp(key1, key2, sdslen((sds)key1)) == 0;
+}
+
+static void keyDestructor(void *privdata, void *key)
+{
+	sdsfree((sds)key);
+}
+
+static void valDestructor(void *privdata, void *val)
+{
+	if (val)
+		decrRefCount((robj*)val);
+}
+
+static dictType keyspaceType = {keyHash, NULL, NULL, keyCompare, keyDestructor, valDestructor, 0};
+static dictType expiresType = {keyHash, NULL, NULL, keyCompare, NULL, NULL, 0};
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t xorshift(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+/* The expire cycle of Redis before the index: sample 20 keys with an
+expire at random, and sample again as long as more than 5 of them were
+expired, within 25% of the cron period. */
+#define SAMPLING_KEYS_PER_LOOP 20
+
+static void samplingExpireCycle(void)
+{
+	long long start = ustime(), timelimit = 1000000 / server.hz / 4;
+	int iteration = 0;
+
+	for (int j = 0; j < server.dbnum; j++)
+	{
+		redisDb *db = &server.db[j];
+		unsigned long expired;
+
+		do
+		{
+			unsigned long num = dictSize(db->expires);
+			long long now = ustime() / 1000;
+
+			if (num == 0)
+				break;
+			if (num > SAMPLING_KEYS_PER_LOOP)
+				num = SAMPLING_KEYS_PER_LOOP;
+			expired = 0;
+			while (num--)
+			{
+				dictEntry *de = evictionRandomEntry(db->expires);
+				expireEntry *ee = (expireEntry*)dictGetVal(de);
+
+				if (ee->when <= now)
+				{
+					deleteExpiredKey(db, ee->key);
+					expired++;
+				}
+			}
+			if (++iteration % 16 == 0 && ustime() - start > timelimit)
+			{
+				server.stat_expired_time_cap_reached_count++;
+				return;
+			}
+		}
+		while (expired > SAMPLING_KEYS_PER_LOOP / 4);
+	}
+}
+
+static void createDb(redisDb *db)
+{
+	db->dictionary = dictCreate(keyspaceType, NULL);
+	db->expires = dictCreate(expiresType, NULL);
+	expireIndexInit(db);
+	server.db = db;
+	server.stat_expiredkeys = 0;
+	server.stat_expired_time_cap_reached_count = 0;
+}
+
+static void freeExpireEntry(void *privdata, const dictEntry *de)
+{
+	zfree(dictGetVal(de));
+}
+
+static void releaseDb(redisDb *db)
+{
+	unsigned long cursor = 0;
+
+	do
+		cursor = dictScan(db->expires, cursor, freeExpireEntry, NULL);
+	while (cursor);
+	dictRelease(db->expires);
+	dictRelease(db->dictionary);
+	zfree(db->expires_index);
+}
+
+/* SET key <100 bytes> PX ttl. Returns the time the write took. */
+static long long setex(redisDb *db, unsigned long id, long long ttl_ms)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "session:%lu", id);
+	robj *o = (robj*)zcalloc(sizeof(robj));
+	sds key = sdsnewlen(buf, len);
+	long long t = realtime();
+
+	o->type = OBJ_STRING;
+	o->encoding = OBJ_ENCODING_RAW;
+	o->refcount = 1;
+	o->ptr = zmalloc(100);
+	dictAdd(db->dictionary, key, o);
+	setExpire(db, key, now_us / 1000 + ttl_ms);
+	return realtime() - t;
+}
+
+/* A cron call, returns its real time. */
+static long long cron(int sampling)
+{
+	long long elapsed;
+
+	cron_start = realtime();
+	if (sampling)
+		samplingExpireCycle();
+	else
+		activeExpireCycle();
+	elapsed = realtime() - cron_start;
+	cron_start = 0;
+	return elapsed;
+}
+
+#define STEADY_SECONDS 60
+#define STEADY_WARMUP 20
+#define STEADY_RATE 50000
+
+static void steady(const char *name, int sampling)
+{
+	redisDb db;
+	/* Keys due by every simulated ms, to count the dead keys. */
+	vector<long long> due((STEADY_SECONDS + 16) * 1000, 0);
+	long long start = now_us, due_sum = 0, set_us = 0, cron_us = 0, worst = 0;
+	long long dead_sum = 0, dead_max = 0, samples = 0, last_ms = 0;
+	unsigned long id = 0;
+
+	createDb(&db);
+	for (long long c = 0; c < STEADY_SECONDS * 1000000LL / CRON_US; c++)
+	{
+		long long elapsed, now_ms;
+
+		for (int w = 0; w < STEADY_RATE / (1000000 / CRON_US); w++)
+		{
+			long long ttl = 5000 + xorshift() % 10000;
+
+			now_us += CRON_US / (STEADY_RATE / (1000000 / CRON_US));
+			set_us += setex(&db, id++, ttl);
+			due[(now_us - start) / 1000 + ttl]++;
+		}
+		elapsed = cron(sampling);
+		now_ms = (now_us - start) / 1000;
+		while (last_ms <= now_ms)
+			due_sum += due[last_ms++];
+		if (now_us - start < STEADY_WARMUP * 1000000LL)
+			continue;
+		cron_us += elapsed;
+		if (elapsed > worst)
+			worst = elapsed;
+		long long dead = due_sum - server.stat_expiredkeys;
+		dead_sum += dead;
+		if (dead > dead_max)
+			dead_max = dead;
+		samples++;
+	}
+	printf("%-9s steady  dead keys avg %7.0f max %7lld of %7lu  cron %5.2f%% cpu  max %6.2f ms  set %.0f ns\n",
+		name, (double)dead_sum / samples, dead_max, dictSize(db.dictionary),
+		cron_us * 100.0 / (samples * CRON_US), worst / 1000.0,
+		set_us * 1000.0 / id);
+	releaseDb(&db);
+}
+
+#define WAVE_KEYS 1000000
+
+static void wave(const char *name, int sampling)
+{
+	redisDb db;
+	long long at, worst = 0, calls = 0;
+
+	createDb(&db);
+	at = now_us / 1000 + 1000;
+	for (unsigned long id = 0; id < WAVE_KEYS; id++)
+		setex(&db, id, at - now_us / 1000);
+	now_us = at * 1000;
+	while (dictSize(db.dictionary) && calls < 100000)
+	{
+		long long elapsed = cron(sampling);
+
+		if (elapsed > worst)
+			worst = elapsed;
+		calls++;
+		now_us += CRON_US;
+	}
+	printf("%-9s wave    %lu keys left  max cron %6.2f ms  %5lld cron calls (%lld out of time) to delete %d keys\n",
+		name, dictSize(db.dictionary), worst / 1000.0, calls,
+		server.stat_expired_time_cap_reached_count, WAVE_KEYS);
+	releaseDb(&db);
+}
+
+int main(int argc, char **argv)
+{
+	/* The server allocates with jemalloc. Without fastbins glibc does not
+	consolidate the chunks of a million freed keys in the first large
+	malloc() after them, a stall of 150 ms the server does not have. */
+	mallopt(M_MXFAST, 0);
+	server.hz = 1000000 / CRON_US;
+	server.dbnum = 1;
+	server.active_expire_max_cpu = CONFIG_DEFAULT_ACTIVE_EXPIRE_MAX_CPU;
+	server.lazyfree_lazy_expire = 0;
+	now_us = 1000000000LL * 1000000;
+	steady("sampling", 1);
+	steady("index", 0);
+	wave("sampling", 1);
+	wave("index", 0);
+	return 0;
+}
@@ -0,0 +1,86 @@
+/* Benchmark of the dict hash functions over key lengths from 8 bytes to
+1KB: SipHash-1-2 (dictGenHashFunction), the fast seeded hash
+(dictGenFastHashFunction, with AES-NI when the CPU has it, and the wyhash
+fallback forced), and the integer mixer for 8 byte keys.
+
+Every hash feeds the next key, so that the numbers are latencies, as in a
+lookup, and not throughputs of independent hashes.
+
+g++ -O2 -I../src hash_bench.cpp -o hash_bench
+./hash_bench 10000000 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* dict.c is built against zmalloc.h in the server. */
+static void *zmalloc(size_t size) { return malloc(size); }
+static void *zcalloc(size_t size) { return calloc(1, size); }
+static void zfree(void *ptr) { free(ptr); }
+
+#include "siphash.c"
+#include "dict.c"
+
+static long long ustime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static uint64_t wyhashOnly(const void *key, int len)
+{
+	return _dictWyhash(key, len, _dictRead64(dict_hash_function_seed));
+}
+
+static uint64_t intMixer(const void *key, int len)
+{
+	return dictGenIntHashFunction(_dictRead64((const uint8_t*)key));
+}
+
+static void bench(const char *name, uint64_t (*hash)(const void*, int),
+	uint8_t *buf, int len, long count)
+{
+	long long start = ustime(), elapsed;
+	uint64_t h = 0;
+
+	for (long j = 0; j < count; j++)
+	{
+		memcpy(buf, &h, sizeof(h));
+		h = hash(buf, len);
+	}
+	elapsed = ustime() - start;
+	printf("  %-8s %6.1f ns %7.2f GB/s", name, elapsed * 1000.0 / count,
+		(double)len * count / elapsed / 1000.0);
+	if (h == 42)
+		printf("!");
+}
+
+int main(int argc, char **argv)
+{
+	long count = argc > 1 ? atol(argv[1]) : 10000000;
+	uint8_t seed[16], *buf = (uint8_t*)malloc(1024);
+
+	for (int j = 0; j < 16; j++)
+		seed[j] = rand();
+	for (int j = 0; j < 1024; j++)
+		buf[j] = rand();
+	dictSetHashFunctionSeed(seed);
+	dictGenFastHashFunction(buf, 8); /* Resolve the CPU dispatch. */
+	printf("fast hash: %s\n", dict_fast_hash == _dictWyhash ? "wyhash" : "aes");
+
+	for (int len = 8; len <= 1024; len *= 2)
+	{
+		long n = len > 64 ? count / (len / 64) : count;
+
+		printf("%5d bytes", len);
+		bench("siphash", dictGenHashFunction, buf, len, n);
+		bench("fast", dictGenFastHashFunction, buf, len, n);
+		bench("wyhash", wyhashOnly, buf, len, n);
+		if (len == 8)
+			bench("int", intMixer, buf, len, n);
+		printf("\n");
+	}
+	free(buf);
+	return 0;
+}
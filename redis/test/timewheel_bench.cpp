@@ -0,0 +1,89 @@
+/* Benchmark of the timing wheel used for the event loop time events with
+1M timers, against the linked list search of the nearest timer it replaced.
+
+g++ -O2 -I../src timewheel_bench.cpp ../src/timewheel.cpp -o timewheel_bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "timewheel.h"
+
+#define NUM_TIMERS 1000000
+
+static long long ustime(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+int main()
+{
+	twWheel *wheel = new twWheel();
+	twTimer *timers = new twTimer[NUM_TIMERS];
+	long long now = 1000, start, elapsed;
+	long long fired = 0, wakeups = 0;
+
+	srand(1);
+	twInit(wheel, now);
+
+	/* Mix of short deadlines and idle timeouts, up to one hour. */
+	start = ustime();
+	for (int j = 0; j < NUM_TIMERS; j++)
+	{
+		timers[j].when = now + 1 + (j % 2 ? rand() % 1000 : rand() % 3600000);
+		twAdd(wheel, &timers[j]);
+	}
+	elapsed = ustime() - start;
+	printf("insert:  %.1f ns/timer\n", elapsed * 1000.0 / NUM_TIMERS);
+
+	start = ustime();
+	for (int j = 0; j < NUM_TIMERS; j += 4)
+		twCancel(wheel, &timers[j]);
+	elapsed = ustime() - start;
+	printf("cancel:  %.1f ns/timer\n", elapsed * 1000.0 / (NUM_TIMERS / 4));
+
+	start = ustime();
+	for (int j = 0; j < 1000000; j++)
+		twNextTimeout(wheel, now);
+	elapsed = ustime() - start;
+	printf("next timeout: %.1f ns/call\n", elapsed * 1000.0 / 1000000);
+
+	/* Old design: scan every timer to find the nearest one. */
+	start = ustime();
+	long long nearest = -1;
+	for (int j = 0; j < NUM_TIMERS; j++)
+		if (j % 4 && (nearest == -1 || timers[j].when < nearest))
+			nearest = timers[j].when;
+	elapsed = ustime() - start;
+	printf("next timeout, list scan: %.1f ns/call (nearest %lld)\n",
+		elapsed * 1000.0, nearest);
+
+	/* Run the clock like the event loop would, sleeping until the next
+	timeout every time. */
+	start = ustime();
+	while (wheel->count)
+	{
+		twTimer expired;
+		long long timeout = twNextTimeout(wheel, now);
+
+		now += timeout;
+		twListInit(&expired);
+		twExpire(wheel, now, &expired);
+		while (!twListEmpty(&expired))
+		{
+			twTimer *timer = expired.next;
+			twCancel(wheel, timer);
+			if (timer->when > now)
+			{
+				printf("timer fired early!\n");
+				return 1;
+			}
+			fired++;
+		}
+		wakeups++;
+	}
+	elapsed = ustime() - start;
+	printf("expire:  %.1f ns/timer (%lld timers, %lld wakeups)\n",
+		elapsed * 1000.0 / fired, fired, wakeups);
+	return 0;
+}